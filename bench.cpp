@@ -0,0 +1,351 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "compression.h"
+#include "framer.h"
+#include "history.h"
+#include "protocol.h"
+#include "shared_buffer.h"
+#include "slot_map.h"
+#include "text_scan.h"
+#include "timing_wheel.h"
+
+#define BENCH_MIN_SECONDS 0.2   // each benchmark runs at least this long
+
+using namespace std;
+
+// every heap allocation of the process goes through these, so a benchmark can
+// report how many allocations and bytes one operation costs; kept out of line so
+// the compiler does not pair the inlined malloc/free against the new/delete calls
+static size_t allocation_count = 0;
+static size_t allocation_bytes = 0;
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocation_count++;
+    allocation_bytes += size;
+    void *memory = malloc(size ? size : 1);
+    if (!memory) throw bad_alloc();
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept { free(memory); }
+
+// keep the optimizer from discarding a result
+template <typename T>
+inline void keep(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// run body (which performs ops_per_call operations) until BENCH_MIN_SECONDS have passed
+template <typename F>
+void bench(const char *name, size_t ops_per_call, F &&body) {
+    body();  // warm up caches and lazily sized buffers
+
+    size_t calls = 0;
+    size_t allocs_before = allocation_count;
+    size_t bytes_before = allocation_bytes;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    size_t batch = 1;
+    while (elapsed < BENCH_MIN_SECONDS) {
+        for (size_t i = 0; i < batch; i++) body();
+        calls += batch;
+        batch *= 2;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    double ops = static_cast<double>(calls) * ops_per_call;
+    printf("%-34s %10.1f ns/op %8.2f allocs/op %10.1f bytes/op\n", name, elapsed * 1e9 / ops,
+           (allocation_count - allocs_before) / ops, (allocation_bytes - bytes_before) / ops);
+}
+
+// a burst of pipelined MSG commands as a bot would send them
+string make_burst(size_t lines, size_t text_length) {
+    string burst;
+    for (size_t i = 0; i < lines; i++) {
+        burst += "MSG ";
+        burst.append(text_length, static_cast<char>('a' + i % 26));
+        burst += " \r\n";
+    }
+    return burst;
+}
+
+void bench_framer() {
+    const size_t lines = 64;
+    string burst = make_burst(lines, 80);
+
+    // the whole burst arrives in one read
+    LineFramer framer;
+    bench("framer: 64 lines in one read", lines, [&]() {
+        framer.append(burst.data(), burst.size());
+        string_view line;
+        while (framer.next_line(line)) keep(line);
+    });
+
+    // the same burst arrives in 100-byte reads, so most lines are split
+    LineFramer split;
+    bench("framer: 64 lines in 100-byte reads", lines, [&]() {
+        for (size_t offset = 0; offset < burst.size(); offset += 100) {
+            split.append(burst.data() + offset, min<size_t>(100, burst.size() - offset));
+            string_view line;
+            while (split.next_line(line)) keep(line);
+        }
+    });
+}
+
+void bench_parse() {
+    string short_line = "MSG hello everyone  \r";
+    string long_line = "MSG " + string(250, 'x') + "\t \r";
+    bench("parse_msg_command: short", 1, [&]() {
+        string_view message;
+        keep(parse_msg_command(short_line, message));
+        keep(message);
+    });
+    bench("parse_msg_command: 255 chars", 1, [&]() {
+        string_view message;
+        keep(parse_msg_command(long_line, message));
+        keep(message);
+    });
+}
+
+void bench_nick() {
+    string line = "NICK Alice_1234\r";
+    bench("parse_nick_command + validate", 1, [&]() {
+        keep(valid_nickname(parse_nick_command(line)));
+    });
+}
+
+void bench_format() {
+    string text(120, 'm');
+    bench("format_msg: 120 chars", 1, [&]() {
+        BufferRef formatted(format_msg("Alice_1234", text));
+        keep(formatted.get());
+    });
+}
+
+void bench_frames() {
+    const size_t count = 64;
+    vector<string> texts(count, string(80, 'f'));
+    vector<string_view> messages(texts.begin(), texts.end());
+    uint32_t sender = 42;
+    bench("format_frame_msg: 64 messages", count, [&]() {
+        BufferRef frame(format_frame_msg(&sender, "#general", messages.data(), count));
+        keep(frame.get());
+    });
+    bench("format_msgs: 64 lines", count, [&]() {
+        BufferRef lines(format_msgs("Alice_1234", "#general", messages.data(), count));
+        keep(lines.get());
+    });
+
+    // the client's frame, as the server takes it out of the framer
+    BufferRef frame(format_frame_msg(nullptr, "#general", messages.data(), count));
+    LineFramer framer(MAX_FRAME_LENGTH, MAX_FRAME_LENGTH);
+    bench("next_frame + parse: 64 messages", count, [&]() {
+        framer.append(frame->view().data(), frame->size());
+        string_view input, room, encoded, text;
+        while (framer.next_frame(input, MAX_FRAME_LENGTH)) {
+            keep(parse_frame_msg(input.substr(1), room, encoded));
+            while (next_frame_message(encoded, text)) keep(text);
+        }
+    });
+}
+
+void bench_compression() {
+    // a broadcast of chat lines that differ in sender and text, like a busy room
+    const size_t count = 64;
+    vector<BufferRef> lines;
+    vector<string_view> parts;
+    for (size_t i = 0; i < count; i++) {
+        string text = "message number " + to_string(i) + " about the release on friday";
+        lines.emplace_back(format_room_msg(i % 2 ? "Alice_1234" : "bob", "#general", text));
+        parts.push_back(lines.back()->view());
+    }
+
+    // deflate-shared: a loop iteration's output as one chunk that stands on its own,
+    // compressed once for every client that got the same lines; a quiet room sends
+    // single lines, which deflate does not shrink and go out as stored blocks
+    Deflater shared(6, true);
+    size_t shared_bytes = 0, single_bytes = 0;
+    bench("deflate-shared: 64 lines in one chunk", count, [&]() {
+        BufferRef chunk(shared.compress(parts.data(), count));
+        shared_bytes = chunk->size();
+    });
+    bench("deflate-shared: 64 one-line chunks", count, [&]() {
+        single_bytes = 0;
+        for (string_view &part : parts) {
+            BufferRef chunk(shared.compress(&part, 1));
+            single_bytes += chunk->size();
+        }
+    });
+
+    // deflate: one connection's context, flushed once per batch of lines
+    Deflater connection(6, false);
+    bench("deflate: 64 lines in one chunk", count, [&]() {
+        BufferRef chunk(connection.compress(parts.data(), count));
+        keep(chunk.get());
+    });
+
+    // sizes from a fresh context; the one above has long seen these lines. The first
+    // chunk of a connection refers to nothing before it, so a fresh receiver can
+    // inflate it again and again
+    Deflater sender(6, false);
+    BufferRef chunk(sender.compress(parts.data(), count));
+    size_t plain_bytes = 0;
+    for (string_view &part : parts) plain_bytes += part.size();
+    printf("  64 lines: %zu bytes plain, %zu deflate-shared (%zu one line a chunk), %zu deflate\n", plain_bytes,
+           shared_bytes, single_bytes, chunk->size());
+
+    char out[16384];
+    bench("inflate: 64 lines", count, [&]() {
+        StreamInflater receiver;
+        receiver.feed(chunk->view().data(), chunk->size());
+        while (receiver.read(out, sizeof(out)) > 0) keep(out[0]);
+    });
+}
+
+void bench_registry() {
+    const size_t clients = 10000;
+    SlotMap<int*> registry;
+    vector<SlotHandle> handles(clients);
+    int value = 0;
+    for (size_t i = 0; i < clients; i++) handles[i] = registry.insert(&value);
+
+    size_t next = 0;
+    bench("slot_map: remove + insert", 1, [&]() {
+        registry.erase(handles[next]);
+        handles[next] = registry.insert(&value);
+        next = (next + 1) % clients;
+    });
+
+    bench("slot_map: iterate (per entry)", clients, [&]() {
+        for (int *entry : registry) keep(entry);
+    });
+
+    bench("slot_map: lookup", 1, [&]() {
+        keep(registry.get(handles[next]));
+        next = (next + 7) % clients;
+    });
+}
+
+void bench_history() {
+    History history(64);
+    BufferRef line(format_room_msg("Alice_1234", "#general", string(120, 'h')));
+    uint64_t time_ns = 0;
+    bench("history: add line", 1, [&]() {
+        history.add(++time_ns, line->view());
+    });
+    bench("history: collect 50 lines", 50, [&]() {
+        size_t lines;
+        BufferRef replay(history.collect(50, 0, lines));
+        keep(replay.get());
+    });
+}
+
+void bench_pools() {
+    size_t capacity;
+    bench("buffer_pool: acquire + release 4 KiB", 1, [&]() {
+        char *buffer = buffer_pool_acquire(4096, capacity);
+        keep(buffer);
+        buffer_pool_release(buffer, capacity);
+    });
+    bench("object_pool: allocate + free 320 B", 1, [&]() {
+        void *object = object_pool_allocate(320);
+        keep(object);
+        object_pool_deallocate(object, 320);
+    });
+}
+
+void bench_timers() {
+    // 100k connection timers of 10 ms ticks spread over a minute, like idle deadlines
+    const size_t count = 100000;
+    const uint64_t tick = 10000000, minute = 60000000000ull;
+    vector<WheelTimer> timers(count);
+    TimingWheel wheel(tick, 0);
+    uint64_t now = 0;
+    for (size_t i = 0; i < count; i++) wheel.schedule(timers[i], now + (i * 7919 % count) * (minute / count));
+
+    size_t next = 0;
+    bench("timing_wheel: reschedule", 1, [&]() {
+        wheel.schedule(timers[next], now + minute + (next * 7919 % count) * (minute / count));
+        next = (next + 1) % count;
+    });
+
+    // each round turns the wheel a minute further, every timer expires and is set again
+    size_t expired = 0;
+    bench("timing_wheel: expire + reschedule", count, [&]() {
+        uint64_t until = now + minute;
+        for (; now < until; now += 100 * tick) {
+            wheel.advance(now, [&](WheelTimer &timer) {
+                expired++;
+                wheel.schedule(timer, now + minute);
+            });
+        }
+    });
+    keep(expired);
+}
+
+void bench_text_scan() {
+    // a large pasted message, in ASCII and in text with 2, 3 and 4 byte sequences
+    string ascii = "MSG " + string(2000, 'x') + " \r\n";
+    string utf8 = "MSG ";
+    while (utf8.size() < 2000) utf8 += "gr\xC3\xBC\xC3\x9F""e, \xE4\xB8\x96\xE7\x95\x8C \xF0\x9F\x98\x80 ";
+    utf8 += " \r\n";
+    string burst = make_burst(64, 80);
+
+    // what every line cost before the kernels, finding the '\n' and the trailing
+    // whitespace without checking UTF-8
+    bench("memchr + trim: 2000 ASCII bytes", 1, [&]() {
+        string_view line(ascii.data(), static_cast<const char*>(memchr(ascii.data(), '\n', ascii.size())) - ascii.data());
+        keep(line.find_last_not_of(" \n\r\t"));
+    });
+
+    string best = text_scan_kernel();
+    for (const char *kernel : {"scalar", "ssse3", "avx2"}) {
+        if (!use_text_scan_kernel(kernel)) continue;
+        string name = string("scan_line ") + kernel + ": 2000 ASCII bytes";
+        bench(name.c_str(), 1, [&]() {
+            LineScan scan;
+            keep(scan_line(ascii.data(), ascii.size(), scan));
+            keep(scan);
+        });
+        name = string("scan_line ") + kernel + ": 2000 UTF-8 bytes";
+        bench(name.c_str(), 1, [&]() {
+            LineScan scan;
+            keep(scan_line(utf8.data(), utf8.size(), scan));
+            keep(scan);
+        });
+        name = string("framer ") + kernel + ": 64 lines in one read";
+        LineFramer framer;
+        bench(name.c_str(), 64, [&]() {
+            framer.append(burst.data(), burst.size());
+            string_view line;
+            LineScan scan;
+            while (framer.next_line(line, scan)) keep(scan);
+        });
+    }
+    use_text_scan_kernel(best.c_str());
+}
+
+int main() {
+    printf("%-34s %13s %18s %19s\n", "kernel", "time", "allocations", "allocated");
+    bench_framer();
+    bench_parse();
+    bench_nick();
+    bench_format();
+    bench_frames();
+    bench_compression();
+    bench_registry();
+    bench_history();
+    bench_pools();
+    bench_timers();
+    bench_text_scan();
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "buffer_pool.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#define OBJECT_SLOT_SHIFT 6      // slot sizes are multiples of 64 bytes
+#define OBJECT_SLOT_CLASSES 16   // up to 1 KiB
+#define OBJECT_SLAB_BYTES 65536
+
+using namespace std;
+
+namespace {
+
+// a free buffer or slot, linked through its first bytes
+struct FreeNode {
+    FreeNode *next;
+};
+
+// free buffers of one thread by class; given back to the system when the thread ends
+struct BufferCache {
+    FreeNode *free[BUFFER_POOL_CLASSES] = {};
+    size_t cached[BUFFER_POOL_CLASSES] = {};
+
+    ~BufferCache();
+};
+
+// free slots of one thread by class, and what is left of its current slab
+struct ObjectCache {
+    FreeNode *free[OBJECT_SLOT_CLASSES] = {};
+    char *slab = nullptr;
+    size_t slab_left = 0;
+};
+
+thread_local BufferCache buffer_cache;
+thread_local ObjectCache object_cache;
+
+atomic<uint64_t> buffers_borrowed(0);
+atomic<uint64_t> buffers_cached(0);
+atomic<uint64_t> slab_bytes(0);
+atomic<uint64_t> slots_used(0);
+
+BufferCache::~BufferCache() {
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        while (FreeNode *node = free[i]) {
+            free[i] = node->next;
+            std::free(node);
+        }
+        buffers_cached -= cached[i];
+    }
+}
+
+// the smallest class holding size bytes, BUFFER_POOL_CLASSES if none does
+int buffer_class(size_t size) {
+    int index = 0;
+    while (index < BUFFER_POOL_CLASSES && (size_t(1) << (BUFFER_POOL_MIN_SHIFT + index)) < size) index++;
+    return index;
+}
+
+}  // namespace
+
+char *buffer_pool_acquire(size_t size, size_t &capacity) {
+    int index = buffer_class(size);
+    if (index == BUFFER_POOL_CLASSES) {
+        capacity = size;
+    } else {
+        capacity = size_t(1) << (BUFFER_POOL_MIN_SHIFT + index);
+        if (FreeNode *node = buffer_cache.free[index]) {
+            buffer_cache.free[index] = node->next;
+            buffer_cache.cached[index] -= capacity;
+            buffers_cached.fetch_sub(capacity, memory_order_relaxed);
+            buffers_borrowed.fetch_add(capacity, memory_order_relaxed);
+            return reinterpret_cast<char*>(node);
+        }
+    }
+    char *buffer = static_cast<char*>(malloc(capacity));
+    if (!buffer) throw std::bad_alloc();
+    buffers_borrowed.fetch_add(capacity, memory_order_relaxed);
+    return buffer;
+}
+
+void buffer_pool_release(char *buffer, size_t capacity) {
+    if (!buffer) return;
+    buffers_borrowed.fetch_sub(capacity, memory_order_relaxed);
+    int index = buffer_class(capacity);
+    if (index == BUFFER_POOL_CLASSES || buffer_cache.cached[index] + capacity > BUFFER_POOL_CACHE_BYTES) {
+        free(buffer);
+        return;
+    }
+    auto *node = reinterpret_cast<FreeNode*>(buffer);
+    node->next = buffer_cache.free[index];
+    buffer_cache.free[index] = node;
+    buffer_cache.cached[index] += capacity;
+    buffers_cached.fetch_add(capacity, memory_order_relaxed);
+}
+
+BufferPoolStats buffer_pool_stats() {
+    BufferPoolStats stats;
+    stats.borrowed = buffers_borrowed.load(memory_order_relaxed);
+    stats.cached = buffers_cached.load(memory_order_relaxed);
+    return stats;
+}
+
+void *object_pool_allocate(size_t size) {
+    size_t index = (size + (size_t(1) << OBJECT_SLOT_SHIFT) - 1) >> OBJECT_SLOT_SHIFT;
+    if (index == 0) index = 1;
+    if (index > OBJECT_SLOT_CLASSES) {
+        void *object = malloc(size);
+        if (!object) throw std::bad_alloc();
+        return object;
+    }
+    size_t slot = index << OBJECT_SLOT_SHIFT;
+    slots_used.fetch_add(slot, memory_order_relaxed);
+    if (FreeNode *node = object_cache.free[index - 1]) {
+        object_cache.free[index - 1] = node->next;
+        return node;
+    }
+    if (object_cache.slab_left < slot) {
+        // the tail of the old slab is too small for this class and stays unused
+        object_cache.slab = static_cast<char*>(aligned_alloc(size_t(1) << OBJECT_SLOT_SHIFT, OBJECT_SLAB_BYTES));
+        if (!object_cache.slab) throw std::bad_alloc();
+        object_cache.slab_left = OBJECT_SLAB_BYTES;
+        slab_bytes.fetch_add(OBJECT_SLAB_BYTES, memory_order_relaxed);
+    }
+    void *object = object_cache.slab;
+    object_cache.slab += slot;
+    object_cache.slab_left -= slot;
+    return object;
+}
+
+void object_pool_deallocate(void *object, size_t size) {
+    if (!object) return;
+    size_t index = (size + (size_t(1) << OBJECT_SLOT_SHIFT) - 1) >> OBJECT_SLOT_SHIFT;
+    if (index == 0) index = 1;
+    if (index > OBJECT_SLOT_CLASSES) {
+        free(object);
+        return;
+    }
+    slots_used.fetch_sub(index << OBJECT_SLOT_SHIFT, memory_order_relaxed);
+    auto *node = static_cast<FreeNode*>(object);
+    node->next = object_cache.free[index - 1];
+    object_cache.free[index - 1] = node;
+}
+
+ObjectPoolStats object_pool_stats() {
+    ObjectPoolStats stats;
+    stats.slabs = slab_bytes.load(memory_order_relaxed);
+    stats.used = slots_used.load(memory_order_relaxed);
+    return stats;
+}
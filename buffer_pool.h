@@ -0,0 +1,49 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Memory pools that keep idle connections cheap.
+//
+// I/O buffers come in power-of-two size classes from 2 KiB to 2 MiB. A connection
+// borrows one only while it has data pending and gives it back once it is idle
+// again, so a million connections that mostly sit idle share the buffers of the
+// few that are busy. Every thread keeps its own free lists, capped per class, and
+// a buffer may be given back on another thread than the one that borrowed it.
+// Larger buffers go straight to malloc.
+//
+// Connection objects come from an object pool of fixed-size slots carved out of
+// slabs, without a malloc header per object and close together in memory.
+
+#define BUFFER_POOL_MIN_SHIFT 11           // 2 KiB, the smallest class
+#define BUFFER_POOL_CLASSES 11             // up to 2 MiB
+#define BUFFER_POOL_CACHE_BYTES (2 << 20)  // free bytes a thread keeps per class
+
+// a buffer of at least size bytes; capacity is set to the size it really has
+char *buffer_pool_acquire(size_t size, size_t &capacity);
+
+// give back a buffer of buffer_pool_acquire() with the capacity it came with
+void buffer_pool_release(char *buffer, size_t capacity);
+
+struct BufferPoolStats {
+    uint64_t borrowed = 0;   // bytes of buffers handed out and not given back
+    uint64_t cached = 0;     // bytes of free buffers kept for reuse
+};
+
+BufferPoolStats buffer_pool_stats();
+
+// Connection objects: slots of size rounded up to 64 bytes, at most 1 KiB, carved
+// from 64 KiB slabs that are never returned to the system; larger sizes go to malloc.
+// Meant for class-level operator new and delete
+void *object_pool_allocate(size_t size);
+void object_pool_deallocate(void *object, size_t size);
+
+struct ObjectPoolStats {
+    uint64_t slabs = 0;      // bytes of slabs taken from the system
+    uint64_t used = 0;       // bytes of slots in use
+};
+
+ObjectPoolStats object_pool_stats();
+
+#endif
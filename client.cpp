@@ -1,10 +1,13 @@
 #include <iostream>
 #include <string>
+#include <cstring>
 #include <regex>
 #include <thread>
 #include <atomic>
 #include <csignal>
 #include <cstdlib>
+#include <cerrno>
+#include <string_view>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,15 +16,28 @@
 #include <netdb.h>
 #include <sstream>
 #include <vector>
+#include <mutex>
+#include <memory>
 
-#define MAX_MESSAGE_LENGTH 2048
-#define MAX_NAME_LENGTH 12
+#include "compression.h"
+#include "framer.h"
+#include "loadgen.h"
+#include "protocol.h"
+#include "text_scan.h"
+
+#define HANDSHAKE_BUFFER 2048
+#define RECEIVE_CHUNK 65536             // recv size of the interactive client, also its longest line
+#define RAW_RECEIVE_BUFFER (1 << 20)    // recv size and socket buffer of --raw
 
 using namespace std;
 
 atomic<bool> isRunning(true);  // controls the running state
 int serverSocket = 0;  // socket descriptor for server communication
 string username;  // client's nickname
+bool binary = false;  // speaking HELLO 2 frames instead of lines
+string compression;  // method to ask for with COMPRESS, none if empty
+mutex sendLock;  // the receiving thread also sends, keep whole frames together
+unique_ptr<StreamInflater> inflater;  // set once the server confirmed COMPRESS
 
 // flush the standard output
 void flushOutput() {
@@ -36,12 +52,12 @@ void signalHandler(int signum) {
     exit(signum);
 }
 
-// Helper function to remove the "MSG <nickname>" prefix
-string stripMessagePrefix(const string& message) {
+// Helper function to remove the "MSG <nickname>" prefix; the result views into message
+string_view stripMessagePrefix(string_view message) {
     size_t firstSpace = message.find(' ');
-    if (firstSpace == string::npos) return message;  // Return the message as-is if there's no space
+    if (firstSpace == string_view::npos) return message;  // Return the message as-is if there's no space
     size_t secondSpace = message.find(' ', firstSpace + 1);
-    if (secondSpace == string::npos) return message;  // Return the message as-is if there's no second space
+    if (secondSpace == string_view::npos) return message;  // Return the message as-is if there's no second space
 
     // Only strip if the message starts with "MSG "
     if (message.substr(0, firstSpace) == "MSG") {
@@ -52,60 +68,276 @@ string stripMessagePrefix(const string& message) {
     return message;
 }
 
-// Helper function to split a string by delimiter
-vector<string> split(const string& s, const string& delimiter) {
-    vector<string> tokens;
-    size_t start = 0, end = 0;
-    while ((end = s.find(delimiter, start)) != string::npos) {
-        tokens.push_back(s.substr(start, end - start));
-        start = end + delimiter.length();
+// append a line from the server to output the way it is printed: chat messages
+// without their "MSG <nickname>" prefix, direct messages as "*<sender>* <text>"
+void appendLine(string_view line, string &output) {
+    if (line.compare(0, 8, "PRIVMSG ") == 0) {
+        string_view sender, text;
+        if (parse_privmsg_command(line, sender, text)) {
+            output += '*';
+            output.append(sender.data(), sender.size());
+            output += "* ";
+            output.append(text.data(), text.size());
+            output += '\n';
+            return;
+        }
+    }
+    string_view strippedMessage = stripMessagePrefix(line);
+    output.append(strippedMessage.data(), strippedMessage.size());
+    output += '\n';
+}
+
+// send all of data under the send lock
+bool sendAll(const char *data, size_t length) {
+    lock_guard<mutex> guard(sendLock);
+    while (length > 0) {
+        ssize_t sent = send(serverSocket, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// answer a keepalive PING of the server, which disconnects clients that stay silent
+void sendPong() {
+    string pong = binary ? string(BufferRef(format_frame(FRAME_TEXT, {"PONG"}))->view()) : PONG_MESSAGE;
+    if (!sendAll(pong.data(), pong.size())) cerr << "error: failed to answer PING." << endl;
+}
+
+// a PING line is answered instead of printed; false for any other line
+bool answerPing(string_view line) {
+    if (line != "PING") return false;
+    sendPong();
+    return true;
+}
+
+// --raw does not frame the stream, so PINGs are spotted by their bytes: "PING\n"
+// after a newline, or after the type byte of a FRAME_TEXT on HELLO 2. One split
+// over two reads is found too; a chat message that happens to match only gets a
+// PONG sent that nobody asked for
+void answerRawPings(const char *data, size_t length) {
+    static const char pattern[] = "?PING\n";   // the first byte is either of the two
+    static size_t matched = 0;
+    for (size_t i = 0; i < length; i++) {
+        char c = data[i];
+        if (matched > 0 && c == pattern[matched]) {
+            if (++matched < sizeof(pattern) - 1) continue;
+            sendPong();
+        }
+        matched = c == '\n' || c == FRAME_TEXT ? 1 : 0;
     }
-    tokens.push_back(s.substr(start));  // Add the last token
-    return tokens;
 }
 
-// receives messages from the server and handles TCP message fragmentation
-void receiveMessage() {
-    char buffer[MAX_MESSAGE_LENGTH] = {};
-    string partialMessage = "";  // Buffer to hold partial messages
+// print a line from the server with what scanning it found out: trailing whitespace
+// is dropped, and a line that is not well-formed UTF-8 shows '?' for its bytes that
+// are not ASCII, so it cannot garble the terminal. PINGs are answered, QUIT ends the chat
+void handleLine(string_view line, const LineScan &scan, string &output) {
+    line = line.substr(0, scan.content);
+    if (line.empty() || answerPing(line)) return;
+    if (scan.valid) {
+        appendLine(line, output);
+    } else {
+        string shown(line);
+        for (char &c : shown) {
+            if (static_cast<unsigned char>(c) >= 0x80) c = '?';
+        }
+        appendLine(shown, output);
+    }
+    if (line == "QUIT") isRunning = false;
+}
+
+// write all of data to stdout, one write call unless the pipe or terminal is full
+bool writeOutput(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// receive once from the server into framer, through the inflater on a compressed
+// connection; returns what recv returned, or -1 if the compressed stream is corrupt
+ssize_t receiveInto(LineFramer &framer) {
+    if (!inflater) {
+        char *space = framer.write_ptr();
+        ssize_t receive = recv(serverSocket, space, framer.write_space(), 0);
+        if (receive > 0) framer.commit(receive);
+        return receive;
+    }
+
+    static vector<char> compressed(RECEIVE_CHUNK);
+    ssize_t receive = recv(serverSocket, compressed.data(), compressed.size(), 0);
+    if (receive <= 0) return receive;
+    inflater->feed(compressed.data(), receive);
+    while (true) {
+        char *space = framer.write_ptr();
+        ssize_t produced = inflater->read(space, framer.write_space());
+        if (produced < 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+        if (produced == 0) return receive;
+        framer.commit(produced);
+    }
+}
+
+// receives messages from the server and handles TCP message fragmentation. Lines are
+// framed in place in the receive buffer and everything one recv delivered is printed
+// with a single write, so a busy room costs no allocations and no per-line flushes.
+// Lines already in framer from the handshake come first
+void receiveMessage(LineFramer &framer) {
+    string output;  // reused, only grows until it fits the largest batch
+    output.reserve(RECEIVE_CHUNK);
 
     while (isRunning) {
-        int receive = recv(serverSocket, buffer, MAX_MESSAGE_LENGTH, 0);
+        // Process each complete message, a partial one stays in the framer
+        string_view completeMessage;
+        LineScan scan;
+        while (isRunning && framer.next_line(completeMessage, scan)) {
+            // print the message without its "MSG <nickname>" prefix
+            handleLine(completeMessage, scan, output);
+        }
+        if (!output.empty()) {
+            if (!writeOutput(output.data(), output.size())) isRunning = false;
+            output.clear();
+        }
+        if (!isRunning) break;
+
+        ssize_t receive = receiveInto(framer);
         if (receive > 0) {
-            partialMessage += string(buffer, receive);  // Append received data to buffer
-
-            // Process complete messages (split by newline)
-            vector<string> messages = split(partialMessage, "\n");
-            
-            // The last message might be incomplete, so we keep it in the partial buffer
-            partialMessage = messages.back();
-            messages.pop_back();  // Remove the incomplete message from processing
-
-            // Process each complete message
-            for (const string& completeMessage : messages) {
-                if (completeMessage.empty()) continue;
-
-                // Strip the "MSG <nickname>" prefix once and print the message
-                string strippedMessage = stripMessagePrefix(completeMessage);
-                cout << strippedMessage << endl;  // Print the stripped message (content only)
-
-                // If the server sends the special disconnect message or closes the connection:
-                if (completeMessage == "QUIT") {
-                    isRunning = false;
-                    break;
-                }
-            }
+            continue;
         } else if (receive == 0) {
             // Connection closed by server
             cout << username << ": server disconnected. exiting chat..." << endl;
             isRunning = false;
+        } else if (errno != EINTR) {
+            cerr << "error: failed to receive message from server." << endl;
+            isRunning = false;
+        }
+    }
+}
+
+// append the lines of a FRAME_TEXT to output the way receiveMessage() prints them
+void appendTextLines(string_view text, string &output) {
+    while (!text.empty()) {
+        LineScan scan;
+        if (scan_line(text.data(), text.size(), scan)) {
+            handleLine(text.substr(0, scan.scanned), scan, output);
+            text.remove_prefix(scan.scanned + 1);
         } else {
+            // the last line lacks its '\n', and is cut short if it ends inside a sequence
+            scan.valid = scan.valid && scan.scanned == text.size();
+            handleLine(text, scan, output);
+            break;
+        }
+    }
+}
+
+// append the messages of a server FRAME_MSG to output; a batch of messages is one
+// frame, so it is printed without splitting the text into lines first
+void appendFrameMessages(string_view body, string &output) {
+    if (body.size() < 4) return;
+    string_view room, messages, text;
+    if (!parse_frame_msg(body.substr(4), room, messages)) return;
+    while (next_frame_message(messages, text)) {
+        if (!room.empty()) {
+            output.append(room.data(), room.size());
+            output += ' ';
+        }
+        output.append(text.data(), text.size());
+        output += '\n';
+    }
+}
+
+// HELLO 2 counterpart of receiveMessage(): frames are split in place in the same
+// kind of buffer, and everything one recv delivered is printed with one write
+void receiveFrames(LineFramer &framer) {
+    string output;
+    output.reserve(RECEIVE_CHUNK);
+
+    // the first pass handles what arrived together with the handshake
+    while (isRunning) {
+        string_view frame;
+        while (isRunning && framer.next_frame(frame, MAX_FRAME_LENGTH)) {
+            if (frame.empty()) continue;
+            string_view body = frame.substr(1);
+            switch (frame[0]) {
+            case FRAME_MSG:
+                appendFrameMessages(body, output);
+                break;
+            case FRAME_TEXT:
+                appendTextLines(body, output);
+                break;
+            default:
+                break;  // nothing asks for FRAME_USER yet
+            }
+        }
+        if (framer.overflowed()) {
+            cerr << "error: frame from server too long." << endl;
+            isRunning = false;
+        }
+        if (!output.empty()) {
+            if (!writeOutput(output.data(), output.size())) isRunning = false;
+            output.clear();
+        }
+        if (!isRunning) break;
+
+        ssize_t receive = receiveInto(framer);
+        if (receive > 0) {
+            continue;
+        } else if (receive == 0) {
+            cout << username << ": server disconnected. exiting chat..." << endl;
+            isRunning = false;
+        } else if (errno != EINTR) {
             cerr << "error: failed to receive message from server." << endl;
             isRunning = false;
         }
+    }
+}
+
+// relay the decompressed stream of length compressed bytes to stdout through plain
+bool writeInflated(const char *data, size_t length, vector<char> &plain) {
+    inflater->feed(data, length);
+    ssize_t produced;
+    while ((produced = inflater->read(plain.data(), plain.size())) > 0) {
+        answerRawPings(plain.data(), produced);
+        if (!writeOutput(plain.data(), produced)) return false;
+    }
+    if (produced < 0) cerr << "error: corrupt compressed stream from server." << endl;
+    return produced == 0;
+}
 
-        // Clear the buffer after each use
-        memset(buffer, 0, MAX_MESSAGE_LENGTH);
+// tap mode: relays the server's byte stream to stdout untouched, one write per recv
+// into a large buffer, to keep up with a busy room when logging or monitoring it. A
+// compressed stream is relayed as it was before compression
+void receiveRaw() {
+    int size = RAW_RECEIVE_BUFFER;
+    setsockopt(serverSocket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));  // best effort
+    vector<char> buffer(RAW_RECEIVE_BUFFER);
+    vector<char> plain(inflater ? RAW_RECEIVE_BUFFER : 0);
+
+    while (isRunning) {
+        ssize_t receive = recv(serverSocket, buffer.data(), buffer.size(), 0);
+        if (receive > 0) {
+            if (!inflater) answerRawPings(buffer.data(), receive);
+            bool written = inflater ? writeInflated(buffer.data(), receive, plain) : writeOutput(buffer.data(), receive);
+            if (!written) isRunning = false;
+        } else if (receive == 0) {
+            cerr << username << ": server disconnected. exiting chat..." << endl;
+            isRunning = false;
+        } else if (errno != EINTR) {
+            cerr << "error: failed to receive message from server." << endl;
+            isRunning = false;
+        }
     }
 }
 
@@ -114,7 +346,12 @@ void sendMessage() {
     string message;
     while (isRunning) {
         flushOutput();  // flush output before user input
-        getline(cin, message);  // read user input
+        if (!getline(cin, message)) break;  // read user input, stop sending at end of input
+        if (!valid_utf8(message.data(), message.size())) {
+            // the server would refuse it
+            cerr << "error: message is not valid UTF-8." << endl;
+            continue;
+        }
 
         // Check if the input is a raw message like "2C7ABE39", which should be sent as-is
         if (message == "2C7ABE39") {
@@ -124,10 +361,29 @@ void sendMessage() {
                 isRunning = false;
                 break;
             }
+        } else if (message.compare(0, 5, "/msg ") == 0) {
+            // a direct message, "/msg <nickname> <text>", to that user only
+            string command = "PRIVMSG " + message.substr(5);
+            string wire = binary ? string(BufferRef(format_frame(FRAME_TEXT, {command}))->view()) : command + "\n";
+            if (!sendAll(wire.data(), wire.size())) {
+                cerr << "error: failed to send message to server." << endl;
+                isRunning = false;
+                break;
+            }
+        } else if (binary) {
+            // the same text a MSG line carries, as a lobby FRAME_MSG
+            string text = username + " " + message;
+            string_view textView = text;
+            BufferRef frame(format_frame_msg(nullptr, string_view(), &textView, 1));
+            if (!sendAll(frame->view().data(), frame->size())) {
+                cerr << "error: failed to send message to server." << endl;
+                isRunning = false;
+                break;
+            }
         } else {
             // Otherwise, send the message with the "MSG <nickname>" prefix
             string protocolMessage = "MSG " + username + " " + message + "\n";
-            if (send(serverSocket, protocolMessage.c_str(), protocolMessage.length(), 0) == -1) {
+            if (!sendAll(protocolMessage.data(), protocolMessage.size())) {
                 cerr << "error: failed to send message to server." << endl;
                 isRunning = false;
                 break;
@@ -136,13 +392,125 @@ void sendMessage() {
     }
 }
 
+// receive into framer until it holds one complete frame, which is returned
+bool receiveFrame(LineFramer &framer, string_view &frame) {
+    while (!framer.next_frame(frame, MAX_FRAME_LENGTH)) {
+        ssize_t receive = receiveInto(framer);
+        if (receive == 0 || (receive < 0 && errno != EINTR)) return false;
+    }
+    return true;
+}
+
+// receive into framer until it holds one complete line, which is returned
+bool receiveLine(LineFramer &framer, string_view &line) {
+    while (!framer.next_line(line)) {
+        ssize_t receive = receiveInto(framer);
+        if (receive == 0 || (receive < 0 && errno != EINTR)) return false;
+    }
+    return true;
+}
+
+// ask for compression before NICK; the confirmation is the last thing the server
+// sends uncompressed, after it the inflater takes over. False if refused
+bool requestCompression() {
+    string request = "COMPRESS " + compression;
+    string confirmation = "OK " + request + "\n";
+    if (binary) {
+        request = string(BufferRef(format_frame(FRAME_TEXT, {request}))->view());
+        confirmation = string(BufferRef(format_frame(FRAME_TEXT, {confirmation}))->view());
+    } else {
+        request += '\n';
+    }
+    // nothing else is on the way before NICK, so exactly the confirmation is read
+    string answer(confirmation.size(), '\0');
+    if (!sendAll(request.data(), request.size()) ||
+        recv(serverSocket, &answer[0], answer.size(), MSG_WAITALL) != (ssize_t)answer.size() ||
+        answer != confirmation) {
+        return false;
+    }
+    inflater = make_unique<StreamInflater>();
+    return true;
+}
+
+// the rest of the session after the greeting, with HELLO 2 frames
+int runBinary(bool raw, ostream &status) {
+    string hello = HELLO_BINARY "\n";
+    char confirmation[sizeof(HELLO_BINARY)];
+    if (!sendAll(hello.data(), hello.size()) ||
+        recv(serverSocket, confirmation, sizeof(confirmation), MSG_WAITALL) != sizeof(confirmation) ||
+        string_view(confirmation, sizeof(confirmation)) != hello) {
+        cerr << "error: server does not speak " << HELLO_BINARY << "." << endl;
+        close(serverSocket);
+        return 1;
+    }
+    if (!compression.empty() && !requestCompression()) {
+        cerr << "error: server refused compression." << endl;
+        close(serverSocket);
+        return 1;
+    }
+
+    BufferRef nick(format_frame(FRAME_NICK, {username}));
+    LineFramer framer(RECEIVE_CHUNK, RECEIVE_CHUNK);
+    string_view frame;
+    if (!sendAll(nick->view().data(), nick->size()) || !receiveFrame(framer, frame)) {
+        cerr << "error: error reading server response." << endl;
+        close(serverSocket);
+        return 1;
+    }
+    string responseStr(!frame.empty() && frame[0] == FRAME_TEXT ? frame.substr(1) : string_view());
+    status << "server response: " << responseStr;
+    if (raw) {
+        // whatever arrived behind the OK frame is already part of the stream
+        string_view rest = framer.buffered();
+        writeOutput(rest.data(), rest.size());
+        receiveRaw();
+        close(serverSocket);
+        return 0;
+    }
+    if (responseStr.find("OK") == string::npos) {
+        close(serverSocket);
+        return 1;
+    }
+    cout << "welcome to the chat!" << endl;
+
+    thread sendThread(sendMessage);
+    receiveFrames(framer);
+
+    sendThread.join();
+    close(serverSocket);
+    return 0;
+}
+
 // main function
 int main(int argc, char *argv[]) {
+    // load-generator mode drives many sessions instead of one interactive one
+    if (argc > 1 && string(argv[1]) == "--load") {
+        return runLoad(argc, argv);
+    }
+
     // set up signal handler for ctrl+c
     signal(SIGINT, signalHandler);
 
-    if (argc < 3) {
-        cout << "usage: " << argv[0] << " <ip:port> <nickname>" << endl;
+    // a raw tap keeps stdout for the server's stream, status goes to stderr
+    bool raw = false;
+    bool usage = argc < 3;
+    for (int i = 3; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--raw") {
+            raw = true;
+        } else if (option == "--binary") {
+            binary = true;
+        } else if (option == "--compress") {
+            compression = COMPRESSION_DEFLATE;
+        } else if (option == "--compress-shared") {
+            compression = COMPRESSION_DEFLATE_SHARED;
+        } else {
+            usage = true;
+        }
+    }
+    if (usage) {
+        cout << "usage: " << argv[0] << " <ip:port> <nickname> [--raw] [--binary] [--compress|--compress-shared]" << endl;
+        cout << "       " << argv[0] << " --load <ip:port> [--sessions N] [--rate MSGS_PER_SEC] [--size BYTES] [--duration SECONDS]" << endl;
         return 0;
     }
 
@@ -163,7 +531,9 @@ int main(int argc, char *argv[]) {
     }
     username = nickname;
 
-    cout << "connecting to " << host << ":" << port << " as " << username << "..." << endl;
+    ostream &status = raw ? cerr : cout;
+
+    status << "connecting to " << host << ":" << port << " as " << username << "..." << endl;
 
     struct addrinfo hints{}, *serverInfo;
     memset(&hints, 0, sizeof(hints));
@@ -190,15 +560,15 @@ int main(int argc, char *argv[]) {
     }
     freeaddrinfo(serverInfo);
 
-    char serverProtocol[MAX_MESSAGE_LENGTH] = {};
+    char serverProtocol[HANDSHAKE_BUFFER] = {};
     int bytesReceived = recv(serverSocket, serverProtocol, sizeof(serverProtocol), 0);
     if (bytesReceived <= 0) {
         cerr << "error: error reading server protocol." << endl;
         close(serverSocket);
         return 1;
     }
-    cout << "server protocol: " << string(serverProtocol, bytesReceived);
-    flushOutput();
+    status << "server protocol: " << string(serverProtocol, bytesReceived);
+    status.flush();
 
     if (string(serverProtocol).find("HELLO 1") == string::npos) {
         cerr << "error: server protocol not supported." << endl;
@@ -206,6 +576,13 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (binary) return runBinary(raw, status);
+    if (!compression.empty() && !requestCompression()) {
+        cerr << "error: server refused compression." << endl;
+        close(serverSocket);
+        return 1;
+    }
+
     string nicknameProtocolMessage = "NICK " + username + "\n";
     if (send(serverSocket, nicknameProtocolMessage.c_str(), nicknameProtocolMessage.length(), 0) == -1) {
         cerr << "error: failed to send nickname to server." << endl;
@@ -213,25 +590,53 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    char response[MAX_MESSAGE_LENGTH] = {};
-    bytesReceived = recv(serverSocket, response, sizeof(response), 0);  // Use recv instead of read
-    if (bytesReceived <= 0) {
-        cerr << "error: error reading server response." << endl;
-        close(serverSocket);
-        return 1;
+    LineFramer framer(RECEIVE_CHUNK, RECEIVE_CHUNK);
+    string responseStr;
+    if (inflater) {
+        // compressed from here on; what follows the response stays in the framer
+        string_view responseLine;
+        if (!receiveLine(framer, responseLine)) {
+            cerr << "error: error reading server response." << endl;
+            close(serverSocket);
+            return 1;
+        }
+        responseStr = string(responseLine) + "\n";
+    } else {
+        char response[HANDSHAKE_BUFFER] = {};
+        bytesReceived = recv(serverSocket, response, sizeof(response), 0);  // Use recv instead of read
+        if (bytesReceived <= 0) {
+            cerr << "error: error reading server response." << endl;
+            close(serverSocket);
+            return 1;
+        }
+        responseStr.assign(response, bytesReceived);
     }
 
     // Process the server's response message (combined OK and fake message)
-    string responseStr(response, bytesReceived);
+    if (raw) {
+        // whatever arrived behind the OK line is already part of the stream
+        size_t newline = responseStr.find('\n');
+        size_t end = newline == string::npos ? responseStr.size() : newline + 1;
+        status << "server response: " << responseStr.substr(0, end);
+        writeOutput(responseStr.data() + end, responseStr.size() - end);
+        string_view rest = framer.buffered();
+        writeOutput(rest.data(), rest.size());
+        receiveRaw();
+        close(serverSocket);
+        return 0;
+    }
     cout << "server response: " << responseStr;
 
-    if (responseStr.find("OK") != string::npos) {
-        cout << "welcome to the chat!" << endl;
+    if (responseStr.find("OK") == string::npos) {
+        // nickname refused, or already taken
+        close(serverSocket);
+        return 1;
     }
+    cout << "welcome to the chat!" << endl;
 
     // Handle the rest of the messages
     thread sendThread(sendMessage);
-    receiveMessage();  // Handle receiving messages in the main thread
+    receiveMessage(framer);  // Handle receiving messages in the main thread
 
     sendThread.join();
     close(serverSocket);  // close the socket when done
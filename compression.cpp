@@ -0,0 +1,120 @@
+#include "compression.h"
+
+#include <vector>
+
+// a connection's context: 8 KiB of history covers many chat lines, and at about
+// 50 KiB it stays affordable for every subscriber that asks for compression
+#define CONNECTION_WINDOW_BITS 13
+#define CONNECTION_MEM_LEVEL 5
+#define STORED_BLOCK_BYTES 65535   // most a stored block holds, after its 5 byte header
+
+using namespace std;
+
+namespace {
+
+// compressed output is gathered here before it is copied into a buffer of its
+// exact size; one per thread, shared by every deflater that thread runs
+thread_local vector<unsigned char> scratch;
+
+size_t stored_blocks(size_t total) {
+    return total == 0 ? 1 : (total + STORED_BLOCK_BYTES - 1) / STORED_BLOCK_BYTES;
+}
+
+// parts as stored blocks, total bytes in all, starting at a byte boundary: each a
+// header byte with BFINAL and BTYPE 0, then LEN and its complement, little-endian
+SharedBuffer *store(const string_view *parts, size_t count, size_t total, uint64_t stamp) {
+    size_t blocks = stored_blocks(total);
+    SharedBuffer *buffer = SharedBuffer::create(total + 5 * blocks);
+    size_t part = 0, offset = 0;
+    for (size_t block = 0; block < blocks; block++) {
+        size_t length = min<size_t>(total - block * STORED_BLOCK_BYTES, STORED_BLOCK_BYTES);
+        unsigned char header[5] = {0, static_cast<unsigned char>(length), static_cast<unsigned char>(length >> 8),
+                                   static_cast<unsigned char>(~length), static_cast<unsigned char>(~length >> 8)};
+        buffer->append(string_view(reinterpret_cast<const char*>(header), sizeof(header)));
+        while (length > 0) {
+            size_t take = min(length, parts[part].size() - offset);
+            buffer->append(parts[part].substr(offset, take));
+            length -= take;
+            offset += take;
+            if (offset == parts[part].size()) {
+                part++;
+                offset = 0;
+            }
+        }
+    }
+    buffer->stamp = stamp;
+    return buffer;
+}
+
+}  // namespace
+
+Deflater::Deflater(int level, bool independent) : independent_(independent) {
+    // negative window bits: raw deflate, no zlib header or checksum per chunk
+    int window_bits = independent ? -MAX_WBITS : -CONNECTION_WINDOW_BITS;
+    int mem_level = independent ? 8 : CONNECTION_MEM_LEVEL;
+    ready_ = deflateInit2(&stream_, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+Deflater::~Deflater() {
+    if (ready_) deflateEnd(&stream_);
+}
+
+SharedBuffer *Deflater::compress(const string_view *parts, size_t count, uint64_t stamp) {
+    if (!ready_ || (independent_ && deflateReset(&stream_) != Z_OK)) return nullptr;
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) total += parts[i].size();
+    // the bound covers a finished stream, the sync flush adds an empty stored block
+    size_t bound = deflateBound(&stream_, total) + 16;
+    if (scratch.size() < bound) scratch.resize(bound);
+
+    stream_.next_out = scratch.data();
+    stream_.avail_out = static_cast<uInt>(bound);
+    for (size_t i = 0; i < count; i++) {
+        stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(parts[i].data()));
+        stream_.avail_in = static_cast<uInt>(parts[i].size());
+        int flush = i + 1 == count ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        if (deflate(&stream_, flush) != Z_OK || stream_.avail_in > 0) {
+            // the context is out of step with what the receiver will see
+            ready_ = false;
+            return nullptr;
+        }
+    }
+    if (stream_.avail_out == 0) {
+        ready_ = false;
+        return nullptr;
+    }
+
+    size_t length = bound - stream_.avail_out;
+    // short chunks rarely shrink, a chunk that stands on its own can go out as it is
+    if (independent_ && length >= total + 5 * stored_blocks(total)) return store(parts, count, total, stamp);
+    SharedBuffer *buffer = SharedBuffer::create(length);
+    buffer->append(string_view(reinterpret_cast<const char*>(scratch.data()), length));
+    buffer->stamp = stamp;
+    return buffer;
+}
+
+StreamInflater::StreamInflater() {
+    ready_ = inflateInit2(&stream_, -MAX_WBITS) == Z_OK;
+}
+
+StreamInflater::~StreamInflater() {
+    if (ready_) inflateEnd(&stream_);
+}
+
+void StreamInflater::feed(const char *data, size_t length) {
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_.avail_in = static_cast<uInt>(length);
+}
+
+ssize_t StreamInflater::read(char *out, size_t space) {
+    if (!ready_) return -1;
+    stream_.next_out = reinterpret_cast<Bytef*>(out);
+    stream_.avail_out = static_cast<uInt>(space);
+    while (stream_.avail_out > 0) {
+        int status = inflate(&stream_, Z_NO_FLUSH);
+        if (status == Z_BUF_ERROR) break;   // no input left and nothing pending
+        // chunks never end the stream, a final block is as corrupt as bad data
+        if (status != Z_OK) return -1;
+    }
+    return static_cast<ssize_t>(space - stream_.avail_out);
+}
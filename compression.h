@@ -0,0 +1,74 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string_view>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "shared_buffer.h"
+
+// Compression of the server-to-client stream, negotiated before NICK.
+//
+// Either way the server sends raw deflate data in chunks, each ended by a sync
+// flush, and the receiver inflates the connection as one continuous stream. The
+// two methods differ in what a chunk may refer back to:
+//
+//   deflate          one compression context per connection; chunks refer back to
+//                    everything the connection was sent before, which compresses
+//                    chat lines best but costs CPU and memory per recipient
+//   deflate-shared   every chunk is compressed on its own, and any sequence of such
+//                    chunks is a valid stream; what a loop iteration queued for a
+//                    client is one chunk, compressed once for all the clients that
+//                    were sent the same messages. It trades ratio for CPU: a chunk
+//                    cannot refer to earlier ones, so a busy room compresses about
+//                    as well as with deflate, while a quiet one, a line per chunk,
+//                    does not shrink at all and goes out in stored blocks, 5 bytes
+//                    longer than plain
+//
+// A connection's context can be replaced by a fresh one at any chunk boundary,
+// which is how a hot upgrade carries compressed clients over.
+#define COMPRESSION_DEFLATE "deflate"
+#define COMPRESSION_DEFLATE_SHARED "deflate-shared"
+
+class Deflater {
+public:
+    // independent: every chunk stands on its own, as deflate-shared needs, and is
+    // stored as it is when deflate would not make it smaller; otherwise the deflater
+    // keeps the smaller window of one connection's deflate context
+    Deflater(int level, bool independent);
+    ~Deflater();
+
+    Deflater(const Deflater&) = delete;
+    Deflater &operator=(const Deflater&) = delete;
+
+    // count parts as one chunk in a new buffer with the given stamp; nullptr if zlib fails
+    SharedBuffer *compress(const std::string_view *parts, size_t count, uint64_t stamp = 0);
+
+private:
+    z_stream stream_{};
+    bool ready_ = false;
+    bool independent_;
+};
+
+// receiving end of a compressed connection
+class StreamInflater {
+public:
+    StreamInflater();
+    ~StreamInflater();
+
+    StreamInflater(const StreamInflater&) = delete;
+    StreamInflater &operator=(const StreamInflater&) = delete;
+
+    // take length bytes received; they must stay put until read() returned 0
+    void feed(const char *data, size_t length);
+
+    // inflate into out, at most space bytes; returns the bytes produced, 0 once
+    // everything fed was inflated and -1 if the stream is corrupt
+    ssize_t read(char *out, size_t space);
+
+private:
+    z_stream stream_{};
+    bool ready_ = false;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "io_engine.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define EPOLL_MAX_EVENTS 256
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+namespace {
+
+// edge-triggered epoll; the listener and the wakeup fd are tagged with pointers
+// to their fd members, everything else registered is an IoConnection
+class EpollEngine : public IoEngine {
+public:
+    EpollEngine(IoHandler &handler, int epoll_fd) : handler_(handler), epoll_fd_(epoll_fd) {}
+
+    ~EpollEngine() override { close(epoll_fd_); }
+
+    const char *name() const override { return "epoll"; }
+
+    bool asynchronous() const override { return false; }
+
+    bool add_listener(int fd) override {
+        listen_fd_ = fd;
+        return watch(fd, EPOLLIN | EPOLLET, &listen_fd_);
+    }
+
+    void remove_listener() override {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, nullptr);
+    }
+
+    bool add_wakeup(int fd) override {
+        wakeup_fd_ = fd;
+        return watch(fd, EPOLLIN | EPOLLET, &wakeup_fd_);
+    }
+
+    bool add_connection(IoConnection *conn) override {
+        conn->paused = false;
+        return watch(conn->sockfd, CONNECTION_EVENTS, conn);
+    }
+
+    void pause(IoConnection *conn) override {
+        conn->paused = true;
+    }
+
+    // modifying an edge-triggered registration re-checks readiness, so data that
+    // arrived while paused is reported by the next poll() without a new edge
+    void resume(IoConnection *conn) override {
+        if (!conn->paused) return;
+        conn->paused = false;
+        watch(conn->sockfd, CONNECTION_EVENTS, conn, EPOLL_CTL_MOD);
+    }
+
+    bool release(IoConnection *conn) override {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn->sockfd, nullptr);
+        return true;
+    }
+
+    ssize_t send(IoConnection *conn, const struct iovec *iov, int count, int flags) override {
+        struct msghdr msg{};
+        msg.msg_iov = const_cast<struct iovec*>(iov);
+        msg.msg_iovlen = count;
+        return sendmsg(conn->sockfd, &msg, flags);
+    }
+
+    void submit() override {}
+
+    int poll(int timeout_ms) override {
+        struct epoll_event events[EPOLL_MAX_EVENTS];
+        int ready = epoll_wait(epoll_fd_, events, EPOLL_MAX_EVENTS, timeout_ms);
+        for (int i = 0; i < ready; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_fd_) {
+                accept_all();
+            } else if (tag == &wakeup_fd_) {
+                handler_.on_wakeup();
+            } else {
+                auto *conn = static_cast<IoConnection*>(tag);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) read_all(conn);
+                if (events[i].events & EPOLLOUT) handler_.on_writable(conn, 0);
+            }
+        }
+        return ready;
+    }
+
+private:
+    bool watch(int fd, uint32_t events, void *tag, int operation = EPOLL_CTL_ADD) {
+        struct epoll_event ev{};
+        ev.events = events;
+        ev.data.ptr = tag;
+        return epoll_ctl(epoll_fd_, operation, fd, &ev) == 0;
+    }
+
+    // with edge-triggered epoll the listener has to be drained until EAGAIN
+    void accept_all() {
+        while (true) {
+            struct sockaddr_in address;
+            socklen_t length = sizeof(address);
+            int fd = accept4(listen_fd_, (struct sockaddr*)&address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("error: accept failed: %s\n", strerror(errno));
+                }
+                return;
+            }
+            handler_.on_accept(fd, address);
+        }
+    }
+
+    // read straight into the handler's buffer until EAGAIN or a pause; a single read
+    // may carry several pipelined commands or only part of one
+    void read_all(IoConnection *conn) {
+        while (!conn->paused) {
+            size_t length;
+            char *buffer = handler_.read_buffer(conn, length);
+            if (!buffer) return;
+            ssize_t received = recv(conn->sockfd, buffer, length, 0);
+            if (received > 0) {
+                handler_.on_read(conn, received);
+            } else if (received == 0) {
+                handler_.on_read(conn, 0);
+                return;
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) handler_.on_error(conn, errno);
+                return;
+            }
+        }
+    }
+
+    IoHandler &handler_;
+    int epoll_fd_;
+    int listen_fd_ = -1;
+    int wakeup_fd_ = -1;
+};
+
+}  // namespace
+
+IoEngine *create_epoll_engine(IoHandler &handler) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) return nullptr;
+    return new EpollEngine(handler, epoll_fd);
+}
@@ -0,0 +1,834 @@
+#include "federation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framer.h"
+#include "logger.h"
+#include "protocol.h"
+#include "shared_buffer.h"
+
+#define LINK_VERSION 2
+#define LINK_MAX_FRAME (1 << 20)
+#define LINK_READ_CHUNK 65536
+#define LINK_QUEUE_BYTES (16 << 20)   // a link this far behind is dropped, it resyncs once it is back
+#define LINK_RETRY_MS 1000            // between connection attempts to a configured peer
+#define LINK_MAX_IOV 64
+#define SEQUENCE_WINDOW 1024          // recent sequence numbers remembered per origin, a multiple of 64
+#define SNAPSHOT_FRAME_BYTES 60000    // a snapshot frame is closed once it is this long
+#define MAX_LINK_MESSAGES 256         // messages of a LINK_MSG handed to the server at a time
+
+using namespace std;
+
+namespace {
+
+enum LinkType : uint8_t {
+    LINK_HELLO = 1,
+    LINK_MSG = 2,
+    LINK_PRESENCE = 3,
+    LINK_SNAPSHOT = 4,
+    LINK_HEARTBEAT = 5,
+    LINK_RESYNC = 6,
+    LINK_DIRECT = 7
+};
+
+enum SnapshotFlags : uint8_t {
+    SNAPSHOT_FIRST = 1,
+    SNAPSHOT_LAST = 2
+};
+
+// TCP connection to another node
+struct Link {
+    int fd = -1;
+    string peer;                // configured address of an outbound link, empty if accepted
+    bool connecting = false;    // non-blocking connect still in progress
+    bool closed = false;        // removed at the end of the loop iteration
+    uint32_t node = 0;          // peer's node id, 0 until its LINK_HELLO arrived
+    uint64_t heard_ns = 0;      // when the last frame arrived, or the link was opened
+    LineFramer framer{LINK_MAX_FRAME, LINK_READ_CHUNK};
+    deque<BufferRef> outqueue;
+    size_t out_offset = 0;      // bytes of outqueue.front() already sent
+    size_t queued = 0;          // unsent bytes in outqueue
+};
+
+// configured peer; an outbound link to it is kept open, reopened after a retry delay
+struct Peer {
+    string address;
+    bool linked = false;
+    uint64_t retry_ns = 0;
+};
+
+// another node, as far as this one knows it
+struct Origin {
+    uint64_t highest = 0;                       // highest sequence number seen
+    uint64_t seen[SEQUENCE_WINDOW / 64] = {};   // bit s % SEQUENCE_WINDOW: s was seen, for the window up to highest
+    uint64_t state_seq = 0;                     // newest presence change or snapshot applied
+    uint64_t heard_ns = 0;
+    unordered_map<uint32_t, string> users;
+    unordered_map<uint32_t, string> incoming;   // snapshot still being received
+    uint64_t incoming_seq = 0;                  // sequence number of its first frame, 0 if none
+};
+
+FederationConfig settings;
+FederationHandler callbacks;
+atomic<bool> running(false);
+thread federation_thread;
+int listen_fd = -1;
+int wake_fd = -1;   // eventfd raised when the outbox goes non-empty
+
+// own broadcasts, appended by the shards and drained by the federation thread
+mutex outbox_lock;
+vector<BufferRef> outbox;                      // in sequence number order
+uint64_t next_seq = 0;
+unordered_map<uint32_t, string> local_users;   // what the next snapshot holds
+
+// everything else belongs to the federation thread
+vector<unique_ptr<Link>> links;
+vector<Peer> peers;
+unordered_map<uint32_t, Origin> origins;
+bool snapshot_due = false;       // send our snapshot at the end of the loop iteration
+uint64_t resync_asked_ns = 0;    // last time an unknown origin made this node ask for snapshots
+
+atomic<uint64_t> links_up(0);
+atomic<uint64_t> received(0);
+atomic<uint64_t> duplicates(0);
+atomic<uint64_t> forwarded(0);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// a link frame being put together; finish() fills in the length
+class FrameBuilder {
+public:
+    explicit FrameBuilder(LinkType type) : bytes_(FRAME_HEADER_LENGTH, '\0') {
+        bytes_[4] = static_cast<char>(type);
+    }
+
+    void u8(uint8_t value) { bytes_.push_back(static_cast<char>(value)); }
+
+    void u16(uint16_t value) {
+        char out[2];
+        store_u16(out, value);
+        bytes_.append(out, sizeof(out));
+    }
+
+    void u32(uint32_t value) {
+        char out[4];
+        store_u32(out, value);
+        bytes_.append(out, sizeof(out));
+    }
+
+    void u64(uint64_t value) {
+        u32(static_cast<uint32_t>(value >> 32));
+        u32(static_cast<uint32_t>(value));
+    }
+
+    void text(string_view value) { bytes_.append(value); }
+
+    // overwrite the byte at offset, for flags only known at the end
+    void set_u8(size_t offset, uint8_t value) { bytes_[offset] = static_cast<char>(value); }
+
+    size_t size() const { return bytes_.size(); }
+
+    BufferRef finish() {
+        store_u32(&bytes_[0], static_cast<uint32_t>(bytes_.size() - 4));
+        return BufferRef(SharedBuffer::concat({bytes_}));
+    }
+
+private:
+    string bytes_;
+};
+
+// the fields of a received frame in order; ok() turns false once a read ran past the end
+class FrameReader {
+public:
+    explicit FrameReader(string_view body) : rest_(body) {}
+
+    uint8_t u8() { return take(1) ? static_cast<uint8_t>(consume(1)[0]) : 0; }
+    uint32_t u32() { return take(4) ? load_u32(consume(4).data()) : 0; }
+    uint16_t u16() { return take(2) ? load_u16(consume(2).data()) : 0; }
+
+    uint64_t u64() {
+        uint64_t high = u32();
+        return high << 32 | u32();
+    }
+
+    string_view text(size_t length) { return take(length) ? consume(length) : string_view(); }
+
+    string_view rest() { return consume(rest_.size()); }
+
+    bool empty() const { return rest_.empty(); }
+    bool ok() const { return ok_; }
+
+private:
+    bool take(size_t length) {
+        if (rest_.size() < length) ok_ = false;
+        return ok_;
+    }
+
+    string_view consume(size_t length) {
+        string_view part = rest_.substr(0, length);
+        rest_.remove_prefix(length);
+        return part;
+    }
+
+    string_view rest_;
+    bool ok_ = true;
+};
+
+// a new broadcast from this node; outbox_lock must be held until it is published
+FrameBuilder broadcast(LinkType type) {
+    FrameBuilder frame(type);
+    frame.u32(settings.node_id);
+    frame.u64(next_seq++);
+    return frame;
+}
+
+// queue a broadcast of this node for the federation thread; outbox_lock held
+void publish(FrameBuilder &frame) {
+    outbox.push_back(frame.finish());
+    if (outbox.size() == 1) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_ERROR("error: failed to wake the federation thread: %s\n", strerror(errno));
+        }
+    }
+}
+
+// all local users, in frames of consecutive sequence numbers no other broadcast of
+// this node can come between
+void publish_snapshot() {
+    lock_guard<mutex> guard(outbox_lock);
+    auto it = local_users.begin();
+    bool first = true;
+    do {
+        FrameBuilder frame = broadcast(LINK_SNAPSHOT);
+        size_t flags = frame.size();
+        frame.u8(first ? SNAPSHOT_FIRST : 0);
+        for (; it != local_users.end() && frame.size() < SNAPSHOT_FRAME_BYTES; ++it) {
+            frame.u32(it->first);
+            frame.u8(static_cast<uint8_t>(it->second.size()));
+            frame.text(it->second);
+        }
+        if (it == local_users.end()) frame.set_u8(flags, (first ? SNAPSHOT_FIRST : 0) | SNAPSHOT_LAST);
+        publish(frame);
+        first = false;
+    } while (it != local_users.end());
+}
+
+void publish_signal(LinkType type) {
+    lock_guard<mutex> guard(outbox_lock);
+    FrameBuilder frame = broadcast(type);
+    publish(frame);
+}
+
+// true the first time seq shows up; anything below the window counts as seen
+bool first_sighting(Origin &origin, uint64_t seq) {
+    if (seq > origin.highest) {
+        if (origin.highest == 0 || seq - origin.highest >= SEQUENCE_WINDOW) {
+            memset(origin.seen, 0, sizeof(origin.seen));
+        } else {
+            for (uint64_t skipped = origin.highest + 1; skipped < seq; skipped++) {
+                origin.seen[skipped % SEQUENCE_WINDOW / 64] &= ~(1ull << skipped % 64);
+            }
+        }
+        origin.highest = seq;
+    } else if (origin.highest - seq >= SEQUENCE_WINDOW) {
+        return false;
+    }
+    uint64_t &word = origin.seen[seq % SEQUENCE_WINDOW / 64];
+    uint64_t bit = 1ull << seq % 64;
+    if (word & bit) return false;
+    word |= bit;
+    return true;
+}
+
+void close_link(Link &link, const char *reason) {
+    if (link.closed) return;
+    link.closed = true;
+    close(link.fd);
+    if (link.node != 0) {
+        links_up--;
+        LOG_INFO("federation: link to node %u closed: %s\n", link.node, reason);
+    } else if (!link.connecting) {
+        LOG_DEBUG("federation: link closed before its hello: %s\n", reason);
+    }
+    for (Peer &peer : peers) {
+        if (!link.peer.empty() && peer.address == link.peer) {
+            peer.linked = false;
+            peer.retry_ns = now_ns() + LINK_RETRY_MS * 1000000ull;
+        }
+    }
+}
+
+// send what the kernel takes of the link's queue
+void flush_link(Link &link) {
+    while (!link.outqueue.empty() && !link.closed) {
+        struct iovec iov[LINK_MAX_IOV];
+        int count = 0;
+        for (size_t i = 0; i < link.outqueue.size() && count < LINK_MAX_IOV; i++, count++) {
+            size_t skip = i == 0 ? link.out_offset : 0;
+            iov[count].iov_base = const_cast<char*>(link.outqueue[i]->data() + skip);
+            iov[count].iov_len = link.outqueue[i]->size() - skip;
+        }
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(link.fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_link(link, strerror(errno));
+            return;
+        }
+        link.queued -= sent;
+        size_t remaining = sent;
+        while (remaining > 0) {
+            size_t left = link.outqueue.front()->size() - link.out_offset;
+            if (remaining < left) {
+                link.out_offset += remaining;
+                break;
+            }
+            remaining -= left;
+            link.outqueue.pop_front();
+            link.out_offset = 0;
+        }
+    }
+}
+
+void queue_frame(Link &link, const BufferRef &frame) {
+    if (link.closed) return;
+    link.outqueue.push_back(frame);
+    link.queued += frame->size();
+    if (link.queued > LINK_QUEUE_BYTES) close_link(link, "peer too slow");
+}
+
+// send the broadcasts the shards and this thread published to every link that is up
+void send_outbox() {
+    static vector<BufferRef> frames;
+    {
+        lock_guard<mutex> guard(outbox_lock);
+        frames.swap(outbox);
+    }
+    for (const BufferRef &frame : frames) {
+        for (auto &link : links) {
+            if (link->node != 0) queue_frame(*link, frame);
+        }
+    }
+    frames.clear();
+}
+
+// a broadcast seen for the first time goes on over every other link, unchanged
+void forward(Link &from, string_view frame) {
+    SharedBuffer *buffer = SharedBuffer::create(4 + frame.size());
+    char length[4];
+    store_u32(length, static_cast<uint32_t>(frame.size()));
+    buffer->append(string_view(length, sizeof(length)));
+    buffer->append(frame);
+    BufferRef copy(buffer);
+    for (auto &link : links) {
+        if (link.get() != &from && link->node != 0 && !link->closed) {
+            queue_frame(*link, copy);
+            forwarded++;
+        }
+    }
+}
+
+void send_hello(Link &link) {
+    FrameBuilder frame(LINK_HELLO);
+    frame.u32(LINK_VERSION);
+    frame.u32(settings.node_id);
+    frame.text(settings.secret);
+    queue_frame(link, frame.finish());
+    flush_link(link);
+}
+
+// compare secrets without stopping at the first difference, so the time taken does
+// not tell how much of a guess was right
+bool same_secret(string_view given, string_view secret) {
+    if (given.size() != secret.size()) return false;
+    unsigned char difference = 0;
+    for (size_t i = 0; i < secret.size(); i++) difference |= given[i] ^ secret[i];
+    return difference == 0;
+}
+
+void handle_hello(Link &link, FrameReader &reader) {
+    uint32_t version = reader.u32();
+    uint32_t node = reader.u32();
+    string_view secret = reader.rest();
+    if (!reader.ok() || link.node != 0 || version != LINK_VERSION || node == 0 || node == settings.node_id) {
+        LOG_ERROR("error: federation: refused link from node %u, version %u\n", node, version);
+        close_link(link, "refused");
+        return;
+    }
+    if (!same_secret(secret, settings.secret)) {
+        LOG_ERROR("error: federation: refused link from node %u, wrong secret\n", node);
+        close_link(link, "refused");
+        return;
+    }
+    // with links opened both ways, both ends keep the one the lower node id opened
+    bool ours = !link.peer.empty();
+    for (auto &other : links) {
+        if (other.get() == &link || other->node != node || other->closed) continue;
+        if (ours == (settings.node_id < node)) {
+            close_link(*other, "duplicate link");
+        } else {
+            close_link(link, "duplicate link");
+            return;
+        }
+    }
+    link.node = node;
+    links_up++;
+    if (!ours) send_hello(link);
+    LOG_INFO("federation: linked to node %u\n", node);
+    // everybody sends a snapshot, so both sides learn about all the nodes behind the new link
+    publish_signal(LINK_RESYNC);
+    snapshot_due = true;
+}
+
+// ask all nodes for snapshots, at most once per timeout
+void ask_resync(uint64_t now) {
+    if (now - resync_asked_ns < settings.timeout_ms * 1000000ull) return;
+    resync_asked_ns = now;
+    publish_signal(LINK_RESYNC);
+}
+
+void apply_message(FrameReader &reader) {
+    uint32_t sender = reader.u32();
+    string_view nick = reader.text(reader.u8());
+    string_view room = reader.text(reader.u8());
+    string_view messages[MAX_LINK_MESSAGES];
+    size_t count = 0;
+    while (reader.ok() && !reader.empty()) {
+        string_view text = reader.text(reader.u16());
+        if (!reader.ok()) break;
+        messages[count++] = text;
+        if (count == MAX_LINK_MESSAGES) {
+            callbacks.message(sender, nick, room, messages, count);
+            count = 0;
+        }
+    }
+    if (count > 0 && reader.ok()) callbacks.message(sender, nick, room, messages, count);
+}
+
+void apply_direct(FrameReader &reader) {
+    uint32_t sender = reader.u32();
+    string_view nick = reader.text(reader.u8());
+    uint32_t recipient = reader.u32();
+    string_view text = reader.rest();
+    if (reader.ok()) callbacks.direct(sender, nick, recipient, text);
+}
+
+void apply_presence(Origin &origin, uint64_t seq, FrameReader &reader) {
+    bool online = reader.u8() != 0;
+    uint32_t uid = reader.u32();
+    string_view nick = reader.rest();
+    if (!reader.ok() || seq <= origin.state_seq) return;
+    origin.state_seq = seq;
+    if (online) {
+        string &name = origin.users[uid];
+        if (name == nick) return;
+        name = string(nick);
+        callbacks.presence(uid, nick, true);
+    } else {
+        auto it = origin.users.find(uid);
+        if (it == origin.users.end()) return;
+        callbacks.presence(uid, it->second, false);
+        origin.users.erase(it);
+    }
+}
+
+// collect a snapshot's frames, then replace the origin's users with it in one go
+void apply_snapshot(Origin &origin, uint64_t seq, FrameReader &reader) {
+    uint8_t flags = reader.u8();
+    if (flags & SNAPSHOT_FIRST) {
+        origin.incoming.clear();
+        origin.incoming_seq = seq;
+    } else if (origin.incoming_seq == 0) {
+        return;   // missed its start, the next snapshot will do
+    }
+    while (reader.ok() && !reader.empty()) {
+        uint32_t uid = reader.u32();
+        string_view nick = reader.text(reader.u8());
+        if (reader.ok()) origin.incoming[uid] = string(nick);
+    }
+    if (!(flags & SNAPSHOT_LAST)) return;
+
+    if (origin.incoming_seq > origin.state_seq) {
+        for (auto &user : origin.users) {
+            if (!origin.incoming.count(user.first)) callbacks.presence(user.first, user.second, false);
+        }
+        for (auto &user : origin.incoming) {
+            auto it = origin.users.find(user.first);
+            if (it == origin.users.end() || it->second != user.second) callbacks.presence(user.first, user.second, true);
+        }
+        origin.users.swap(origin.incoming);
+        origin.state_seq = seq;
+    }
+    origin.incoming.clear();
+    origin.incoming_seq = 0;
+}
+
+void handle_broadcast(Link &link, string_view frame, uint64_t now) {
+    uint8_t type = static_cast<uint8_t>(frame[0]);
+    FrameReader reader(frame.substr(1));
+    uint32_t node = reader.u32();
+    uint64_t seq = reader.u64();
+    if (!reader.ok() || node == 0) {
+        close_link(link, "malformed frame");
+        return;
+    }
+    if (node == settings.node_id) {
+        duplicates++;   // our own, back over another path
+        return;
+    }
+    bool known = origins.count(node) > 0;
+    Origin &origin = origins[node];
+    origin.heard_ns = now;
+    if (!first_sighting(origin, seq)) {
+        duplicates++;
+        return;
+    }
+    received++;
+    forward(link, frame);
+
+    // heard from a node that was given up on without a link going down on this side
+    if (!known && type != LINK_SNAPSHOT && type != LINK_RESYNC) ask_resync(now);
+
+    switch (type) {
+    case LINK_MSG:
+        apply_message(reader);
+        break;
+    case LINK_DIRECT:
+        apply_direct(reader);
+        break;
+    case LINK_PRESENCE:
+        apply_presence(origin, seq, reader);
+        break;
+    case LINK_SNAPSHOT:
+        apply_snapshot(origin, seq, reader);
+        break;
+    case LINK_RESYNC:
+        snapshot_due = true;
+        break;
+    default:
+        break;   // heartbeats, and types of newer versions, are only forwarded
+    }
+}
+
+void read_link(Link &link, uint64_t now) {
+    while (!link.closed) {
+        char *space = link.framer.write_ptr();
+        ssize_t length = recv(link.fd, space, link.framer.write_space(), 0);
+        if (length == 0) {
+            close_link(link, "closed by peer");
+            return;
+        }
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_link(link, strerror(errno));
+            return;
+        }
+        link.framer.commit(length);
+        link.heard_ns = now;
+
+        string_view frame;
+        while (!link.closed && link.framer.next_frame(frame, LINK_MAX_FRAME)) {
+            if (frame.empty()) {
+                close_link(link, "empty frame");
+            } else if (frame[0] == LINK_HELLO) {
+                FrameReader reader(frame.substr(1));
+                handle_hello(link, reader);
+            } else if (link.node == 0) {
+                close_link(link, "no hello");
+            } else {
+                handle_broadcast(link, frame, now);
+            }
+        }
+        if (link.framer.overflowed()) close_link(link, "frame too long");
+    }
+}
+
+// host:port into an address; false if it does not resolve
+bool resolve(const string &address, bool passive, struct addrinfo *&result) {
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) return false;
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+    struct addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    return getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) == 0;
+}
+
+Link *add_link(int fd, const string &peer) {
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    links.push_back(make_unique<Link>());
+    Link *link = links.back().get();
+    link->fd = fd;
+    link->peer = peer;
+    link->heard_ns = now_ns();
+    return link;
+}
+
+// start connecting to every configured peer without an open link whose retry delay passed
+void connect_peers(uint64_t now) {
+    for (Peer &peer : peers) {
+        if (peer.linked || now < peer.retry_ns) continue;
+        peer.retry_ns = now + LINK_RETRY_MS * 1000000ull;
+        struct addrinfo *address;
+        if (!resolve(peer.address, false, address)) {
+            LOG_ERROR("error: federation: cannot resolve peer %s\n", peer.address.c_str());
+            continue;
+        }
+        int fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && (connect(fd, address->ai_addr, address->ai_addrlen) == 0 || errno == EINPROGRESS)) {
+            add_link(fd, peer.address)->connecting = true;
+            peer.linked = true;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(address);
+    }
+}
+
+void accept_links() {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) LOG_ERROR("error: federation accept failed: %s\n", strerror(errno));
+            return;
+        }
+        // the other side says hello first, it is only answered with the secret
+        add_link(fd, string());
+    }
+}
+
+// heartbeat, and give up on links and nodes that were silent for the timeout
+void check_liveness(uint64_t now) {
+    publish_signal(LINK_HEARTBEAT);
+    uint64_t timeout = settings.timeout_ms * 1000000ull;
+    for (auto &link : links) {
+        if (!link->closed && now - link->heard_ns > timeout) close_link(*link, "timed out");
+    }
+    for (auto it = origins.begin(); it != origins.end();) {
+        if (now - it->second.heard_ns <= timeout) {
+            ++it;
+            continue;
+        }
+        LOG_INFO("federation: lost node %u with %zu user(s)\n", it->first, it->second.users.size());
+        for (auto &user : it->second.users) callbacks.presence(user.first, user.second, false);
+        it = origins.erase(it);
+    }
+}
+
+void run_federation() {
+    uint64_t heartbeat_interval = settings.timeout_ms * 1000000ull / 3;
+    uint64_t next_heartbeat = 0;
+    vector<struct pollfd> fds;
+    while (running.load(memory_order_acquire)) {
+        uint64_t now = now_ns();
+        if (now >= next_heartbeat) {
+            check_liveness(now);
+            next_heartbeat = now + heartbeat_interval;
+        }
+        connect_peers(now);
+        send_outbox();
+
+        fds.clear();
+        fds.push_back({wake_fd, POLLIN, 0});
+        fds.push_back({listen_fd, POLLIN, 0});   // ignored by poll() while -1
+        for (auto &link : links) {
+            short events = POLLIN;
+            if (link->connecting || link->queued > 0) events |= POLLOUT;
+            fds.push_back({link->fd, events, 0});
+        }
+        int wait = static_cast<int>((next_heartbeat - now) / 1000000) + 1;
+        if (!peers.empty()) wait = min(wait, LINK_RETRY_MS);
+        if (poll(fds.data(), fds.size(), wait) < 0 && errno != EINTR) {
+            LOG_ERROR("error: federation poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        now = now_ns();
+        if (fds[0].revents) {
+            uint64_t counter;
+            while (read(wake_fd, &counter, sizeof(counter)) > 0) {}
+        }
+        if (fds[1].revents) accept_links();
+        size_t polled = fds.size() - 2;   // links accepted just now were not polled
+        for (size_t i = 0; i < polled; i++) {
+            Link &link = *links[i];
+            short revents = fds[i + 2].revents;
+            if (link.closed || !revents) continue;
+            if (link.connecting) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error != 0) {
+                    close_link(link, strerror(error));
+                    continue;
+                }
+                link.connecting = false;
+                link.heard_ns = now;
+                send_hello(link);
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR)) read_link(link, now);
+            if (revents & POLLOUT) flush_link(link);
+        }
+
+        if (snapshot_due) {
+            snapshot_due = false;
+            publish_snapshot();
+        }
+        send_outbox();
+        for (auto &link : links) flush_link(*link);
+        for (size_t i = 0; i < links.size();) {
+            if (links[i]->closed) {
+                links.erase(links.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    // stopped: what was published so far goes out as far as the kernel takes it,
+    // the other nodes notice the missing heartbeats for the rest
+    send_outbox();
+    for (auto &link : links) {
+        flush_link(*link);
+        close_link(*link, "node stopped");
+    }
+    links.clear();
+    peers.clear();
+    if (listen_fd >= 0) close(listen_fd);
+    listen_fd = -1;
+}
+
+int open_listener(const string &address) {
+    struct addrinfo *result;
+    if (!resolve(address, true, result)) return -1;
+    int fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int option = 1;
+    // a hot upgrade's successor binds the port while its predecessor still has it
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) < 0 ||
+        bind(fd, result->ai_addr, result->ai_addrlen) < 0 || listen(fd, 16) < 0) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+}  // namespace
+
+bool federation_start(const FederationConfig &config, const FederationHandler &handler) {
+    settings = config;
+    callbacks = handler;
+    next_seq = max(next_seq, wall_ns());
+    if (wake_fd < 0) wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) return false;
+    if (!config.listen.empty()) {
+        listen_fd = open_listener(config.listen);
+        if (listen_fd < 0) {
+            LOG_ERROR("error: federation: cannot listen on %s: %s\n", config.listen.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    for (const string &address : config.peers) peers.push_back(Peer{address});
+    running.store(true, memory_order_release);
+    federation_thread = thread(run_federation);
+    return true;
+}
+
+void federation_stop() {
+    if (!running.exchange(false, memory_order_acq_rel)) return;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("error: failed to wake the federation thread: %s\n", strerror(errno));
+    }
+    federation_thread.join();
+}
+
+void federation_publish_message(uint32_t sender, string_view nick, string_view room, const string_view *messages,
+                                size_t count) {
+    if (!running.load(memory_order_acquire)) return;
+    lock_guard<mutex> guard(outbox_lock);
+    FrameBuilder frame = broadcast(LINK_MSG);
+    frame.u32(sender);
+    frame.u8(static_cast<uint8_t>(nick.size()));
+    frame.text(nick);
+    frame.u8(static_cast<uint8_t>(room.size()));
+    frame.text(room);
+    for (size_t i = 0; i < count; i++) {
+        frame.u16(static_cast<uint16_t>(messages[i].size()));
+        frame.text(messages[i]);
+    }
+    publish(frame);
+}
+
+void federation_publish_direct(uint32_t sender, string_view nick, uint32_t recipient, string_view text) {
+    if (!running.load(memory_order_acquire)) return;
+    lock_guard<mutex> guard(outbox_lock);
+    FrameBuilder frame = broadcast(LINK_DIRECT);
+    frame.u32(sender);
+    frame.u8(static_cast<uint8_t>(nick.size()));
+    frame.text(nick);
+    frame.u32(recipient);
+    frame.text(text);
+    publish(frame);
+}
+
+void federation_publish_presence(uint32_t uid, string_view nick, bool online) {
+    if (!running.load(memory_order_acquire)) return;
+    lock_guard<mutex> guard(outbox_lock);
+    if (online) {
+        local_users[uid] = string(nick);
+    } else {
+        local_users.erase(uid);
+    }
+    FrameBuilder frame = broadcast(LINK_PRESENCE);
+    frame.u8(online ? 1 : 0);
+    frame.u32(uid);
+    frame.text(nick);
+    publish(frame);
+}
+
+FederationStats federation_stats() {
+    FederationStats stats;
+    stats.links = links_up.load();
+    stats.received = received.load();
+    stats.duplicates = duplicates.load();
+    stats.forwarded = forwarded.load();
+    return stats;
+}
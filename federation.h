@@ -0,0 +1,86 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Server-to-server links that let several cserverd nodes share one chat space.
+//
+// Every node has a node id, unique in the federation, and links to some of the
+// others over TCP: it listens on a peer port and connects out to the peers it was
+// given; any connected topology works. Links carry frames like HELLO 2, a u32
+// big-endian length, a type byte and the body:
+//
+//   LINK_HELLO       u32 link version, u32 node id, the shared secret; the first
+//                    frame either way, and on an accepted link only sent back once
+//                    the other side's proved it knows the secret
+//   LINK_MSG         chat messages of a user: u32 sender id, u8 nick length, the
+//                    nick, u8 room length, the room, then each message as a u16
+//                    length and the text
+//   LINK_PRESENCE    u8 1 if a user joined, 0 if it left, u32 user id, the nick
+//   LINK_SNAPSHOT    u8 flags (first, last), then per user a u32 id, u8 nick
+//                    length and the nick; all users of the origin node, in frames
+//                    with consecutive sequence numbers
+//   LINK_HEARTBEAT   the origin is alive
+//   LINK_RESYNC      every node answers with its snapshot, sent when a link comes up
+//   LINK_DIRECT      a direct message: u32 sender id, u8 nick length, the nick, u32
+//                    recipient id, the text; only the recipient's node delivers it
+//
+// All but LINK_HELLO are broadcasts and start with the origin's u32 node id and a
+// u64 sequence number. A node forwards a broadcast to all its links but the one
+// it came in on, the first time it sees it: a window of recent sequence numbers
+// per origin drops the copies that arrive over other paths, which keeps forwarding
+// loop-free in any topology. Sequence numbers start at the wall clock in ns, so a
+// restarted node continues above everything it sent before.
+//
+// A node's users are known everywhere from its presence changes and snapshots,
+// and forgotten once nothing was heard from the node for the peer timeout; it
+// sends heartbeats well within that.
+
+struct FederationConfig {
+    uint32_t node_id = 0;                // federation is off while 0
+    std::string listen;                  // host:port of the peer port, none if empty
+    std::vector<std::string> peers;      // host:port of the nodes to link to
+    int timeout_ms = 3000;               // a link or node silent this long is gone
+    std::string secret;                  // shared by all the nodes, links without it are refused
+};
+
+// what the server does with the traffic of other nodes; called on the federation thread
+struct FederationHandler {
+    // count chat messages from a user of another node to room
+    void (*message)(uint32_t sender, std::string_view nick, std::string_view room, const std::string_view *messages,
+                    size_t count);
+    // a user of another node joined, or left (also when its node is gone)
+    void (*presence)(uint32_t uid, std::string_view nick, bool online);
+    // a direct message from a user of another node to recipient, which may be on any node
+    void (*direct)(uint32_t sender, std::string_view nick, uint32_t recipient, std::string_view text);
+};
+
+// counters for the metrics
+struct FederationStats {
+    uint64_t links = 0;                  // links up right now
+    uint64_t received = 0;               // broadcasts received for the first time
+    uint64_t duplicates = 0;             // copies dropped by the sequence window
+    uint64_t forwarded = 0;              // broadcast frames sent on to other links
+};
+
+// open the peer port and start the federation thread; false on error. May be called
+// again after federation_stop()
+bool federation_start(const FederationConfig &config, const FederationHandler &handler);
+
+// close the links and the peer port and wait for the federation thread to end, after
+// which no handler is called any more; a no-op unless the federation runs
+void federation_stop();
+
+// broadcast a local user's chat messages, a direct message to a user of another node,
+// or a presence change; thread safe, and no-ops unless federation_start() succeeded
+void federation_publish_message(uint32_t sender, std::string_view nick, std::string_view room,
+                                const std::string_view *messages, size_t count);
+void federation_publish_direct(uint32_t sender, std::string_view nick, uint32_t recipient, std::string_view text);
+void federation_publish_presence(uint32_t uid, std::string_view nick, bool online);
+
+FederationStats federation_stats();
+
+#endif
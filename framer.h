@@ -0,0 +1,184 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <cstring>
+#include <string_view>
+
+#include "buffer_pool.h"
+#include "text_scan.h"
+
+// Per-connection input buffer that splits a byte stream into '\n'-terminated lines,
+// or into length-prefixed frames.
+//
+// Data is received straight into the free space at the end of the buffer. Complete
+// lines are handed out as views into the buffer, a partial tail simply stays where
+// it is until the rest arrives; it is only moved to the front when the buffer runs
+// out of room at the end. Lines longer than max_line are dropped up to their
+// terminating '\n' and reported through overflowed(). The search for the '\n' is a
+// scan_line() that checks UTF-8 and finds the trailing whitespace on the way.
+//
+// The buffer is borrowed from the buffer pool with the first write_ptr(), and can be
+// given back with release() whenever everything received was handed out.
+class LineFramer {
+public:
+    explicit LineFramer(size_t max_line = 2048, size_t read_chunk = 2048)
+        : max_line_(max_line), read_chunk_(read_chunk) {}
+
+    ~LineFramer() {
+        buffer_pool_release(buffer_, capacity_);
+    }
+
+    LineFramer(const LineFramer&) = delete;
+    LineFramer &operator=(const LineFramer&) = delete;
+
+    // free space to recv() into, at least read_chunk bytes
+    char *write_ptr() {
+        reserve();
+        return buffer_ + tail_;
+    }
+
+    size_t write_space() const {
+        return capacity_ - tail_;
+    }
+
+    // account for n bytes written at write_ptr()
+    void commit(size_t n) {
+        tail_ += n;
+    }
+
+    // copy bytes in, for callers that already hold the data elsewhere
+    void append(const char *data, size_t n) {
+        while (n > 0) {
+            char *dst = write_ptr();
+            size_t chunk = n < write_space() ? n : write_space();
+            memcpy(dst, data, chunk);
+            commit(chunk);
+            data += chunk;
+            n -= chunk;
+        }
+    }
+
+    // next complete line without its '\n'; the view is valid until the next write_ptr()
+    bool next_line(std::string_view &line) {
+        LineScan scan;
+        return next_line(line, scan);
+    }
+
+    // the same, with what the scan found out about the line: scan.content is its
+    // length without trailing whitespace, scan.valid whether it is well-formed UTF-8
+    bool next_line(std::string_view &line, LineScan &scan) {
+        while (head_ < tail_) {
+            const char *start = buffer_ + head_;
+            if (!scan_line(start, tail_ - head_, scan_)) {
+                if (tail_ - head_ > max_line_) {
+                    // no terminator within the limit, drop what we have and skip to the next '\n'
+                    discarding_ = true;
+                    overflowed_ = true;
+                    head_ = tail_;
+                    scan_ = LineScan();
+                }
+                break;
+            }
+
+            size_t length = scan_.scanned;
+            scan = scan_;
+            scan_ = LineScan();
+            head_ += length + 1;
+            if (discarding_ || length > max_line_) {
+                discarding_ = false;
+                overflowed_ = true;
+                continue;
+            }
+            line = std::string_view(start, length);
+            return true;
+        }
+        if (head_ == tail_) head_ = tail_ = 0;
+        return false;
+    }
+
+    // next frame of a length-prefixed stream: a 4-byte big-endian length and that many
+    // bytes, viewed without the length; valid until the next write_ptr(). A length
+    // above max_frame cannot be skipped reliably, it discards the whole input and is
+    // reported through overflowed()
+    bool next_frame(std::string_view &frame, size_t max_frame) {
+        if (tail_ - head_ >= 4) {
+            const unsigned char *start = reinterpret_cast<const unsigned char*>(buffer_ + head_);
+            size_t length = static_cast<size_t>(start[0]) << 24 | start[1] << 16 | start[2] << 8 | start[3];
+            if (length > max_frame) {
+                overflowed_ = true;
+                head_ = tail_;
+                scan_ = LineScan();
+            } else if (tail_ - head_ - 4 >= length) {
+                frame = std::string_view(buffer_ + head_ + 4, length);
+                head_ += 4 + length;
+                scan_ = LineScan();
+                return true;
+            }
+        }
+        if (head_ == tail_) head_ = tail_ = 0;
+        return false;
+    }
+
+    // true once if a line was dropped for exceeding max_line since the last call
+    bool overflowed() {
+        bool result = overflowed_;
+        overflowed_ = false;
+        return result;
+    }
+
+    // bytes of an incomplete line held back for the next read
+    size_t pending() const {
+        return tail_ - head_;
+    }
+
+    // give the buffer back to the pool if nothing is pending, the next write_ptr()
+    // borrows one again
+    void release() {
+        if (head_ != tail_ || !buffer_) return;
+        buffer_pool_release(buffer_, capacity_);
+        buffer_ = nullptr;
+        capacity_ = 0;
+        head_ = tail_ = 0;
+    }
+
+    // true while a buffer is borrowed
+    bool holds_buffer() const {
+        return buffer_ != nullptr;
+    }
+
+    // everything received that next_line() has not handed out yet
+    std::string_view buffered() const {
+        return std::string_view(buffer_ + head_, tail_ - head_);
+    }
+
+private:
+    void reserve() {
+        if (capacity_ - tail_ >= read_chunk_) return;
+        if (head_ > 0) {
+            // slide the partial tail to the front, this is the only copy a line ever gets
+            memmove(buffer_, buffer_ + head_, tail_ - head_);
+            tail_ -= head_;
+            head_ = 0;
+        }
+        if (capacity_ - tail_ < read_chunk_) {
+            size_t capacity;
+            char *grown = buffer_pool_acquire(tail_ + read_chunk_, capacity);
+            if (tail_ > 0) memcpy(grown, buffer_, tail_);
+            buffer_pool_release(buffer_, capacity_);
+            buffer_ = grown;
+            capacity_ = capacity;
+        }
+    }
+
+    char *buffer_ = nullptr;
+    size_t capacity_ = 0;
+    size_t head_ = 0;   // start of the first unconsumed line
+    size_t tail_ = 0;   // end of received data
+    size_t max_line_;
+    size_t read_chunk_;
+    LineScan scan_;     // of the line at head_, so far
+    bool discarding_ = false;
+    bool overflowed_ = false;
+};
+
+#endif
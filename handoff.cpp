@@ -0,0 +1,316 @@
+#include "handoff.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define HANDOFF_CHUNK 16384             // input and output bytes per record
+#define HANDOFF_MAX_RECORD (HANDOFF_CHUNK + 4096)
+#define HANDOFF_REQUEST_TIMEOUT_MS 1000
+#define HANDOFF_VERSION 3               // bump with every change to the records
+
+// record types; every record is one SEQPACKET message starting with its type
+#define RECORD_REQUEST 'T'    // u32 version, successor asks for the state
+#define RECORD_LISTENER 'L'   // u32 shard, the socket attached
+#define RECORD_CLIENT 'C'     // ClientRecord, name, rooms, the socket attached
+#define RECORD_INPUT 'I'      // bytes for the input of the last client
+#define RECORD_OUTPUT 'O'     // bytes for the output of the last client
+#define RECORD_END 'E'        // EndRecord
+#define RECORD_ACK 'A'        // successor took everything over
+
+using namespace std;
+
+namespace {
+
+struct ClientRecord {
+    uint32_t shard;
+    struct sockaddr_in address;
+    int32_t uid;
+    uint8_t joined;
+    uint8_t room_aware;
+    uint8_t binary;
+    uint8_t compression;
+    uint16_t name_length;
+    uint16_t room_count;      // each room is a length byte and the name
+    uint32_t input_length;
+    uint32_t output_length;
+};
+
+struct EndRecord {
+    int32_t next_uid;
+    uint32_t listeners;
+    uint32_t clients;
+};
+
+bool unix_address(const string &path, struct sockaddr_un &addr) {
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR("error: upgrade socket path too long\n");
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// send one record, with fd attached unless it is negative
+bool send_record(int sock, char type, const void *data, size_t length, int fd = -1) {
+    struct iovec iov[2] = {{&type, 1}, {const_cast<void*>(data), length}};
+    struct msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+// receive one record into buffer; returns its length including the type byte, 0 at
+// the end of the stream and -1 on error. fd is the attached socket or -1
+ssize_t receive_record(int sock, char *buffer, size_t size, int &fd) {
+    struct iovec iov = {buffer, size};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    fd = -1;
+    ssize_t length;
+    while ((length = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) return -1;
+    return length;
+}
+
+// send data as a series of records of type, HANDOFF_CHUNK bytes at most each
+bool send_chunks(int sock, char type, const string &data) {
+    for (size_t offset = 0; offset < data.size(); offset += HANDOFF_CHUNK) {
+        size_t length = min(data.size() - offset, static_cast<size_t>(HANDOFF_CHUNK));
+        if (!send_record(sock, type, data.data() + offset, length)) return false;
+    }
+    return true;
+}
+
+bool send_client(int sock, const HandoffClient &client) {
+    ClientRecord record{};
+    record.shard = client.shard;
+    record.address = client.address;
+    record.uid = client.uid;
+    record.joined = client.joined;
+    record.room_aware = client.room_aware;
+    record.binary = client.binary;
+    record.compression = client.compression;
+    record.name_length = static_cast<uint16_t>(client.name.size());
+    record.room_count = static_cast<uint16_t>(client.rooms.size());
+    record.input_length = static_cast<uint32_t>(client.input.size());
+    record.output_length = static_cast<uint32_t>(client.output.size());
+
+    string body(reinterpret_cast<const char*>(&record), sizeof(record));
+    body += client.name;
+    for (const string &room : client.rooms) {
+        body += static_cast<char>(room.size());
+        body += room;
+    }
+    return send_record(sock, RECORD_CLIENT, body.data(), body.size(), client.fd) &&
+           send_chunks(sock, RECORD_INPUT, client.input) &&
+           send_chunks(sock, RECORD_OUTPUT, client.output);
+}
+
+// parse the body of a RECORD_CLIENT into client; false if it is malformed
+bool parse_client(const char *body, size_t length, HandoffClient &client, ClientRecord &record) {
+    if (length < sizeof(record)) return false;
+    memcpy(&record, body, sizeof(record));
+    size_t offset = sizeof(record);
+    if (offset + record.name_length > length) return false;
+    client.shard = record.shard;
+    client.address = record.address;
+    client.uid = record.uid;
+    client.joined = record.joined;
+    client.room_aware = record.room_aware;
+    client.binary = record.binary;
+    client.compression = record.compression;
+    client.name.assign(body + offset, record.name_length);
+    offset += record.name_length;
+    for (unsigned i = 0; i < record.room_count; i++) {
+        if (offset >= length) return false;
+        size_t room_length = static_cast<unsigned char>(body[offset++]);
+        if (offset + room_length > length) return false;
+        client.rooms.emplace_back(body + offset, room_length);
+        offset += room_length;
+    }
+    client.input.reserve(record.input_length);
+    client.output.reserve(record.output_length);
+    return offset == length;
+}
+
+void close_all(HandoffState &state) {
+    for (int fd : state.listeners) {
+        if (fd >= 0) close(fd);
+    }
+    for (HandoffClient &client : state.clients) {
+        if (client.fd >= 0) close(client.fd);
+    }
+    state = HandoffState{};
+}
+
+}  // namespace
+
+int handoff_listen(const string &path) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    // the socket hands out every connection of the server, only its owner may connect
+    mode_t mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0 || listen(fd, 4) < 0) {
+        LOG_ERROR("error: upgrade socket %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const string &path) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool handoff_request(int fd, HandoffState &state) {
+    uint32_t version = HANDOFF_VERSION;
+    if (!send_record(fd, RECORD_REQUEST, &version, sizeof(version))) return false;
+
+    // the predecessor drains its clients first, so this may take a while
+    char buffer[HANDOFF_MAX_RECORD];
+    HandoffClient *client = nullptr;
+    ClientRecord record{};
+    while (true) {
+        int attached;
+        ssize_t length = receive_record(fd, buffer, sizeof(buffer), attached);
+        if (length <= 0) break;
+        const char *body = buffer + 1;
+        size_t body_length = length - 1;
+
+        switch (buffer[0]) {
+        case RECORD_LISTENER: {
+            uint32_t shard;
+            if (attached < 0 || body_length != sizeof(shard)) break;
+            memcpy(&shard, body, sizeof(shard));
+            if (shard >= state.listeners.size()) state.listeners.resize(shard + 1, -1);
+            state.listeners[shard] = attached;
+            continue;
+        }
+        case RECORD_CLIENT:
+            state.clients.emplace_back();
+            client = &state.clients.back();
+            client->fd = attached;
+            if (attached < 0 || !parse_client(body, body_length, *client, record)) break;
+            continue;
+        case RECORD_INPUT:
+            if (!client || client->input.size() + body_length > record.input_length) break;
+            client->input.append(body, body_length);
+            continue;
+        case RECORD_OUTPUT:
+            if (!client || client->output.size() + body_length > record.output_length) break;
+            client->output.append(body, body_length);
+            continue;
+        case RECORD_END: {
+            EndRecord end;
+            if (body_length != sizeof(end)) break;
+            memcpy(&end, body, sizeof(end));
+            if (end.listeners != state.listeners.size() || end.clients != state.clients.size()) break;
+            if (client && (client->input.size() != record.input_length ||
+                           client->output.size() != record.output_length)) {
+                break;
+            }
+            state.next_uid = end.next_uid;
+            if (!send_record(fd, RECORD_ACK, nullptr, 0)) break;
+            return true;
+        }
+        }
+        if (attached >= 0 && (!client || client->fd != attached)) close(attached);
+        break;
+    }
+    LOG_ERROR("error: handoff from the running server failed\n");
+    close_all(state);
+    return false;
+}
+
+bool handoff_await_request(int fd) {
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 || peer.uid != getuid()) {
+        LOG_ERROR("error: upgrade request from another user refused\n");
+        return false;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, HANDOFF_REQUEST_TIMEOUT_MS) <= 0) return false;
+    char buffer[16];
+    int attached;
+    ssize_t received = receive_record(fd, buffer, sizeof(buffer), attached);
+    if (attached >= 0) close(attached);
+    uint32_t version;
+    if (received != 1 + sizeof(version) || buffer[0] != RECORD_REQUEST) return false;
+    memcpy(&version, buffer + 1, sizeof(version));
+    if (version != HANDOFF_VERSION) {
+        LOG_ERROR("error: upgrade request with handoff version %u refused, this server speaks %u\n",
+                  version, HANDOFF_VERSION);
+        return false;
+    }
+    return true;
+}
+
+bool handoff_send(int fd, const HandoffState &state) {
+    for (size_t i = 0; i < state.listeners.size(); i++) {
+        uint32_t shard = static_cast<uint32_t>(i);
+        if (!send_record(fd, RECORD_LISTENER, &shard, sizeof(shard), state.listeners[i])) return false;
+    }
+    for (const HandoffClient &client : state.clients) {
+        if (!send_client(fd, client)) return false;
+    }
+    EndRecord end = {state.next_uid, static_cast<uint32_t>(state.listeners.size()),
+                     static_cast<uint32_t>(state.clients.size())};
+    if (!send_record(fd, RECORD_END, &end, sizeof(end))) return false;
+
+    // no timeout: giving up while the successor may still go ahead would leave two
+    // servers on the same connections; if it dies the read ends with EOF instead
+    char ack;
+    ssize_t received;
+    while ((received = recv(fd, &ack, 1, 0)) < 0 && errno == EINTR) {}
+    return received == 1 && ack == RECORD_ACK;
+}
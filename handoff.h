@@ -0,0 +1,59 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+// Hot upgrade handoff between two server processes.
+//
+// A running server listens on a Unix SOCK_SEQPACKET socket. A successor started
+// with the same socket path connects to it and asks for the server's state; the
+// listening sockets and every client connection travel as SCM_RIGHTS, each with
+// the session state needed to carry on serving it. The predecessor exits once the
+// successor acknowledged, the connections themselves never notice.
+//
+// Only the predecessor's uid and peers running as the same user may take over, and
+// only with the same handoff format version.
+
+// one client connection and its session
+struct HandoffClient {
+    int fd = -1;
+    int shard = 0;                   // event loop that served it in the predecessor
+    struct sockaddr_in address{};
+    int uid = 0;
+    bool joined = false;             // sent a valid NICK, otherwise still in the handshake
+    bool room_aware = false;
+    bool binary = false;             // switched to HELLO 2 frames
+    uint8_t compression = 0;         // how the output is compressed, as the server numbers it
+    std::string name;
+    std::vector<std::string> rooms;  // rooms the client is in, in joining order
+    std::string input;               // received, not processed yet
+    std::string output;              // queued, not sent yet
+};
+
+struct HandoffState {
+    std::vector<int> listeners;      // by shard
+    std::vector<HandoffClient> clients;
+    int next_uid = 0;
+};
+
+// bind and listen on the upgrade socket at path, replacing a stale socket file; -1 on error
+int handoff_listen(const std::string &path);
+
+// successor: connect to the server at path; -1 if none is running there
+int handoff_connect(const std::string &path);
+
+// successor: ask for the predecessor's state and acknowledge it; on false every
+// descriptor received is closed again and the predecessor keeps running
+bool handoff_request(int fd, HandoffState &state);
+
+// predecessor: wait for the request of a connection accepted on the upgrade
+// socket; false if it is none, or comes from another user
+bool handoff_await_request(int fd);
+
+// predecessor: send state and wait for the acknowledgement; after true the
+// successor serves everything that was sent
+bool handoff_send(int fd, const HandoffState &state);
+
+#endif
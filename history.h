@@ -0,0 +1,68 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "shared_buffer.h"
+
+#define HISTORY_LINE_BYTES 320   // longest line kept, a room MSG at every length limit fits
+
+// Fixed-size ring of the most recent lines relayed in one room, kept exactly as
+// they were sent so a replay is a copy of bytes with no formatting or parsing.
+// Not synchronized, the owner serializes add() and collect().
+class History {
+public:
+    explicit History(size_t capacity) : slots_(capacity) {}
+
+    size_t capacity() const { return slots_.size(); }
+
+    // lines in the ring, at most its capacity
+    size_t stored() const { return next_ < slots_.size() ? next_ : slots_.size(); }
+
+    // remember line, overwriting the oldest one once the ring is full
+    void add(uint64_t time_ns, std::string_view line) {
+        if (slots_.empty() || line.size() > HISTORY_LINE_BYTES) return;
+        Slot &slot = slots_[next_ % slots_.size()];
+        slot.time_ns = time_ns;
+        slot.length = static_cast<uint16_t>(line.size());
+        memcpy(slot.line, line.data(), line.size());
+        next_++;
+    }
+
+    // the last count lines that were added at or after since_ns, oldest first, in one
+    // buffer; lines is set to the number of lines it holds
+    SharedBuffer *collect(size_t count, uint64_t since_ns, size_t &lines) const {
+        if (count > stored()) count = stored();
+
+        size_t first = next_;
+        size_t total = 0;
+        while (first > next_ - count && slot(first - 1).time_ns >= since_ns) {
+            first--;
+            total += slot(first).length;
+        }
+
+        SharedBuffer *buffer = SharedBuffer::create(total);
+        for (size_t i = first; i < next_; i++) {
+            buffer->append(std::string_view(slot(i).line, slot(i).length));
+        }
+        lines = next_ - first;
+        return buffer;
+    }
+
+private:
+    struct Slot {
+        uint64_t time_ns = 0;
+        uint16_t length = 0;
+        char line[HISTORY_LINE_BYTES];
+    };
+
+    const Slot &slot(size_t sequence) const { return slots_[sequence % slots_.size()]; }
+
+    std::vector<Slot> slots_;
+    size_t next_ = 0;   // sequence number of the next line, the total added so far
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+// Socket I/O of one event loop, behind an interface with two implementations:
+//
+//   epoll     readiness based; reads until EAGAIN and sends synchronously
+//   io_uring  completion based; multishot accept and recv into a provided buffer
+//             ring, sends complete asynchronously, and everything queued during
+//             a tick is submitted with the wait of the next poll() in one syscall
+//
+// The engine reports what happened through an IoHandler and never owns the
+// connections; it only refers to them until release() says it is done.
+
+// engine-side view of a connection; the server's client type derives from it
+struct IoConnection {
+    int sockfd = -1;
+    void *io_state = nullptr;   // engine bookkeeping, if the engine needs any
+    bool paused = false;        // between IoEngine::pause() and resume(), set by the engine
+};
+
+// what the event loop does with the I/O its engine reports
+class IoHandler {
+public:
+    virtual ~IoHandler() = default;
+
+    // a new non-blocking connection was accepted on the listener
+    virtual void on_accept(int fd, const struct sockaddr_in &address) = 0;
+
+    // the wakeup descriptor given to add_wakeup() was signalled
+    virtual void on_wakeup() = 0;
+
+    // where the next bytes received for conn go, nullptr once conn takes no more input
+    virtual char *read_buffer(IoConnection *conn, size_t &length) = 0;
+
+    // length bytes were stored at read_buffer(); 0 means the peer closed the connection
+    virtual void on_read(IoConnection *conn, size_t length) = 0;
+
+    // the engine can take more output for conn: the socket became writable, or an
+    // asynchronous send() finished and sent bytes of it went out
+    virtual void on_writable(IoConnection *conn, size_t sent) = 0;
+
+    // a receive or send on conn failed with error
+    virtual void on_error(IoConnection *conn, int error) = 0;
+
+    // the engine dropped its last reference to a connection release() kept
+    virtual void on_released(IoConnection *conn) = 0;
+};
+
+class IoEngine {
+public:
+    virtual ~IoEngine() = default;
+
+    virtual const char *name() const = 0;
+
+    // true if send() may complete later, through on_writable(), instead of right away
+    virtual bool asynchronous() const = 0;
+
+    // start accepting on a listening socket
+    virtual bool add_listener(int fd) = 0;
+
+    // stop accepting; connections the engine already accepted are still reported
+    virtual void remove_listener() = 0;
+
+    // report every signal of an eventfd through on_wakeup()
+    virtual bool add_wakeup(int fd) = 0;
+
+    // start receiving on conn->sockfd
+    virtual bool add_connection(IoConnection *conn) = 0;
+
+    // stop receiving on conn until resume(), leaving what arrives in the socket buffer;
+    // bytes the engine already took off the socket still go through on_read()
+    virtual void pause(IoConnection *conn) = 0;
+
+    // receive on conn again, including what arrived while it was paused
+    virtual void resume(IoConnection *conn) = 0;
+
+    // stop all I/O on conn before its socket is closed; false if operations are still
+    // in flight, on_released() follows once they are done. Bytes those operations
+    // already took off the socket still go through read_buffer() and on_read()
+    virtual bool release(IoConnection *conn) = 0;
+
+    // send iov to conn: returns the bytes sent, or -1 with errno set; EINPROGRESS means
+    // the send completes through on_writable() and iov's bytes must stay put until then.
+    // The iovec array itself is copied
+    virtual ssize_t send(IoConnection *conn, const struct iovec *iov, int count, int flags) = 0;
+
+    // hand queued operations to the kernel now instead of with the next poll()
+    virtual void submit() = 0;
+
+    // wait up to timeout_ms (-1 without limit) and dispatch what happened; returns
+    // the number of events, or -1 with errno set
+    virtual int poll(int timeout_ms) = 0;
+};
+
+IoEngine *create_epoll_engine(IoHandler &handler);
+
+// nullptr if the kernel lacks io_uring or any of the features the engine uses
+IoEngine *create_uring_engine(IoHandler &handler);
+
+#endif
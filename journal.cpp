@@ -0,0 +1,404 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define JOURNAL_PREFIX "journal-"
+#define JOURNAL_SUFFIX ".seg"
+#define JOURNAL_SPARE JOURNAL_PREFIX "spare" JOURNAL_SUFFIX
+#define JOURNAL_ALIGN 8
+#define JOURNAL_MAGIC "cserverd jrnl 1"   // with its NUL, the segment header
+
+using namespace std;
+
+namespace {
+
+// on-disk record header, followed by the room name and the line, padded to
+// JOURNAL_ALIGN; a zero length marks the end of the data in a segment. Segments
+// start with JOURNAL_MAGIC
+struct RecordHeader {
+    uint32_t length;        // whole record including header and padding
+    uint16_t room_length;
+    uint16_t line_length;
+    uint64_t time_ns;
+    uint64_t previous;      // position of the room's record before this one, 0 if none
+};
+
+// one mapped segment file; unmapped with the last reference, so a reader that took
+// one keeps it mapped while the sync thread expires it
+struct Segment {
+    uint64_t sequence;      // 0 for the spare until it is taken
+    int fd;                 // -1 for a segment of an earlier run, mapped read-only
+    char *base;
+    size_t size;
+    size_t written = 0;     // appended bytes, guarded by append_mutex
+    size_t synced = 0;      // bytes known to be on disk, only touched by the sync thread
+
+    Segment(uint64_t sequence, int fd, char *base, size_t size) : sequence(sequence), fd(fd), base(base), size(size) {}
+    Segment(const Segment&) = delete;
+    Segment &operator=(const Segment&) = delete;
+    ~Segment() {
+        munmap(base, size);
+        if (fd >= 0) close(fd);
+    }
+};
+
+JournalConfig settings;
+mutex append_mutex;
+shared_ptr<Segment> current;
+shared_ptr<Segment> spare;                  // mapped by the sync thread for the next switch, if ready
+vector<shared_ptr<Segment>> retired;        // full segments waiting for their final sync
+deque<shared_ptr<Segment>> kept;            // the segment files on disk, oldest first
+unordered_map<string, uint64_t> last_record;  // position of the newest record of each room
+uint64_t next_sequence = 0;
+
+atomic<bool> running(false);
+atomic<uint64_t> appended(0);
+atomic<uint64_t> syncs(0);
+mutex wake_mutex;
+condition_variable wake;
+thread syncer;
+
+string segment_path(uint64_t sequence) {
+    char name[64];
+    snprintf(name, sizeof(name), JOURNAL_PREFIX "%010llu" JOURNAL_SUFFIX, (unsigned long long)sequence);
+    return settings.directory + "/" + name;
+}
+
+size_t padded(size_t length) {
+    return (length + JOURNAL_ALIGN - 1) & ~static_cast<size_t>(JOURNAL_ALIGN - 1);
+}
+
+// a record is found by the sequence number of its segment plus one and its offset
+uint64_t position(uint64_t sequence, size_t offset) {
+    return (sequence + 1) << 32 | offset;
+}
+
+string spare_path() {
+    return settings.directory + "/" JOURNAL_SPARE;
+}
+
+// create, size and map a segment file, and write its header
+shared_ptr<Segment> create_segment(const string &path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("error: journal %s: %s\n", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+    if (ftruncate(fd, settings.segment_bytes) < 0) {
+        LOG_ERROR("error: journal %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    void *base = mmap(nullptr, settings.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("error: journal mmap %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    auto segment = make_shared<Segment>(0, fd, static_cast<char*>(base), settings.segment_bytes);
+    memcpy(segment->base, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    segment->written = sizeof(JOURNAL_MAGIC);
+    return segment;
+}
+
+// the segment to append to once the current one is full: the spare under its
+// sequence number, or, if the sync thread has none ready, one created here.
+// append_mutex held
+shared_ptr<Segment> next_segment() {
+    uint64_t sequence = next_sequence++;
+    string path = segment_path(sequence);
+    shared_ptr<Segment> segment = move(spare);
+    if (segment && rename(spare_path().c_str(), path.c_str()) < 0) {
+        LOG_ERROR("error: journal %s: %s\n", path.c_str(), strerror(errno));
+        segment = nullptr;
+    }
+    if (!segment) segment = create_segment(path);
+    if (!segment) return nullptr;
+    segment->sequence = sequence;
+    kept.push_back(segment);
+    wake.notify_one();   // for the next spare
+    return segment;
+}
+
+// map a spare segment unless one is ready; the file work is done without the lock,
+// and only the sync thread makes spares
+void prepare_spare() {
+    {
+        lock_guard<mutex> guard(append_mutex);
+        if (spare) return;
+    }
+    shared_ptr<Segment> segment = create_segment(spare_path());
+    if (!segment) return;
+    lock_guard<mutex> guard(append_mutex);
+    spare = move(segment);
+}
+
+// msync the appended part of segment that is not known to be on disk yet
+void sync_segment(Segment *segment, size_t written) {
+    if (written <= segment->synced) return;
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = segment->synced & ~(page - 1);
+    if (msync(segment->base + start, written - start, MS_SYNC) < 0) {
+        LOG_ERROR("error: journal msync: %s\n", strerror(errno));
+    }
+    segment->synced = written;
+    syncs.fetch_add(1, memory_order_relaxed);
+}
+
+// one group commit: flush the retired segments, then the current one, and delete
+// the segments beyond the retention count
+void sync_once() {
+    vector<shared_ptr<Segment>> full, expired;
+    shared_ptr<Segment> segment;
+    size_t written;
+    {
+        lock_guard<mutex> guard(append_mutex);
+        full.swap(retired);
+        segment = current;
+        written = segment ? segment->written : 0;
+        while (kept.size() > settings.keep_segments) {
+            expired.push_back(move(kept.front()));
+            kept.pop_front();
+        }
+        if (!expired.empty()) {
+            // chains into the deleted segments end there
+            uint64_t oldest = position(kept.front()->sequence, 0);
+            for (auto it = last_record.begin(); it != last_record.end();) {
+                it = it->second < oldest ? last_record.erase(it) : next(it);
+            }
+        }
+    }
+
+    // a full segment stays mapped for HISTORY, but no longer counts as resident
+    for (const shared_ptr<Segment> &old : full) {
+        sync_segment(old.get(), old->written);
+        madvise(old->base, old->size, MADV_DONTNEED);
+    }
+    if (segment) sync_segment(segment.get(), written);
+    for (const shared_ptr<Segment> &old : expired) unlink(segment_path(old->sequence).c_str());
+}
+
+void sync_loop() {
+    while (running.load(memory_order_acquire)) {
+        {
+            unique_lock<mutex> lock(wake_mutex);
+            wake.wait_for(lock, chrono::milliseconds(settings.sync_ms));
+        }
+        sync_once();
+        prepare_spare();
+    }
+    sync_once();
+    lock_guard<mutex> guard(append_mutex);
+    if (spare) {
+        spare = nullptr;
+        unlink(spare_path().c_str());
+    }
+}
+
+// whether the record at offset of segment is whole and consistent
+bool whole_record(const Segment &segment, size_t offset, RecordHeader &header) {
+    if (offset + sizeof(header) > segment.size) return false;
+    memcpy(&header, segment.base + offset, sizeof(header));
+    size_t body = static_cast<size_t>(header.room_length) + header.line_length;
+    // a zero or inconsistent header is the end of the data, or a record torn by a crash
+    return header.length != 0 && header.length == padded(sizeof(header) + body) &&
+           offset + header.length <= segment.size;
+}
+
+// feed every complete record of a segment of an earlier run to replay, and link the
+// rooms' chains through it
+void replay_records(Segment &segment, size_t offset, JournalReplay replay) {
+    RecordHeader header;
+    while (whole_record(segment, offset, header)) {
+        const char *room = segment.base + offset + sizeof(header);
+        string_view room_name(room, header.room_length);
+        replay(room_name, header.time_ns, string_view(room + header.room_length, header.line_length));
+        last_record[string(room_name)] = position(segment.sequence, offset);
+        offset += header.length;
+    }
+    segment.written = offset;
+}
+
+// map the segment file of an earlier run and replay it
+shared_ptr<Segment> replay_segment(uint64_t sequence, JournalReplay replay) {
+    string path = segment_path(sequence);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return nullptr;
+
+    auto segment = make_shared<Segment>(sequence, -1, static_cast<char*>(mapped), size);
+    if (size < sizeof(JOURNAL_MAGIC) || memcmp(segment->base, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        LOG_ERROR("error: %s is not a journal segment, skipped\n", path.c_str());
+        return nullptr;
+    }
+    replay_records(*segment, sizeof(JOURNAL_MAGIC), replay);
+    madvise(segment->base, segment->size, MADV_DONTNEED);
+    return segment;
+}
+
+}  // namespace
+
+bool journal_open(const JournalConfig &config, JournalReplay replay) {
+    settings = config;
+    if (settings.keep_segments < 1) settings.keep_segments = 1;
+    // offsets in a segment are 32 bits
+    settings.segment_bytes = min<size_t>(settings.segment_bytes, UINT32_MAX & ~(JOURNAL_ALIGN - 1));
+    mkdir(settings.directory.c_str(), 0755);
+
+    DIR *dir = opendir(settings.directory.c_str());
+    if (!dir) {
+        LOG_ERROR("error: journal directory %s: %s\n", settings.directory.c_str(), strerror(errno));
+        return false;
+    }
+    vector<uint64_t> existing;
+    while (struct dirent *entry = readdir(dir)) {
+        unsigned long long sequence;
+        char suffix[8];
+        if (sscanf(entry->d_name, JOURNAL_PREFIX "%llu%7s", &sequence, suffix) == 2 &&
+            strcmp(suffix, JOURNAL_SUFFIX) == 0) {
+            existing.push_back(sequence);
+        }
+    }
+    closedir(dir);
+    sort(existing.begin(), existing.end());
+    unlink(spare_path().c_str());   // left by a crash, empty
+
+    for (uint64_t sequence : existing) {
+        if (shared_ptr<Segment> segment = replay_segment(sequence, replay)) kept.push_back(move(segment));
+    }
+    next_sequence = existing.empty() ? 0 : existing.back() + 1;
+
+    {
+        lock_guard<mutex> guard(append_mutex);
+        current = next_segment();
+    }
+    if (!current) return false;
+    running.store(true, memory_order_release);
+
+    // signals are for the server's own threads
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    syncer = thread(sync_loop);
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    return true;
+}
+
+void journal_close() {
+    if (!running.exchange(false)) return;
+    wake.notify_one();
+    syncer.join();
+}
+
+void journal_append(const JournalRecord *records, size_t count) {
+    thread_local string key;
+    lock_guard<mutex> guard(append_mutex);
+    size_t total = 0;
+    uint64_t *last = nullptr;
+    for (size_t i = 0; i < count && current; i++) {
+        string_view room = records[i].room, line = records[i].line;
+        size_t length = padded(sizeof(RecordHeader) + room.size() + line.size());
+        if (length > settings.segment_bytes - sizeof(JOURNAL_MAGIC)) continue;
+        if (current->written + length > current->size) {
+            // the rest of the old segment is still zero, which ends its data
+            retired.push_back(current);
+            current = next_segment();
+            if (!current) break;
+        }
+        if (i == 0 || room != records[i - 1].room) {
+            key.assign(room);
+            last = &last_record[key];
+        }
+
+        char *record = current->base + current->written;
+        RecordHeader header = {static_cast<uint32_t>(length), static_cast<uint16_t>(room.size()),
+                               static_cast<uint16_t>(line.size()), records[i].time_ns, *last};
+        *last = position(current->sequence, current->written);
+        memcpy(record + sizeof(header), room.data(), room.size());
+        memcpy(record + sizeof(header) + room.size(), line.data(), line.size());
+        memcpy(record, &header, sizeof(header));
+        current->written += length;
+        total += length;
+    }
+    appended.fetch_add(total, memory_order_relaxed);
+}
+
+size_t journal_recent(string_view room, size_t count, uint64_t since_ns, size_t max_bytes, string &out,
+                      bool &truncated) {
+    truncated = false;
+    vector<shared_ptr<Segment>> segments;
+    uint64_t next;
+    {
+        lock_guard<mutex> guard(append_mutex);
+        auto it = last_record.find(string(room));
+        if (it == last_record.end()) return 0;
+        next = it->second;
+        segments.assign(kept.begin(), kept.end());
+    }
+
+    // newest first down the room's chain; the records were all complete when the
+    // lock was released, and the segments stay mapped while referenced here
+    vector<string_view> lines;
+    size_t bytes = 0;
+    while (next != 0 && lines.size() < count) {
+        uint64_t sequence = (next >> 32) - 1;
+        size_t offset = next & 0xFFFFFFFF;
+        auto segment = lower_bound(segments.begin(), segments.end(), sequence,
+                                   [](const shared_ptr<Segment> &s, uint64_t n) { return s->sequence < n; });
+        RecordHeader header;
+        if (segment == segments.end() || (*segment)->sequence != sequence || !whole_record(**segment, offset, header)) {
+            break;
+        }
+        const char *name = (*segment)->base + offset + sizeof(header);
+        if (string_view(name, header.room_length) != room || header.time_ns < since_ns) break;
+        string_view line(name + header.room_length, header.line_length);
+        if (bytes + line.size() > max_bytes) {
+            truncated = true;
+            break;
+        }
+        bytes += line.size();
+        lines.push_back(line);
+        // always further back, so damaged data cannot make a loop
+        if (header.previous >= next) break;
+        next = header.previous;
+    }
+
+    out.reserve(out.size() + bytes);
+    for (auto line = lines.rbegin(); line != lines.rend(); ++line) out.append(*line);
+    return lines.size();
+}
+
+uint64_t journal_bytes() {
+    return appended.load(memory_order_relaxed);
+}
+
+uint64_t journal_syncs() {
+    return syncs.load(memory_order_relaxed);
+}
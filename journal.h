@@ -0,0 +1,60 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Append-only journal of relayed chat lines.
+//
+// Records are copied into a memory-mapped segment file; when a segment is full the
+// next one is started and the oldest beyond the retention count are deleted. A
+// background thread msyncs what was appended once per sync interval, so many
+// appends share one flush (group commit) and no append waits for the disk. It also
+// creates and maps the next segment ahead of time, an append that fills one only
+// renames that file and switches to it.
+//
+// Each record holds the room, a wall-clock timestamp, the line exactly as it was
+// sent to clients and the position of the room's record before it, so the lines of
+// one room are found from the newest back without reading anything else. Segments
+// stay mapped until they are deleted, and HISTORY reaches back through all of them.
+
+struct JournalConfig {
+    std::string directory;                       // journal disabled if empty
+    size_t segment_bytes = 64 * 1024 * 1024;     // size of one segment file, below 4 GiB
+    unsigned keep_segments = 8;                  // segments kept on disk, the newest included
+    int sync_ms = 50;                            // group commit interval
+};
+
+// called by journal_open() for every record already on disk, oldest first; room
+// and line point into the mapped segment and are only valid during the call
+typedef void (*JournalReplay)(std::string_view room, uint64_t time_ns, std::string_view line);
+
+// replay the existing segments, start a new one and the sync thread; false on error
+bool journal_open(const JournalConfig &config, JournalReplay replay);
+
+// sync everything appended so far and stop the sync thread
+void journal_close();
+
+// a line relayed in room, to append
+struct JournalRecord {
+    std::string_view room;
+    uint64_t time_ns;
+    std::string_view line;
+};
+
+// append count records in order, all under one lock; lines that do not fit an empty
+// segment are not journaled
+void journal_append(const JournalRecord *records, size_t count);
+
+// the last count lines of room appended at or after since_ns, oldest first, added to
+// out as long as they fit in max_bytes in all; truncated is set when older ones in
+// range did not fit. Returns the number of lines. Thread safe
+size_t journal_recent(std::string_view room, size_t count, uint64_t since_ns, size_t max_bytes, std::string &out,
+                      bool &truncated);
+
+// bytes appended and msync calls made since journal_open()
+uint64_t journal_bytes();
+uint64_t journal_syncs();
+
+#endif
@@ -0,0 +1,380 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <csignal>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "framer.h"
+#include "loadgen.h"
+#include "metrics.h"
+#include "protocol.h"
+
+#define LOAD_MAX_EVENTS 1024
+#define LOAD_CONNECT_TIMEOUT_NS 10000000000ull  // give up on sessions not joined after 10s
+#define LOAD_DRAIN_NS 1000000000ull             // keep reading for 1s after the last send
+
+using namespace std;
+
+namespace {
+
+// command line settings of the load generator
+struct LoadOptions {
+    string host;
+    string port;
+    int sessions = 100;
+    double rate = 1.0;       // messages per second per session, 0 only listens
+    int size = 64;           // message text length in bytes
+    double duration = 10.0;  // seconds of traffic
+};
+
+// one simulated chat user
+struct Session {
+    enum State { Connecting, AwaitHello, AwaitOk, Running, Closed };
+
+    int fd = -1;
+    int index = 0;
+    State state = Connecting;
+    LineFramer framer{2048, 4096};
+    string outbuf;          // bytes the socket did not take yet
+    uint64_t nextSend = 0;  // monotonic time of the next message
+};
+
+// totals over all sessions
+struct LoadStats {
+    uint64_t joined = 0;
+    uint64_t failed = 0;
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t bytesIn = 0;
+    Histogram latency;       // send to delivery, per recipient, in ns
+};
+
+volatile sig_atomic_t loadInterrupted = 0;
+
+void loadSignalHandler(int) {
+    loadInterrupted = 1;
+}
+
+uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+void printLoadUsage(const char *program) {
+    cerr << "usage: " << program << " --load <ip:port> [--sessions N] [--rate MSGS_PER_SEC] [--size BYTES]"
+         << " [--duration SECONDS]" << endl;
+}
+
+bool parseLoadOptions(int argc, char *argv[], LoadOptions &options) {
+    if (argc < 3) return false;
+    string serverInfo = argv[2];
+    size_t colonPos = serverInfo.find(':');
+    if (colonPos == string::npos) return false;
+    options.host = serverInfo.substr(0, colonPos);
+    options.port = serverInfo.substr(colonPos + 1);
+
+    for (int i = 3; i < argc; i++) {
+        string option = argv[i];
+        if (i + 1 >= argc) return false;
+        const char *value = argv[++i];
+        if (option == "--sessions") options.sessions = atoi(value);
+        else if (option == "--rate") options.rate = atof(value);
+        else if (option == "--size") options.size = atoi(value);
+        else if (option == "--duration") options.duration = atof(value);
+        else return false;
+    }
+    return options.sessions > 0 && options.rate >= 0 && options.size >= 24 && options.size <= 255 &&
+           options.duration > 0;
+}
+
+// allow one descriptor per session
+void raiseDescriptorLimit(int sessions) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return;
+    rlim_t wanted = sessions + 64;
+    if (limit.rlim_cur >= wanted) return;
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? wanted : min(wanted, limit.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+// write what the socket accepts, keep the rest for EPOLLOUT
+bool sessionWrite(Session &session, const char *data, size_t length) {
+    if (session.outbuf.empty()) {
+        ssize_t sent = send(session.fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            sent = 0;
+        }
+        if (static_cast<size_t>(sent) == length) return true;
+        data += sent;
+        length -= sent;
+    }
+    session.outbuf.append(data, length);
+    return true;
+}
+
+bool sessionFlush(Session &session) {
+    while (!session.outbuf.empty()) {
+        ssize_t sent = send(session.fd, session.outbuf.data(), session.outbuf.size(), MSG_NOSIGNAL);
+        if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        session.outbuf.erase(0, sent);
+    }
+    return true;
+}
+
+void closeSession(Session &session, LoadStats &stats) {
+    if (session.state == Session::Closed) return;
+    if (session.state != Session::Running) stats.failed++;
+    session.state = Session::Closed;
+    close(session.fd);
+}
+
+// "MSG <nick> <timestamp> <padding>": record how long the message took to get here
+void recordDelivery(string_view line, LoadStats &stats, uint64_t now) {
+    if (line.compare(0, 4, "MSG ") != 0) return;
+    size_t stampStart = line.find(' ', 4);
+    if (stampStart == string_view::npos) return;
+    uint64_t stamp = 0;
+    size_t i = stampStart + 1;
+    bool digits = false;
+    for (; i < line.size() && line[i] >= '0' && line[i] <= '9'; i++) {
+        stamp = stamp * 10 + (line[i] - '0');
+        digits = true;
+    }
+    if (!digits || stamp > now) return;  // not one of ours
+    stats.delivered++;
+    stats.latency.record(now - stamp);
+}
+
+void handleSessionLine(Session &session, string_view line, const LoadOptions &options, LoadStats &stats, uint64_t now) {
+    switch (session.state) {
+    case Session::AwaitHello:
+        if (line.compare(0, 7, "HELLO 1") == 0) {
+            string nick = "NICK L" + to_string(getpid() % 10000) + "_" + to_string(session.index) + "\n";
+            if (!sessionWrite(session, nick.data(), nick.size())) closeSession(session, stats);
+            session.state = Session::AwaitOk;
+        } else {
+            closeSession(session, stats);
+        }
+        break;
+    case Session::AwaitOk:
+        if (line.compare(0, 2, "OK") == 0) {
+            session.state = Session::Running;
+            stats.joined++;
+            // spread the first messages over one interval so sessions do not send in lockstep
+            if (options.rate > 0) {
+                uint64_t interval = static_cast<uint64_t>(1e9 / options.rate);
+                session.nextSend = now + (interval * static_cast<uint64_t>(session.index % 997)) / 997;
+            }
+        } else {
+            closeSession(session, stats);
+        }
+        break;
+    case Session::Running:
+        if (line == "PING") {
+            // keepalive of an idle server, sessions that stopped sending stay connected
+            if (!sessionWrite(session, PONG_MESSAGE, strlen(PONG_MESSAGE))) closeSession(session, stats);
+            break;
+        }
+        recordDelivery(line, stats, now);
+        break;
+    default:
+        break;
+    }
+}
+
+void readSession(Session &session, const LoadOptions &options, LoadStats &stats) {
+    while (session.state != Session::Closed) {
+        char *space = session.framer.write_ptr();
+        ssize_t received = recv(session.fd, space, session.framer.write_space(), 0);
+        if (received > 0) {
+            session.framer.commit(received);
+            stats.bytesIn += received;
+            uint64_t now = monotonicNs();
+            string_view line;
+            while (session.state != Session::Closed && session.framer.next_line(line)) {
+                handleSessionLine(session, line, options, stats, now);
+            }
+        } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (received < 0 && errno == EINTR) {
+            continue;
+        } else {
+            closeSession(session, stats);
+        }
+    }
+}
+
+// start a non-blocking connect for every session
+bool connectSessions(vector<Session> &sessions, const LoadOptions &options, int epollFd, LoadStats &stats) {
+    struct addrinfo hints{}, *serverInfo;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &serverInfo) != 0) {
+        cerr << "error: error resolving server address." << endl;
+        return false;
+    }
+
+    for (Session &session : sessions) {
+        session.fd = socket(serverInfo->ai_family, serverInfo->ai_socktype | SOCK_NONBLOCK, serverInfo->ai_protocol);
+        if (session.fd < 0) {
+            cerr << "error: error creating socket: " << strerror(errno) << endl;
+            session.state = Session::Closed;
+            stats.failed++;
+            continue;
+        }
+        int one = 1;
+        setsockopt(session.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(session.fd, serverInfo->ai_addr, serverInfo->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            closeSession(session, stats);
+            continue;
+        }
+
+        struct epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &session;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, session.fd, &ev);
+    }
+    freeaddrinfo(serverInfo);
+    return true;
+}
+
+// send every message that is due; the payload starts with the send time
+void sendDueMessages(vector<Session> &sessions, const LoadOptions &options, LoadStats &stats, uint64_t now,
+                     string &message) {
+    uint64_t interval = static_cast<uint64_t>(1e9 / options.rate);
+    for (Session &session : sessions) {
+        if (session.state != Session::Running) continue;
+        while (session.nextSend <= now && session.state == Session::Running) {
+            string stamp = to_string(now);
+            memcpy(&message[4], stamp.data(), stamp.size());
+            message[4 + stamp.size()] = ' ';
+            if (!sessionWrite(session, message.data(), message.size())) {
+                closeSession(session, stats);
+                break;
+            }
+            stats.sent++;
+            session.nextSend += interval;
+        }
+    }
+}
+
+void printLatency(const char *label, const HistogramSnapshot &snapshot, double quantile) {
+    printf("  %-6s %10.3f ms\n", label, snapshot.quantile(quantile) / 1e6);
+}
+
+}  // namespace
+
+int runLoad(int argc, char *argv[]) {
+    LoadOptions options;
+    if (!parseLoadOptions(argc, argv, options)) {
+        printLoadUsage(argv[0]);
+        return 1;
+    }
+    signal(SIGINT, loadSignalHandler);
+    signal(SIGPIPE, SIG_IGN);
+    raiseDescriptorLimit(options.sessions);
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        cerr << "error: epoll_create1 failed." << endl;
+        return 1;
+    }
+
+    vector<Session> sessions(options.sessions);
+    for (int i = 0; i < options.sessions; i++) sessions[i].index = i;
+
+    LoadStats stats;
+    cout << "load: " << options.sessions << " sessions to " << options.host << ":" << options.port << ", "
+         << options.rate << " msg/s each, " << options.size << " bytes, " << options.duration << "s" << endl;
+    uint64_t start = monotonicNs();
+    if (!connectSessions(sessions, options, epollFd, stats)) return 1;
+
+    // "MSG <stamp> xxxx...\n" with the text exactly options.size bytes long
+    string message = "MSG " + string(options.size, 'x') + "\n";
+
+    struct epoll_event events[LOAD_MAX_EVENTS];
+    uint64_t trafficStart = 0, trafficEnd = 0, lastReport = start;
+    uint64_t lastDelivered = 0;
+    while (!loadInterrupted) {
+        uint64_t now = monotonicNs();
+        bool connecting = stats.joined + stats.failed < static_cast<uint64_t>(options.sessions);
+        if (trafficStart == 0 && (!connecting || now - start > LOAD_CONNECT_TIMEOUT_NS)) {
+            trafficStart = now;
+            trafficEnd = now + static_cast<uint64_t>(options.duration * 1e9);
+            cout << "load: " << stats.joined << " sessions joined, " << stats.failed << " failed in "
+                 << (now - start) / 1000000 << " ms" << endl;
+        }
+        if (trafficStart && now > trafficEnd + LOAD_DRAIN_NS) break;
+
+        if (trafficStart && now < trafficEnd && options.rate > 0) {
+            sendDueMessages(sessions, options, stats, now, message);
+        }
+        if (trafficStart && now - lastReport >= 1000000000ull) {
+            double seconds = (now - lastReport) / 1e9;
+            printf("load: t=%.0fs sent=%llu delivered=%llu (%.0f/s)\n", (now - trafficStart) / 1e9,
+                   (unsigned long long)stats.sent, (unsigned long long)stats.delivered,
+                   (stats.delivered - lastDelivered) / seconds);
+            fflush(stdout);
+            lastReport = now;
+            lastDelivered = stats.delivered;
+        }
+
+        int ready = epoll_wait(epollFd, events, LOAD_MAX_EVENTS, 1);
+        for (int i = 0; i < ready; i++) {
+            Session &session = *static_cast<Session*>(events[i].data.ptr);
+            if (session.state == Session::Closed) continue;
+            if (session.state == Session::Connecting && (events[i].events & (EPOLLOUT | EPOLLIN))) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(session.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error != 0) {
+                    closeSession(session, stats);
+                    continue;
+                }
+                session.state = Session::AwaitHello;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                readSession(session, options, stats);
+            }
+            if ((events[i].events & EPOLLOUT) && session.state != Session::Closed && !sessionFlush(session)) {
+                closeSession(session, stats);
+            }
+        }
+    }
+
+    uint64_t end = trafficEnd && trafficEnd < monotonicNs() ? trafficEnd : monotonicNs();
+    double seconds = trafficStart ? (end - trafficStart) / 1e9 : 0;
+    HistogramSnapshot latency;
+    stats.latency.add_to(latency);
+
+    printf("load: done\n");
+    printf("  sessions   %d joined %llu failed %llu\n", options.sessions, (unsigned long long)stats.joined,
+           (unsigned long long)stats.failed);
+    printf("  sent       %llu messages (%.0f/s)\n", (unsigned long long)stats.sent, seconds > 0 ? stats.sent / seconds : 0);
+    printf("  delivered  %llu messages (%.0f/s), %.1f MB\n", (unsigned long long)stats.delivered,
+           seconds > 0 ? stats.delivered / seconds : 0, stats.bytesIn / 1e6);
+    printf("fan-out latency (send to delivery):\n");
+    printLatency("p50", latency, 0.5);
+    printLatency("p99", latency, 0.99);
+    printLatency("p999", latency, 0.999);
+    printLatency("max", latency, 1.0);
+
+    for (Session &session : sessions) {
+        if (session.state != Session::Closed) close(session.fd);
+    }
+    close(epollFd);
+    return stats.joined > 0 ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+// cchat --load: drive many chat sessions from one process and report delivery
+// throughput and latency. argv[1] is "--load"; returns the process exit code.
+int runLoad(int argc, char *argv[]);
+
+#endif
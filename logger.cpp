@@ -0,0 +1,198 @@
+#include "logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <signal.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 8192      // records, power of two
+#define LOG_RECORD_TEXT 496     // longest record, longer ones are truncated
+#define LOG_BATCH_SIZE 65536    // bytes gathered per write()
+
+using namespace std;
+
+namespace {
+
+// one slot of the ring; sequence tells producers and the writer whose turn it is
+struct LogRecord {
+    atomic<size_t> sequence;
+    LogLevel level;
+    uint16_t length;
+    char text[LOG_RECORD_TEXT];
+};
+
+LogRecord ring[LOG_RING_SIZE];
+atomic<size_t> enqueue_pos(0);
+size_t dequeue_pos = 0;             // only touched by the writer thread
+
+atomic<uint8_t> max_level(static_cast<uint8_t>(LogLevel::Info));
+atomic<bool> content_enabled(true);
+atomic<uint64_t> dropped(0);
+atomic<bool> running(false);
+atomic<bool> writer_idle(false);
+
+mutex wake_mutex;
+condition_variable wake;
+thread writer;
+
+// gather records per output stream and write each stream once per batch
+struct Batch {
+    int fd;
+    size_t length = 0;
+    char data[LOG_BATCH_SIZE];
+
+    explicit Batch(int fd) : fd(fd) {}
+
+    void add(const char *text, size_t n) {
+        if (length + n > sizeof(data)) flush();
+        memcpy(data + length, text, n);
+        length += n;
+    }
+
+    void flush() {
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n = write(fd, data + written, length - written);
+            if (n <= 0) break;  // nowhere left to report it
+            written += n;
+        }
+        length = 0;
+    }
+};
+
+Batch out_batch(STDOUT_FILENO);
+Batch err_batch(STDERR_FILENO);
+
+// move every published record into the batches; returns the number of records taken
+size_t drain_ring() {
+    size_t taken = 0;
+    while (true) {
+        LogRecord &record = ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (record.sequence.load(memory_order_acquire) != dequeue_pos + 1) break;
+        Batch &batch = record.level == LogLevel::Error ? err_batch : out_batch;
+        batch.add(record.text, record.length);
+        record.sequence.store(dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        dequeue_pos++;
+        taken++;
+    }
+    return taken;
+}
+
+void writer_loop() {
+    uint64_t reported_drops = 0;
+    while (true) {
+        bool stopping = !running.load(memory_order_acquire);
+        size_t taken = drain_ring();
+
+        uint64_t drops = dropped.load(memory_order_relaxed);
+        if (drops != reported_drops) {
+            char note[96];
+            int n = snprintf(note, sizeof(note), "warning: %llu log records dropped\n",
+                             static_cast<unsigned long long>(drops - reported_drops));
+            err_batch.add(note, n);
+            reported_drops = drops;
+        }
+        out_batch.flush();
+        err_batch.flush();
+
+        if (stopping) break;
+        if (taken == 0) {
+            // producers only pay for a wakeup when they find the writer asleep
+            unique_lock<mutex> lock(wake_mutex);
+            writer_idle.store(true, memory_order_release);
+            wake.wait_for(lock, chrono::milliseconds(100));
+            writer_idle.store(false, memory_order_relaxed);
+        }
+    }
+}
+
+}  // namespace
+
+void logger_start(LogLevel level, bool log_content) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].sequence.store(i, memory_order_relaxed);
+    }
+    max_level.store(static_cast<uint8_t>(level), memory_order_relaxed);
+    content_enabled.store(log_content, memory_order_relaxed);
+    running.store(true, memory_order_release);
+
+    // signals are for the server's own threads, never the writer
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    writer = thread(writer_loop);
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+
+void logger_stop() {
+    if (!running.exchange(false)) return;
+    wake.notify_one();
+    writer.join();
+}
+
+bool log_enabled(LogLevel level) {
+    return static_cast<uint8_t>(level) <= max_level.load(memory_order_relaxed);
+}
+
+bool log_content_enabled() {
+    return content_enabled.load(memory_order_relaxed);
+}
+
+uint64_t log_dropped() {
+    return dropped.load(memory_order_relaxed);
+}
+
+void log_message(LogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    if (!running.load(memory_order_relaxed)) {
+        // before start or after stop there is no writer, write straight through
+        vfprintf(level == LogLevel::Error ? stderr : stdout, format, args);
+        fflush(level == LogLevel::Error ? stderr : stdout);
+        va_end(args);
+        return;
+    }
+
+    // claim a slot; a slot still holding an unwritten record means the ring is full
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    LogRecord *record;
+    while (true) {
+        record = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t sequence = record->sequence.load(memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (difference == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            va_end(args);
+            return;
+        } else {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+
+    // format straight into the slot, the writer only looks at it once it is published
+    int length = vsnprintf(record->text, LOG_RECORD_TEXT, format, args);
+    va_end(args);
+    if (length < 0) {
+        length = 0;
+    } else if (length >= LOG_RECORD_TEXT) {
+        length = LOG_RECORD_TEXT - 1;
+        record->text[length - 1] = '\n';  // keep truncated records on their own line
+    }
+    record->level = level;
+    record->length = static_cast<uint16_t>(length);
+    record->sequence.store(pos + 1, memory_order_release);
+
+    // a wakeup racing with the writer going to sleep is lost, the wait timeout bounds the delay
+    if (writer_idle.load(memory_order_relaxed) && writer_idle.exchange(false, memory_order_acq_rel)) {
+        wake.notify_one();
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <cstdint>
+
+// Asynchronous logging for the server.
+//
+// log_message() formats into a slot of a lock-free ring and returns; a background
+// thread writes the records out in batches, errors to stderr and everything else
+// to stdout. When the ring is full the record is dropped and counted rather than
+// making the caller wait.
+
+enum class LogLevel : uint8_t {
+    Error = 0,
+    Info = 1,
+    Debug = 2
+};
+
+// start the writer thread; records above level are discarded at the call site
+void logger_start(LogLevel level, bool log_content);
+
+// write out everything queued so far and stop the writer thread
+void logger_stop();
+
+bool log_enabled(LogLevel level);
+
+// true if relayed chat lines should be logged with their text
+bool log_content_enabled();
+
+// records lost because the ring was full
+uint64_t log_dropped();
+
+void log_message(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_ERROR(...) do { if (log_enabled(LogLevel::Error)) log_message(LogLevel::Error, __VA_ARGS__); } while (0)
+#define LOG_INFO(...) do { if (log_enabled(LogLevel::Info)) log_message(LogLevel::Info, __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) do { if (log_enabled(LogLevel::Debug)) log_message(LogLevel::Debug, __VA_ARGS__); } while (0)
+
+#endif
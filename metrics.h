@@ -0,0 +1,117 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Counters and histograms written by exactly one thread and read by any.
+//
+// Updates are a relaxed load and store of the owner's own cache line, no locked
+// instruction and no shared state; readers sum the per-thread instances.
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+#define HISTOGRAM_SUB_BITS 4                            // 16 sub-buckets, about 6% resolution
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// plain copy of one or more histograms, for computing quantiles
+struct HistogramSnapshot {
+    uint64_t counts[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    // upper bound of the bucket that holds the q-th quantile
+    uint64_t quantile(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return bucket_upper(i);
+        }
+        return bucket_upper(HISTOGRAM_BUCKETS - 1);
+    }
+
+    static uint64_t bucket_upper(int index) {
+        int magnitude = index >> HISTOGRAM_SUB_BITS;
+        uint64_t sub = index & (HISTOGRAM_SUB_BUCKETS - 1);
+        if (magnitude == 0) return sub;
+        return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (magnitude - 1)) - 1;
+    }
+};
+
+// HDR-style log-linear histogram: values are grouped by their highest set bit and
+// each power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets
+class Histogram {
+public:
+    void record(uint64_t value) {
+        bump(counts_[bucket_of(value)], 1);
+        bump(count_, 1);
+        bump(sum_, value);
+    }
+
+    void add_to(HistogramSnapshot &snapshot) const {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            snapshot.counts[i] += counts_[i].load(std::memory_order_relaxed);
+        }
+        snapshot.count += count_.load(std::memory_order_relaxed);
+        snapshot.sum += sum_.load(std::memory_order_relaxed);
+    }
+
+    static int bucket_of(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) return static_cast<int>(value);
+        int magnitude = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+        int sub = static_cast<int>((value >> (magnitude - 1)) - HISTOGRAM_SUB_BUCKETS);
+        return (magnitude << HISTOGRAM_SUB_BITS) + sub;
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &slot, uint64_t n) {
+        slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts_[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+};
+
+// Prometheus text exposition helpers
+
+inline void write_metric_header(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+inline void write_metric(std::string &out, const char *name, const char *type, const char *help, uint64_t value) {
+    write_metric_header(out, name, type, help);
+    out += name; out += ' '; out += std::to_string(value); out += '\n';
+}
+
+// a histogram as a summary with fixed quantiles; scale converts recorded units to the exposed unit
+inline void write_summary(std::string &out, const char *name, const char *help,
+                          const HistogramSnapshot &snapshot, double scale) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    char line[160];
+    write_metric_header(out, name, "summary", help);
+    for (double q : quantiles) {
+        snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9g\n", name, q, snapshot.quantile(q) * scale);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.9g\n%s_count %llu\n", name, snapshot.sum * scale, name,
+             static_cast<unsigned long long>(snapshot.count));
+    out += line;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "shared_buffer.h"
+
+#define SPARE_OUTPUT_QUEUES 1024   // empty queues a thread keeps for reuse
+
+// Outbound messages of a connection, oldest first. A deque costs a map and a 512-byte
+// node even when empty, so an idle connection has none: one is borrowed from the
+// thread's spare queues with the first message and given back once the last message
+// is gone, keeping its memory for the next connection with output pending.
+class OutputQueue {
+public:
+    using iterator = std::deque<BufferRef>::iterator;
+
+    OutputQueue() = default;
+    ~OutputQueue() { clear(); }
+
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue &operator=(const OutputQueue&) = delete;
+
+    bool empty() const { return !queue_; }
+    size_t size() const { return queue_ ? queue_->size() : 0; }
+
+    BufferRef &front() { return queue_->front(); }
+
+    // value-initialized deque iterators compare equal, so an empty queue iterates fine
+    iterator begin() { return queue_ ? queue_->begin() : iterator(); }
+    iterator end() { return queue_ ? queue_->end() : iterator(); }
+
+    void push_back(BufferRef message) {
+        borrow();
+        queue_->push_back(std::move(message));
+    }
+
+    void pop_front() {
+        queue_->pop_front();
+        if (queue_->empty()) give_back();
+    }
+
+    // insert message before the one at index
+    void insert(size_t index, BufferRef message) {
+        borrow();
+        queue_->insert(queue_->begin() + index, std::move(message));
+    }
+
+    void erase(iterator first, iterator last) {
+        queue_->erase(first, last);
+        if (queue_->empty()) give_back();
+    }
+
+    void erase(iterator position) { erase(position, position + 1); }
+
+    void clear() {
+        if (!queue_) return;
+        queue_->clear();
+        give_back();
+    }
+
+private:
+    // empty deques kept by a thread; freed when the thread ends
+    struct Spares {
+        std::vector<std::deque<BufferRef>*> queues;
+
+        ~Spares() {
+            for (auto *queue : queues) delete queue;
+        }
+    };
+
+    static Spares &spares() {
+        static thread_local Spares spares;
+        return spares;
+    }
+
+    void borrow() {
+        if (queue_) return;
+        auto &queues = spares().queues;
+        if (queues.empty()) {
+            queue_ = new std::deque<BufferRef>;
+        } else {
+            queue_ = queues.back();
+            queues.pop_back();
+        }
+    }
+
+    void give_back() {
+        auto &queues = spares().queues;
+        if (queues.size() < SPARE_OUTPUT_QUEUES) {
+            queues.push_back(queue_);
+        } else {
+            delete queue_;
+        }
+        queue_ = nullptr;
+    }
+
+    std::deque<BufferRef> *queue_ = nullptr;
+};
+
+#endif
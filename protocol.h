@@ -0,0 +1,288 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+
+#include "shared_buffer.h"
+
+#define MAX_NAME_LENGTH 12
+#define MAX_MESSAGE_LENGTH 255
+#define MAX_ROOM_LENGTH 32
+#define LOBBY_ROOM_NAME "#lobby"
+
+// keepalive: a client silent for a while is sent "PING\n" and answers "PONG\n", in a
+// FRAME_TEXT on HELLO 2; one that does not answer in time is disconnected
+#define PING_MESSAGE "PING\n"
+#define PONG_MESSAGE "PONG\n"
+
+// HELLO 2, the binary protocol. A client answers the "HELLO 1" greeting with
+// "HELLO 2\n" instead of NICK, the server confirms with "HELLO 2\n", and from then
+// on both directions carry frames:
+//
+//   u32 length   big-endian, the bytes after this field
+//   u8  type
+//   body
+//
+// The length is at most MAX_FRAME_LENGTH, a client's frames leave 4 bytes of
+// that for the sender id the server puts in front when relaying them.
+//
+//   FRAME_NICK   client: the nickname, answered with FRAME_TEXT "OK\n" or "ERROR\n"
+//   FRAME_MSG    client: u8 room length, the room (empty for the lobby), then any
+//                number of messages, each a u16 big-endian length and the text.
+//                server: u32 sender id, then the same; a client frame is relayed as
+//                one frame for every 256 messages in it
+//   FRAME_TEXT   client: one text protocol command without its '\n' (JOIN, PRIVMSG ...)
+//                server: text protocol lines with their '\n' (OK, ERROR, replays, PRIVMSG)
+//   FRAME_WHO    client: u32 sender id, answered with
+//   FRAME_USER   server: u32 id and the nickname, empty if nobody has that id
+#define HELLO_BINARY "HELLO 2"
+#define FRAME_HEADER_LENGTH 5
+#define MAX_FRAME_LENGTH 65536
+
+enum FrameType : uint8_t {
+    FRAME_NICK = 1,
+    FRAME_MSG = 2,
+    FRAME_TEXT = 3,
+    FRAME_WHO = 4,
+    FRAME_USER = 5
+};
+
+inline void store_u16(char *out, uint16_t value) {
+    out[0] = static_cast<char>(value >> 8);
+    out[1] = static_cast<char>(value);
+}
+
+inline void store_u32(char *out, uint32_t value) {
+    out[0] = static_cast<char>(value >> 24);
+    out[1] = static_cast<char>(value >> 16);
+    out[2] = static_cast<char>(value >> 8);
+    out[3] = static_cast<char>(value);
+}
+
+inline uint16_t load_u16(const char *in) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(in);
+    return static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+}
+
+inline uint32_t load_u32(const char *in) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(in);
+    return static_cast<uint32_t>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+// Character classes of the chat protocol, computed at compile time so that
+// checking a nickname is a table lookup per byte without any allocation.
+struct NickTable {
+    bool allowed[256] = {};
+
+    constexpr NickTable() {
+        for (int c = 'A'; c <= 'Z'; c++) allowed[c] = true;
+        for (int c = 'a'; c <= 'z'; c++) allowed[c] = true;
+        for (int c = '0'; c <= '9'; c++) allowed[c] = true;
+        allowed[static_cast<unsigned char>('_')] = true;
+    }
+};
+
+constexpr NickTable nick_table;
+
+// same rule as the regex ^[A-Za-z0-9_]+$, limited to MAX_NAME_LENGTH characters
+constexpr bool valid_nickname(std::string_view nick) {
+    if (nick.empty() || nick.size() > MAX_NAME_LENGTH) return false;
+    for (char c : nick) {
+        if (!nick_table.allowed[static_cast<unsigned char>(c)]) return false;
+    }
+    return true;
+}
+
+static_assert(valid_nickname("Alice_42"), "nickname validator rejects a valid nick");
+static_assert(!valid_nickname("bad-nick"), "nickname validator accepts a bad nick");
+static_assert(!valid_nickname("thirteenchars"), "nickname validator ignores the length limit");
+
+// "#" followed by up to MAX_ROOM_LENGTH nickname characters
+constexpr bool valid_room_name(std::string_view room) {
+    if (room.size() < 2 || room.size() > MAX_ROOM_LENGTH + 1 || room[0] != '#') return false;
+    for (char c : room.substr(1)) {
+        if (!nick_table.allowed[static_cast<unsigned char>(c)]) return false;
+    }
+    return true;
+}
+
+// the nickname argument of a "NICK <name>" line, empty if the line is not a NICK command
+inline std::string_view parse_nick_command(std::string_view line) {
+    if (line.compare(0, 5, "NICK ") != 0) return std::string_view();
+    std::string_view rest = line.substr(5);
+    size_t end = rest.find_first_of(" \t\r");
+    return rest.substr(0, end);
+}
+
+// the text of a "MSG <text>" line without trailing whitespace; false if the line is not a MSG command
+inline bool parse_msg_command(std::string_view line, std::string_view &message) {
+    if (line.compare(0, 4, "MSG ") != 0) return false;
+    message = line.substr(4);
+    size_t last = message.find_last_not_of(" \n\r\t");
+    message = message.substr(0, last == std::string_view::npos ? 0 : last + 1);
+    return true;
+}
+
+// split "PRIVMSG <nick> <text>" into the recipient and the text without trailing
+// whitespace; false if the line is not a PRIVMSG command or names nobody
+inline bool parse_privmsg_command(std::string_view line, std::string_view &nick, std::string_view &text) {
+    if (line.compare(0, 8, "PRIVMSG ") != 0) return false;
+    std::string_view rest = line.substr(8);
+    size_t space = rest.find(' ');
+    nick = rest.substr(0, space);
+    text = space == std::string_view::npos ? std::string_view() : rest.substr(space + 1);
+    size_t last = text.find_last_not_of(" \n\r\t");
+    text = text.substr(0, last == std::string_view::npos ? 0 : last + 1);
+    return !nick.empty();
+}
+
+// whether line is a "PONG" command, with or without an argument
+inline bool is_pong_command(std::string_view line) {
+    return line.compare(0, 4, "PONG") == 0 && (line.size() == 4 || line[4] == ' ' || line[4] == '\r');
+}
+
+// the room argument of a "<verb> #room" line such as "JOIN #room", empty if the verb does not match
+inline std::string_view parse_room_command(std::string_view line, std::string_view verb) {
+    if (line.size() <= verb.size() || line.compare(0, verb.size(), verb) != 0 || line[verb.size()] != ' ') {
+        return std::string_view();
+    }
+    std::string_view rest = line.substr(verb.size() + 1);
+    return rest.substr(0, rest.find_first_of(" \t\r"));
+}
+
+// split "#room text" into its room and text, false if message does not start with a room name
+inline bool split_room_message(std::string_view message, std::string_view &room, std::string_view &text) {
+    if (message.empty() || message[0] != '#') return false;
+    size_t space = message.find(' ');
+    room = message.substr(0, space);
+    text = space == std::string_view::npos ? std::string_view() : message.substr(space + 1);
+    return true;
+}
+
+// parse "HISTORY [#room] <count>" or "HISTORY [#room] <seconds>s"; room is left as is
+// when the line names none. False if the line is not a well-formed HISTORY command
+inline bool parse_history_command(std::string_view line, std::string_view &room, unsigned &amount, bool &seconds) {
+    if (line.compare(0, 8, "HISTORY ") != 0) return false;
+    std::string_view rest = line.substr(8);
+    size_t last = rest.find_last_not_of(" \n\r\t");
+    rest = rest.substr(0, last == std::string_view::npos ? 0 : last + 1);
+
+    size_t space = rest.find(' ');
+    if (space != std::string_view::npos) {
+        room = rest.substr(0, space);
+        rest = rest.substr(space + 1);
+    }
+    seconds = !rest.empty() && rest.back() == 's';
+    if (seconds) rest.remove_suffix(1);
+    if (rest.empty() || rest.size() > 9) return false;
+    amount = 0;
+    for (char c : rest) {
+        if (c < '0' || c > '9') return false;
+        amount = amount * 10 + (c - '0');
+    }
+    return true;
+}
+
+// a chat line as relayed to the other clients, "MSG <nick> <text>\n", in one shared allocation
+inline SharedBuffer *format_msg(std::string_view nick, std::string_view message) {
+    return SharedBuffer::concat({"MSG ", nick, " ", message, "\n"});
+}
+
+// a room-scoped chat line as relayed to the room's other members, "MSG <nick> #room <text>\n"
+inline SharedBuffer *format_room_msg(std::string_view nick, std::string_view room, std::string_view message) {
+    return SharedBuffer::concat({"MSG ", nick, " ", room, " ", message, "\n"});
+}
+
+// a direct message as delivered to its recipient, "PRIVMSG <nick> <text>\n" with the sender's nick
+inline SharedBuffer *format_privmsg(std::string_view nick, std::string_view message) {
+    return SharedBuffer::concat({"PRIVMSG ", nick, " ", message, "\n"});
+}
+
+// count chat lines from nick in one buffer, room-scoped unless room is empty
+inline SharedBuffer *format_msgs(std::string_view nick, std::string_view room, const std::string_view *messages,
+                                 size_t count) {
+    if (count == 1) return room.empty() ? format_msg(nick, messages[0]) : format_room_msg(nick, room, messages[0]);
+    size_t prefix = 4 + nick.size() + 1 + (room.empty() ? 0 : room.size() + 1);
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) total += prefix + messages[i].size() + 1;
+    SharedBuffer *buffer = SharedBuffer::create(total);
+    for (size_t i = 0; i < count; i++) {
+        buffer->append("MSG ");
+        buffer->append(nick);
+        buffer->append(" ");
+        if (!room.empty()) {
+            buffer->append(room);
+            buffer->append(" ");
+        }
+        buffer->append(messages[i]);
+        buffer->append("\n");
+    }
+    return buffer;
+}
+
+// a frame of type whose body is the concatenation of parts
+inline SharedBuffer *format_frame(FrameType type, std::initializer_list<std::string_view> parts) {
+    size_t body = 0;
+    for (std::string_view part : parts) body += part.size();
+    char header[FRAME_HEADER_LENGTH];
+    store_u32(header, static_cast<uint32_t>(body + 1));
+    header[4] = static_cast<char>(type);
+    SharedBuffer *buffer = SharedBuffer::create(sizeof(header) + body);
+    buffer->append(std::string_view(header, sizeof(header)));
+    for (std::string_view part : parts) buffer->append(part);
+    return buffer;
+}
+
+// FRAME_MSG carrying count messages to room; the server's frames start with the
+// sender id, pass sender as nullptr for a client's
+inline SharedBuffer *format_frame_msg(const uint32_t *sender, std::string_view room, const std::string_view *messages,
+                                      size_t count) {
+    size_t body = (sender ? 4 : 0) + 1 + room.size();
+    for (size_t i = 0; i < count; i++) body += 2 + messages[i].size();
+    char header[FRAME_HEADER_LENGTH + 5];
+    size_t length = FRAME_HEADER_LENGTH;
+    store_u32(header, static_cast<uint32_t>(body + 1));
+    header[4] = static_cast<char>(FRAME_MSG);
+    if (sender) {
+        store_u32(header + length, *sender);
+        length += 4;
+    }
+    header[length++] = static_cast<char>(room.size());
+
+    SharedBuffer *buffer = SharedBuffer::create(FRAME_HEADER_LENGTH + body);
+    buffer->append(std::string_view(header, length));
+    buffer->append(room);
+    for (size_t i = 0; i < count; i++) {
+        char prefix[2];
+        store_u16(prefix, static_cast<uint16_t>(messages[i].size()));
+        buffer->append(std::string_view(prefix, sizeof(prefix)));
+        buffer->append(messages[i]);
+    }
+    return buffer;
+}
+
+// split the body of a client's FRAME_MSG into its room and its encoded messages;
+// for a server's frame skip the sender id first. False if the body is malformed
+inline bool parse_frame_msg(std::string_view body, std::string_view &room, std::string_view &messages) {
+    if (body.empty()) return false;
+    size_t room_length = static_cast<unsigned char>(body[0]);
+    if (1 + room_length > body.size()) return false;
+    room = body.substr(1, room_length);
+    messages = body.substr(1 + room_length);
+    return true;
+}
+
+// take the next message off the encoded messages of a FRAME_MSG; false once none is
+// left, or if the rest is malformed, which leaves messages non-empty
+inline bool next_frame_message(std::string_view &messages, std::string_view &text) {
+    if (messages.size() < 2) return false;
+    size_t length = load_u16(messages.data());
+    if (2 + length > messages.size()) return false;
+    text = messages.substr(2, length);
+    messages.remove_prefix(2 + length);
+    return true;
+}
+
+#endif
@@ -1,11 +1,17 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <vector>
-#include <thread>
+#include <fstream>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
 #include <atomic>
-#include <regex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -15,10 +21,46 @@
 #include <signal.h>
 #include <cmath>
 #include <fcntl.h>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+
+#include "buffer_pool.h"
+#include "compression.h"
+#include "federation.h"
+#include "framer.h"
+#include "handoff.h"
+#include "history.h"
+#include "io_engine.h"
+#include "journal.h"
+#include "logger.h"
+#include "metrics.h"
+#include "output_queue.h"
+#include "protocol.h"
+#include "shared_buffer.h"
+#include "slot_map.h"
+#include "text_scan.h"
+#include "timing_wheel.h"
+#include "token_bucket.h"
 
 #define MAX_CLIENTS 50
+#define MAX_IOV 64
+#define ADMIN_READ_TIMEOUT_MS 200
+#define MAX_WORKERS 64
+#define MAX_ROOMS 65536
+#define MAX_ROOMS_PER_CLIENT 32
+#define MAX_FRAME_MESSAGES 256
+#define UPGRADE_POLL_MS 10
 #define MAX_BUFFER_SIZE 2048
-#define MAX_NAME_LENGTH 12
+#define MAX_INPUT_BACKLOG 65536   // unprocessed input of a client over its budget before reading pauses
+#define UID_NODE_SHIFT 22     // user ids: the node id above, a per-node counter below
+#define FIRST_UID 10          // counter values below are never given out
+#define MAX_NODE_ID 511
+#define TIMER_TICK_NS 10000000ull   // resolution of the client timers, 10 ms
 #define PROTOCOL_MESSAGE "HELLO 1\n"
 #define OK_MESSAGE "OK\n"
 #define ERROR_MESSAGE "ERROR\n"
@@ -26,113 +68,1646 @@
 using namespace std;
 
 atomic<unsigned int> client_count(0);
-int uid = 10;
+// set by the signal handler, read by every shard; lock-free, so the handler may store it
+atomic<bool> shutdown_requested(false);
+static_assert(atomic<bool>::is_always_lock_free, "the signal handler needs a lock-free flag");
+volatile sig_atomic_t dump_requested = 0;
+atomic<int> uid(FIRST_UID);
+atomic<int> binary_clients(0);   // clients on HELLO 2, relays are only framed while there are any
+uint64_t startup_resident = 0;   // resident bytes before the first connection, for the per-client metric
+
+struct Shard;
+struct Client;
+
+// what to do with a client whose outbound queue is over its limits
+enum class SlowPolicy { DropOldest, DropNewest, Disconnect };
+
+// what to do with a command over the client's rate limits: refuse it, or disconnect
+enum class RatePolicy { Error, Disconnect };
+
+// runtime settings taken from the command line
+struct ServerConfig {
+    int workers = 1;
+    unsigned max_clients = MAX_CLIENTS;  // admission limit over all shards, handshakes included
+    int handshake_timeout_ms = 5000;     // time a new connection gets to send NICK
+    int idle_timeout_ms = 60000;         // silence after which a client is sent PING, 0 never
+    int ping_timeout_ms = 30000;         // time it has to answer before it is disconnected
+    int stall_timeout_ms = 30000;        // longest queued output may wait without going out, 0 no limit
+    size_t queue_bytes = 256 * 1024;   // outbound high-water mark per client
+    size_t queue_msgs = 1024;          // outbound message limit per client
+    SlowPolicy slow_policy = SlowPolicy::Disconnect;
+    LogLevel log_level = LogLevel::Info;
+    bool log_content = true;           // log the text of every relayed message
+    string admin_path;                 // Unix socket serving metrics, none if empty
+    bool io_uring = false;             // use the io_uring engine where the kernel has it
+    int coalesce_us = 200;             // longest a reply waits for the end of the tick, 0 sends at once
+    size_t history = 64;               // recent lines kept per room for HISTORY
+    JournalConfig journal;             // on-disk message journal, off unless a directory is given
+    string upgrade_path;               // Unix socket for hot upgrades, none if empty
+    int upgrade_drain_ms = 2000;       // longest a hot upgrade waits for outbound queues to drain
+    int compress_level = 6;            // deflate level for COMPRESS clients, 0 refuses COMPRESS
+    RateLimit rate_msgs;               // commands per second of each client, unlimited by default
+    RateLimit rate_bytes;              // input bytes per second of each client
+    RatePolicy rate_policy = RatePolicy::Error;
+    unsigned input_budget = 64;        // commands of one client processed per tick, 0 for no limit
+    FederationConfig federation;       // links to other nodes, off unless a node id is given
+    string peer_secret_path;           // file holding the federation's shared secret
+};
+
+ServerConfig config;
+
+// wall clock in nanoseconds, for timestamps that outlive the process
+uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// monotonic clock in nanoseconds
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// a duration option in ms, in ns
+uint64_t ms_ns(int ms) {
+    return static_cast<uint64_t>(ms) * 1000000;
+}
+
+// how a client's output is compressed, see compression.h
+enum class Compression : uint8_t {
+    None,
+    Deflate,        // by the client's own context, when the output is flushed
+    DeflateShared   // when flushed as well, into a chunk shared by the clients sent the same
+};
+
+// where a connection is in the protocol
+enum class ClientState {
+    AwaitingNick,   // greeted with HELLO, waiting for NICK until its handshake deadline
+    Joined          // NICK accepted, client takes part in the chat
+};
+
+// chat room; membership is kept per shard so a fan-out only walks the room's members,
+// and each shard only ever touches its own member list. Every membership and every
+// broadcast on its way to a shard holds a reference, the room and its history are
+// freed with the last one
+struct Room {
+    string name;
+    atomic<int> references{0};
+    atomic<uint64_t> shard_mask{0};     // bit i is set while shard i has members in the room
+    vector<SlotMap<Client*>> members;   // indexed by shard
+    mutex history_lock;                 // shards relaying into the room take turns on history
+    unique_ptr<History> history;        // created with the first line relayed in the room
+};
+
+// room a client is in, with its entry in the room's member list
+struct Membership {
+    Room *room;
+    SlotHandle handle;
+};
 
-// client structure
-struct Client {
+// client structure; the socket lives in the IoConnection part, and the WheelTimer part
+// is its one timer in the shard's timing wheel, set for the earliest of its deadlines.
+// Clients come from the object pool, and their input and output buffers are only
+// borrowed while data is pending, so an idle connection costs well under 1 KiB
+struct Client : IoConnection, WheelTimer {
     struct sockaddr_in address;
-    int sockfd;
     int uid;
     string name;
+    Shard *shard;          // event loop that owns this client
+    SlotHandle handle;     // entry in the shard's handshake or client registry, by state
+    ClientState state = ClientState::AwaitingNick;
+    vector<Membership> rooms;   // the lobby for every client, plus rooms it joined
+    bool room_aware = false;    // sent JOIN at least once, "MSG #room" is always room-scoped
+    bool binary = false;        // negotiated HELLO 2, input and output are frames
+    Compression compression = Compression::None;
+    bool closing = false;  // scheduled for close at the end of the event loop tick
+    unique_ptr<Deflater> deflater;   // Compression::Deflate: the connection's context
+    OutputQueue outqueue;        // messages the kernel did not accept yet, oldest first
+    size_t outqueue_bytes = 0;   // unsent bytes in outqueue
+    size_t out_offset = 0;       // bytes of outqueue.front() already sent
+    size_t deflated = 0;         // leading outqueue messages already in their wire format; with
+                                 // compression on, the rest is compressed when flushed
+    size_t pinned = 0;           // leading outqueue messages an asynchronous send still reads
+    size_t pinned_bytes = 0;     // bytes that send asked for
+    uint64_t send_tick = 0;      // shard tick in which that send was started
+    size_t dropped = 0;          // messages discarded by the slow-consumer policy
+    bool dirty = false;          // has output queued this tick, listed in shard->dirty_clients
+    bool write_blocked = false;  // last send hit EAGAIN, nothing goes out before it is writable
+    TokenBucket message_tokens;  // --rate-msgs
+    TokenBucket byte_tokens;     // --rate-bytes
+    bool rate_limited = false;   // a command was refused since the last one admitted, ERROR sent
+    uint64_t input_tick = 0;     // shard tick input_used counts for
+    unsigned input_used = 0;     // commands processed in that tick
+    bool backlogged = false;     // input left when the budget ran out, listed in shard->backlogged
+    LineFramer framer{MAX_BUFFER_SIZE, MAX_BUFFER_SIZE};  // partial input carried across reads
+    uint64_t input_ns = 0;       // when input last arrived, or the client connected
+    uint64_t ping_ns = 0;        // when the PING it has not answered yet went out, 0 if none
+    uint64_t output_ns = 0;      // when queued output last went out, or a send was started
+
+    static void *operator new(size_t size) { return object_pool_allocate(size); }
+    static void operator delete(void *object, size_t size) { object_pool_deallocate(object, size); }
+};
+
+// rooms in use by name; only JOIN, and traffic of other nodes, looks names up
+struct RoomDirectory {
+    mutex lock;
+    unordered_map<string, Room*> rooms;
+};
+
+// a joined user and where its connection is
+struct UserEntry {
+    string name;
+    int shard = -1;       // shard serving it, -1 for a user of another node
+    SlotHandle handle;    // its entry in that shard's client registry
 };
 
-vector<Client*> clients(MAX_CLIENTS, nullptr);
-mutex clients_mutex;
+// every user of the chat space: by uid for binary clients resolving sender ids, and
+// by nickname, which is unique, for NICK and PRIVMSG
+struct UserDirectory {
+    mutex lock;
+    unordered_map<int, UserEntry> users;
+    unordered_map<string, int> uids;
+};
+
+// a relayed message in both wire formats; the frame is only built while binary
+// clients are connected
+struct Relay {
+    BufferRef text;
+    BufferRef frame;
+};
+
+// relayed lines waiting for the end of the tick to go into the history and journal
+// of their room; the sender's membership keeps the room alive until then, a shard
+// archives what it has before any of its clients leaves a room
+struct Archived {
+    Room *room;
+    uint64_t time_ns;
+    BufferRef lines;
+};
+
+// a deflate-shared chunk, with the messages it was compressed from; holding them
+// keeps their addresses, which shared_key() looks them up by, from being reused
+struct SharedChunk {
+    vector<BufferRef> parts;
+    BufferRef chunk;
+};
+
+// broadcast handed from one shard to another through its inbox, or a direct
+// message for one of its clients
+struct InboxMessage {
+    InboxMessage *next;
+    Relay relay;
+    Room *room;           // nullptr for a direct message
+    int sender_uid;
+    SlotHandle target;    // direct message: the recipient's entry in the client registry
+};
+
+// client taken over from a predecessor, waiting for its shard's I/O engine
+struct AdoptedClient {
+    Client *client;
+    string input;     // received by the predecessor, not processed yet
+    string output;    // queued by the predecessor, not sent yet
+    Compression compression;
+};
+
+// where a hot upgrade is; run_upgrade() moves it forward, the shards follow
+enum class UpgradePhase {
+    Idle,
+    Quiesce,    // shards stop accepting and processing input, one after the other
+    Drain,      // all shards are quiet: empty the inboxes and queues, then release the clients
+    Commit,     // the successor took everything over, the shards stop
+    Abort       // the handoff failed, the shards take their clients back
+};
+
+struct UpgradeState {
+    atomic<UpgradePhase> phase{UpgradePhase::Idle};
+    int shards_quiesced = 0;    // guarded by lock, like shards_handed
+    int shards_handed = 0;
+    mutex lock;
+    condition_variable changed;
+};
+
+// per-shard statistics, summed over all shards by render_metrics()
+struct ShardMetrics {
+    Counter connections_accepted;
+    Counter connections_rejected;
+    Counter handshakes_failed;
+    Counter messages_in;
+    Counter messages_out;
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter send_failures;
+    Counter send_calls;
+    Counter slow_evictions;
+    Counter slow_drops;
+    Counter deflate_in;            // bytes compressed for COMPRESS clients
+    Counter deflate_out;           // compressed bytes they became
+    Counter rate_limited;          // commands refused by the rate limits
+    Counter rate_evictions;        // clients disconnected for going over them
+    Counter pings_sent;            // keepalive PINGs to idle clients
+    Counter ping_timeouts;         // clients disconnected for not answering one
+    Counter stall_evictions;       // clients disconnected for output that stopped going out
+    Histogram fanout_latency_ns;   // message received until its last recipient got it
+    Histogram queue_depth;         // outbound queue length each time a message is queued
+};
+
+// one event loop thread with its own reuseport listener and its own clients;
+// other shards only ever touch its inbox. Its I/O engine reports back through
+// the IoHandler methods
+struct Shard : IoHandler {
+    int index = 0;
+    IoEngine *io = nullptr;                 // created by the shard's own thread
+    int listen_fd = -1;
+    int inbox_fd = -1;                      // eventfd raised when the inbox goes non-empty
+    atomic<InboxMessage*> inbox{nullptr};   // lock-free multi-producer stack, drained as a batch
+    SlotMap<Client*> clients;               // joined clients, densely packed for fan-out
+    SlotMap<Client*> handshakes;            // clients still in the HELLO/NICK exchange
+    TimingWheel timers{TIMER_TICK_NS, now_ns()};  // client timers, see expire_client()
+    vector<Client*> closing_clients;
+    vector<Client*> dirty_clients;          // clients with output gathered during this tick
+    vector<Client*> backlogged;             // clients with input over their budget, in the order it ran out
+    vector<Client*> reading;                // clients that borrowed an input buffer during this tick
+    vector<Archived> archive;               // relays of this tick, archived before its flush
+    uint64_t dirty_since_ns = 0;            // when the first of them got its output
+    uint64_t ticks = 0;                     // event loop iterations so far
+    bool quiesced = false;                  // upgrading: no accepts, input is only buffered
+    bool handed_over = false;               // upgrading: clients released for the successor
+    int releasing = 0;                      // clients whose engine operations are still finishing
+    vector<HandoffClient> handoff;          // released clients, read by run_upgrade()
+    vector<AdoptedClient> adopted;          // clients of a predecessor, started by the shard thread
+    unique_ptr<Deflater> deflater;          // deflate-shared chunks, made by the shard's thread on first use
+    unordered_multimap<size_t, SharedChunk> shared_chunks;   // made during this flush, by shared_key()
+    ShardMetrics metrics;                   // written only by this shard's thread
+    thread worker;
+
+    void on_accept(int fd, const struct sockaddr_in &address) override;
+    void on_wakeup() override;
+    char *read_buffer(IoConnection *conn, size_t &length) override;
+    void on_read(IoConnection *conn, size_t length) override;
+    void on_writable(IoConnection *conn, size_t sent) override;
+    void on_error(IoConnection *conn, int error) override;
+    void on_released(IoConnection *conn) override;
+};
+
+vector<Shard*> shards;
+RoomDirectory room_directory;
+UserDirectory user_directory;
+UpgradeState upgrade;
+Room *lobby = nullptr;                         // every client joins it with NICK, never freed
+thread_local Shard *current_shard = nullptr;   // shard run by this thread, if any
+
+// the last reference to a broadcast is dropped once its last recipient got it (or dropped it)
+void record_fanout_latency(const SharedBuffer &buffer) {
+    if (current_shard) current_shard->metrics.fanout_latency_ns.record(now_ns() - buffer.stamp);
+}
 
 // utility function to handle errors
 void handle_error(const string &message) {
-    perror(message.c_str());
+    LOG_ERROR("%s: %s\n", message.c_str(), strerror(errno));
+    logger_stop();
     exit(EXIT_FAILURE);
 }
 
-// add client to the client list
+// put a socket in non-blocking mode
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// a reference to the room called name, which is created if it does not exist and
+// create is set; nullptr if there is none, or MAX_ROOMS exist
+Room *acquire_room(string_view name, bool create) {
+    lock_guard<mutex> guard(room_directory.lock);
+    auto it = room_directory.rooms.find(string(name));
+    Room *room;
+    if (it != room_directory.rooms.end()) {
+        room = it->second;
+    } else {
+        if (!create || room_directory.rooms.size() >= MAX_ROOMS) return nullptr;
+        room = new Room;
+        room->name = string(name);
+        room->members.resize(shards.size());
+        room_directory.rooms.emplace(room->name, room);
+    }
+    room->references.fetch_add(1, memory_order_relaxed);
+    return room;
+}
+
+// another reference to a room the caller holds one of
+void retain_room(Room *room) {
+    room->references.fetch_add(1, memory_order_relaxed);
+}
+
+// drop a reference to room, the last one frees it. Only acquire_room() takes a room
+// from no references to one, under the directory lock, so the last one is dropped
+// under that lock too
+void release_room(Room *room) {
+    int count = room->references.load(memory_order_relaxed);
+    while (count > 1) {
+        if (room->references.compare_exchange_weak(count, count - 1, memory_order_release, memory_order_relaxed)) return;
+    }
+    lock_guard<mutex> guard(room_directory.lock);
+    if (room->references.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    room_directory.rooms.erase(room->name);
+    delete room;
+}
+
+// the client's membership in the room called name, nullptr if it is not a member
+Membership *find_membership(Client *client, string_view name) {
+    for (Membership &membership : client->rooms) {
+        if (membership.room->name == name) return &membership;
+    }
+    return nullptr;
+}
+
+void join_room(Client *client, Room *room) {
+    retain_room(room);
+    SlotMap<Client*> &members = room->members[client->shard->index];
+    client->rooms.push_back(Membership{room, members.insert(client)});
+    if (members.size() == 1) {
+        room->shard_mask.fetch_or(1ull << client->shard->index, memory_order_release);
+    }
+}
+
+// keep relayed lines, exactly as they were sent, in the history of their room and
+// in the journal: entries in a row for the same room share one turn on its history
+// lock, and all of them go to the journal in one append
+void archive_lines(const Archived *entries, size_t count) {
+    thread_local vector<JournalRecord> records;
+    bool journal = !config.journal.directory.empty();
+    for (size_t i = 0; i < count;) {
+        Room *room = entries[i].room;
+        unique_lock<mutex> guard(room->history_lock, defer_lock);
+        if (config.history > 0) {
+            guard.lock();
+            if (!room->history) room->history = make_unique<History>(config.history);
+        }
+        for (; i < count && entries[i].room == room; i++) {
+            string_view lines = entries[i].lines->view();
+            while (!lines.empty()) {
+                string_view line = lines.substr(0, lines.find('\n') + 1);
+                lines.remove_prefix(line.size());
+                if (config.history > 0) room->history->add(entries[i].time_ns, line);
+                if (journal) records.push_back(JournalRecord{room->name, entries[i].time_ns, line});
+            }
+        }
+    }
+    if (!records.empty()) journal_append(records.data(), records.size());
+    records.clear();
+}
+
+// archive the relays shard staged during this tick
+void archive_staged(Shard &shard) {
+    if (shard.archive.empty()) return;
+    archive_lines(shard.archive.data(), shard.archive.size());
+    shard.archive.clear();
+}
+
+void part_room(Client *client, Room *room) {
+    // what the shard staged may be the room's last lines, which need it alive
+    archive_staged(*client->shard);
+    for (auto it = client->rooms.begin(); it != client->rooms.end(); ++it) {
+        if (it->room != room) continue;
+        SlotMap<Client*> &members = room->members[client->shard->index];
+        members.erase(it->handle);
+        if (members.empty()) {
+            room->shard_mask.fetch_and(~(1ull << client->shard->index), memory_order_release);
+        }
+        client->rooms.erase(it);
+        release_room(room);
+        return;
+    }
+}
+
+// keep line in the room's recent history
+void record_history(Room *room, uint64_t time_ns, string_view line) {
+    if (config.history == 0) return;
+    lock_guard<mutex> guard(room->history_lock);
+    if (!room->history) room->history = make_unique<History>(config.history);
+    room->history->add(time_ns, line);
+}
+
+// journal_open() callback: rebuild the recent history of the rooms in use, the lobby
+// and the rooms of clients taken over, from the journal
+void replay_journal(string_view room_name, uint64_t time_ns, string_view line) {
+    if (!valid_room_name(room_name)) return;
+    Room *room = acquire_room(room_name, false);
+    if (!room) return;
+    record_history(room, time_ns, line);
+    release_room(room);
+}
+
+// add client to the client registry of its shard
 void add_client_to_queue(Client *client) {
-    lock_guard<mutex> lock(clients_mutex);
-    for (auto &c : clients) {
-        if (!c) {
-            c = client;
+    client->handle = client->shard->clients.insert(client);
+}
+
+// remove client from the client registry of its shard
+void remove_client_from_queue(Shard &shard, Client *client) {
+    shard.clients.erase(client->handle);
+    client->handle = SlotHandle();
+}
+
+// schedule a client for close; the socket is released once the current tick is done
+// so that events already reported by the I/O engine never see a dangling pointer
+void close_client(Client *client) {
+    if (client->closing) return;
+    client->closing = true;
+    client->shard->closing_clients.push_back(client);
+}
+
+// set a joined client's timer for the earliest of its deadlines: the end of its idle
+// time, or of the grace period of the PING it was sent, and its stall timeout while
+// output is queued
+void arm_timer(Client *client) {
+    uint64_t deadline = UINT64_MAX;
+    if (client->ping_ns) {
+        deadline = client->ping_ns + ms_ns(config.ping_timeout_ms);
+    } else if (config.idle_timeout_ms > 0) {
+        deadline = client->input_ns + ms_ns(config.idle_timeout_ms);
+    }
+    if (config.stall_timeout_ms > 0 && !client->outqueue.empty()) {
+        deadline = min(deadline, client->output_ns + ms_ns(config.stall_timeout_ms));
+    }
+    if (deadline == UINT64_MAX) {
+        client->shard->timers.cancel(*client);
+    } else {
+        client->shard->timers.schedule(*client, deadline);
+    }
+}
+
+// the socket took less than the client's queued output: make sure its timer goes off
+// by the stall deadline. A timer already set that early stays, so this rarely
+// touches the wheel; a greeted client has its handshake deadline, which comes first
+void watch_output(Client *client) {
+    if (config.stall_timeout_ms == 0 || client->state != ClientState::Joined) return;
+    uint64_t deadline = client->output_ns + ms_ns(config.stall_timeout_ms);
+    TimingWheel &timers = client->shard->timers;
+    if (!client->scheduled() || timers.deadline(*client) > deadline) timers.schedule(*client, deadline);
+}
+
+// drop a user from the directory, and its nickname unless another user holds it
+void forget_user(int user) {
+    lock_guard<mutex> guard(user_directory.lock);
+    auto it = user_directory.users.find(user);
+    if (it == user_directory.users.end()) return;
+    auto owner = user_directory.uids.find(it->second.name);
+    if (owner != user_directory.uids.end() && owner->second == user) user_directory.uids.erase(owner);
+    user_directory.users.erase(it);
+}
+
+// release every client scheduled for close during this tick
+void reap_closing_clients(Shard &shard) {
+    for (Client *client : shard.closing_clients) {
+        shard.timers.cancel(*client);
+        bool released = shard.io->release(client);
+        close(client->sockfd);
+        if (client->state == ClientState::Joined) {
+            federation_publish_presence(client->uid, client->name, false);
+            while (!client->rooms.empty()) part_room(client, client->rooms.back().room);
+            remove_client_from_queue(shard, client);
+            forget_user(client->uid);
+        } else {
+            shard.handshakes.erase(client->handle);
+        }
+        if (client->binary) binary_clients--;
+        if (client->backlogged) {
+            shard.backlogged.erase(find(shard.backlogged.begin(), shard.backlogged.end(), client));
+        }
+        // with operations still in flight the engine hands the client back through on_released()
+        if (released) delete client;
+        client_count--;
+    }
+    shard.closing_clients.clear();
+}
+
+// release every queued message that went out completely with sent bytes
+void consume_sent(Client *client, size_t sent) {
+    client->shard->metrics.bytes_out.add(sent);
+    if (sent > 0) client->output_ns = now_ns();
+    client->outqueue_bytes -= sent;
+    size_t remaining = sent;
+    while (remaining > 0) {
+        size_t left = client->outqueue.front()->size() - client->out_offset;
+        if (remaining < left) {
+            client->out_offset += remaining;
             break;
         }
+        remaining -= left;
+        client->outqueue.pop_front();
+        client->out_offset = 0;
+        if (client->deflated > 0) client->deflated--;
     }
 }
 
-// remove client from the client list
-void remove_client_from_queue(int uid) {
-    lock_guard<mutex> lock(clients_mutex);
-    for (auto &c : clients) {
-        if (c && c->uid == uid) {
-            c = nullptr;
+// hash of count queued messages, by the buffers they are
+size_t shared_key(OutputQueue::iterator first, size_t count) {
+    size_t key = count;
+    for (size_t i = 0; i < count; i++) key = key * 31 + hash<const SharedBuffer*>()(first[i].get());
+    return key;
+}
+
+// count messages queued for a deflate-shared client as one chunk that stands on its
+// own: made once per flush by the shard for every client that was sent the same
+// messages, which during a tick is what members of the same rooms get
+BufferRef shared_chunk(Shard &shard, OutputQueue::iterator first, size_t count) {
+    size_t key = shared_key(first, count);
+    auto range = shard.shared_chunks.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+        const vector<BufferRef> &parts = it->second.parts;
+        if (parts.size() == count && equal(parts.begin(), parts.end(), first,
+                                           [](const BufferRef &a, const BufferRef &b) { return a.get() == b.get(); })) {
+            return it->second.chunk;
+        }
+    }
+
+    if (!shard.deflater) shard.deflater = make_unique<Deflater>(config.compress_level, true);
+    string_view parts[MAX_IOV];
+    size_t plain = 0;
+    for (size_t i = 0; i < count; i++) {
+        parts[i] = first[i]->view();
+        plain += parts[i].size();
+    }
+    BufferRef chunk(shard.deflater->compress(parts, count));
+    if (!chunk) return chunk;
+    shard.metrics.deflate_in.add(plain);
+    shard.metrics.deflate_out.add(chunk->size());
+    shard.shared_chunks.emplace(key, SharedChunk{vector<BufferRef>(first, first + count), chunk});
+    return chunk;
+}
+
+// compress everything queued for a client since the last flush, with its own deflate
+// context or into shared chunks, in batches of MAX_IOV messages; each chunk replaces
+// its messages in the queue
+bool deflate_queued(Client *client) {
+    ShardMetrics &metrics = client->shard->metrics;
+    bool ok = true;
+    while (client->deflated < client->outqueue.size()) {
+        auto first = client->outqueue.begin() + client->deflated;
+        size_t batch = min<size_t>(client->outqueue.end() - first, MAX_IOV);
+        size_t plain = 0;
+        BufferRef chunk;
+        if (client->deflater) {
+            string_view parts[MAX_IOV];
+            for (size_t i = 0; i < batch; i++) {
+                parts[i] = first[i]->view();
+                plain += parts[i].size();
+            }
+            chunk = BufferRef(client->deflater->compress(parts, batch));
+            if (chunk) {
+                metrics.deflate_in.add(plain);
+                metrics.deflate_out.add(chunk->size());
+            }
+        } else {
+            for (size_t i = 0; i < batch; i++) plain += first[i]->size();
+            chunk = shared_chunk(*client->shard, first, batch);
+        }
+        if (!chunk) {
+            ok = false;
             break;
         }
+        client->outqueue_bytes += chunk->size();
+        client->outqueue_bytes -= plain;
+        client->outqueue.erase(first, first + batch);
+        client->outqueue.insert(client->deflated, move(chunk));
+        client->deflated++;
     }
+    if (!ok) LOG_ERROR("error: compressing output failed (uid=%d)\n", client->uid);
+    return ok;
 }
 
-// send message to all clients except the sender
-void send_message_to_all(const string &message, int sender_uid) {
-    lock_guard<mutex> lock(clients_mutex);
-    for (auto &c : clients) {
-        if (c && c->uid != sender_uid) {
-            if (send(c->sockfd, message.c_str(), message.length(), 0) <= 0) {
-                cout << "error: failed to send message to client (uid=" << c->uid << ")\n";
-                fflush(stdout);  // flush to ensure output is shown immediately
-                break;
+// write as much of the client's pending output as the socket accepts, gathering
+// up to MAX_IOV queued messages per send; an asynchronous engine takes one send
+// per client at a time and reports it through Shard::on_writable()
+bool flush_client(Client *client) {
+    if (client->compression != Compression::None && !deflate_queued(client)) return false;
+    while (!client->outqueue.empty() && client->pinned == 0) {
+        struct iovec iov[MAX_IOV];
+        size_t count = 0;
+        size_t requested = 0;
+        for (auto it = client->outqueue.begin(); it != client->outqueue.end() && count < MAX_IOV; ++it, ++count) {
+            size_t skip = count == 0 ? client->out_offset : 0;
+            iov[count].iov_base = const_cast<char*>((*it)->data() + skip);
+            iov[count].iov_len = (*it)->size() - skip;
+            requested += iov[count].iov_len;
+        }
+
+        // when the queue needs more than one call, MSG_MORE holds back the partial
+        // segment until the last one, which pushes everything out
+        int flags = MSG_NOSIGNAL | (count < client->outqueue.size() ? MSG_MORE : 0);
+        ssize_t sent = client->shard->io->send(client, iov, count, flags);
+        client->shard->metrics.send_calls.add();
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINPROGRESS) {
+                // the queued buffers must stay until it completes
+                client->pinned = count;
+                client->pinned_bytes = requested;
+                client->send_tick = client->shard->ticks;
+                client->output_ns = now_ns();
+                watch_output(client);
+                return true;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client->write_blocked = true;  // the engine reports once the socket drains
+                watch_output(client);
+                return true;
             }
+            client->shard->metrics.send_failures.add();
+            return false;
+        }
+        consume_sent(client, sent);
+        if ((size_t)sent < requested) {
+            client->write_blocked = true;  // short write, the socket buffer is full
+            watch_output(client);
+            return true;
         }
     }
+    return true;
 }
 
-// handle client communication
-void handle_client(Client *client) {
-    char buffer[MAX_BUFFER_SIZE];
-    bool leave_flag = false;
+// make room for length more bytes according to the slow-consumer policy;
+// returns false if the new message must not be queued
+bool apply_slow_policy(Client *client, size_t length) {
+    auto over_limit = [&]() {
+        return client->outqueue_bytes + length > config.queue_bytes ||
+               client->outqueue.size() + 1 > config.queue_msgs;
+    };
+    if (!over_limit()) return true;
 
-    client_count++;
+    ShardMetrics &metrics = client->shard->metrics;
+    switch (config.slow_policy) {
+    case SlowPolicy::DropNewest:
+        client->dropped++;
+        metrics.slow_drops.add();
+        return false;
+    case SlowPolicy::DropOldest: {
+        // a partially sent head must go out whole and messages a send in flight reads
+        // must stay, so the oldest droppable message is behind them, and behind the
+        // compressed ones, the rest of the deflate stream refers back to them
+        size_t keep = max(max<size_t>(client->pinned, client->out_offset > 0 ? 1 : 0), client->deflated);
+        while (over_limit() && client->outqueue.size() > keep) {
+            auto oldest = client->outqueue.begin() + keep;
+            client->outqueue_bytes -= (*oldest)->size();
+            client->outqueue.erase(oldest);
+            client->dropped++;
+            metrics.slow_drops.add();
+        }
+        if (!over_limit()) return true;
+        client->dropped++;
+        metrics.slow_drops.add();
+        return false;
+    }
+    case SlowPolicy::Disconnect:
+        break;
+    }
+    LOG_ERROR("error: evicting slow client (uid=%d, queued=%zu bytes)\n", client->uid, client->outqueue_bytes);
+    metrics.slow_evictions.add();
+    close_client(client);
+    return false;
+}
+
+// try to hand data to the socket directly when nothing is queued ahead of it;
+// returns the number of bytes sent, or -1 if the client was closed. Only used
+// with a synchronous engine
+ssize_t send_direct(Client *client, const char *data, size_t length) {
+    if (!client->outqueue.empty()) return 0;
+    struct iovec iov = {const_cast<char*>(data), length};
+    ssize_t sent;
+    do {
+        sent = client->shard->io->send(client, &iov, 1, MSG_NOSIGNAL);
+        client->shard->metrics.send_calls.add();
+    } while (sent < 0 && errno == EINTR);
+    if (sent >= 0) {
+        client->shard->metrics.bytes_out.add(sent);
+        if (sent > 0) client->output_ns = now_ns();
+        return sent;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    client->shard->metrics.send_failures.add();
+    close_client(client);
+    return -1;
+}
+
+// queue the unsent part of a message behind whatever is already queued
+bool enqueue(Client *client, BufferRef message, size_t sent) {
+    if (sent > 0) {
+        // the head of an empty queue was partially written
+        client->outqueue_bytes = message->size() - sent;
+        client->out_offset = sent;
+        client->outqueue.push_back(move(message));
+        return true;
+    }
+    if (!apply_slow_policy(client, message->size())) return !client->closing;
+    client->outqueue_bytes += message->size();
+    client->outqueue.push_back(move(message));
+    client->shard->metrics.queue_depth.record(client->outqueue.size());
+    return true;
+}
+
+// note that client has output to flush at the end of this tick
+void mark_dirty(Client *client) {
+    if (client->dirty) return;
+    client->dirty = true;
+    Shard &shard = *client->shard;
+    if (shard.dirty_clients.empty()) shard.dirty_since_ns = now_ns();
+    shard.dirty_clients.push_back(client);
+}
+
+// write out everything the clients of shard were sent since the last flush, one
+// sendmsg per client; clients being closed get their last words out too. The relays
+// of the tick are archived first
+void flush_dirty_clients(Shard &shard) {
+    archive_staged(shard);
+    for (Client *client : shard.dirty_clients) {
+        client->dirty = false;
+        if (!client->write_blocked && !flush_client(client)) close_client(client);
+    }
+    shard.dirty_clients.clear();
+    shard.shared_chunks.clear();
+}
+
+// flush early when the oldest gathered output has waited for the coalescing cap
+void flush_if_overdue(Shard &shard) {
+    if (!shard.dirty_clients.empty() &&
+        now_ns() - shard.dirty_since_ns >= static_cast<uint64_t>(config.coalesce_us) * 1000) {
+        flush_dirty_clients(shard);
+        shard.io->submit();
+    }
+}
+
+// send a shared message to a client without blocking the event loop; the queue
+// keeps a reference to the same bytes instead of a copy, and a full queue is
+// handled by the slow-consumer policy instead of stalling the sender. Unless
+// coalescing is off, the message is only queued and goes out with everything
+// else the client gets this tick; an asynchronous engine always works that way
+bool send_output(Client *client, const BufferRef &message) {
+    if (client->closing) return false;
+    // a compressed client has its output compressed when flushed
+    if (config.coalesce_us > 0 || client->shard->io->asynchronous() || client->compression != Compression::None) {
+        // output gathered this tick only counts against the queue limits once the
+        // socket has refused it
+        bool full = client->outqueue_bytes + message->size() > config.queue_bytes ||
+                    client->outqueue.size() + 1 > config.queue_msgs;
+        if (full && !client->write_blocked && client->pinned > 0 && client->shard->ticks - client->send_tick <= 1) {
+            // an asynchronous send started this tick or the last one, its completion is
+            // not in yet; the client is held to the limits once it had a tick to finish
+            client->outqueue_bytes += message->size();
+            client->outqueue.push_back(message);
+            mark_dirty(client);
+            return true;
+        }
+        if (full && !client->write_blocked && !flush_client(client)) {
+            close_client(client);
+            return false;
+        }
+        if (!enqueue(client, message, 0)) return false;
+        mark_dirty(client);
+        return true;
+    }
+    ssize_t sent = send_direct(client, message->data(), message->size());
+    if (sent < 0) return false;
+    if ((size_t)sent == message->size()) return true;
+    if (!enqueue(client, message, sent)) return false;
+    watch_output(client);
+    return true;
+}
+
+// send bytes owned by the caller; they are only copied if they have to be queued
+bool send_output(Client *client, const char *data, size_t length) {
+    if (client->closing) return false;
+    if (config.coalesce_us > 0 || client->shard->io->asynchronous() || client->compression != Compression::None) {
+        return send_output(client, BufferRef(SharedBuffer::concat({string_view(data, length)})));
+    }
+    ssize_t sent = send_direct(client, data, length);
+    if (sent < 0) return false;
+    if ((size_t)sent == length) return true;
+    if (!enqueue(client, BufferRef(SharedBuffer::concat({string_view(data, length)})), sent)) return false;
+    watch_output(client);
+    return true;
+}
+
+// compress everything sent to client from now on; what is queued already goes out as it is
+void start_compression(Client *client, Compression compression) {
+    client->compression = compression;
+    if (compression == Compression::Deflate) client->deflater = make_unique<Deflater>(config.compress_level, false);
+    client->deflated = client->outqueue.size();
+}
+
+bool send_output(Client *client, const string &message) {
+    return send_output(client, message.data(), message.length());
+}
+
+// send a text protocol reply, as a FRAME_TEXT to a binary client
+bool reply(Client *client, string_view text) {
+    if (!client->binary) return send_output(client, text.data(), text.size());
+    // a long replay goes out as several frames, split between lines
+    while (text.size() > MAX_FRAME_LENGTH - 1) {
+        size_t end = text.rfind('\n', MAX_FRAME_LENGTH - 2) + 1;
+        if (end == 0) end = MAX_FRAME_LENGTH - 1;
+        if (!send_output(client, BufferRef(format_frame(FRAME_TEXT, {text.substr(0, end)})))) return false;
+        text.remove_prefix(end);
+    }
+    return send_output(client, BufferRef(format_frame(FRAME_TEXT, {text})));
+}
+
+bool reply(Client *client, const BufferRef &text) {
+    if (client->binary) return reply(client, text->view());
+    return send_output(client, text);
+}
+
+// the variant of relay in a client's wire format, made on first use; a relay without
+// a frame goes to binary clients as a FRAME_TEXT with its lines
+const BufferRef &relay_variant(Relay &relay, bool binary) {
+    if (binary && !relay.frame) relay.frame = BufferRef(format_frame(FRAME_TEXT, {relay.text->view()}));
+    return binary ? relay.frame : relay.text;
+}
+
+// send a relay to one client of shard in its format; variants collects the formats made
+void deliver_to_client(Shard &shard, Client *c, Relay &variants) {
+    shard.metrics.messages_out.add();
+    if (!send_output(c, relay_variant(variants, c->binary))) {
+        LOG_ERROR("error: failed to send message to client (uid=%d)\n", c->uid);
+    }
+}
+
+// send a relay to every member of room on one shard except the sender, each in its format
+void deliver_to_shard(Shard &shard, Room *room, const Relay &relay, int sender_uid) {
+    Relay variants = relay;   // plus the ones made here, shared by this shard's recipients
+    for (Client *c : room->members[shard.index]) {
+        if (c->uid != sender_uid && !c->closing) deliver_to_client(shard, c, variants);
+    }
+}
+
+// send a direct message to the client of shard behind target, unless it has left since
+void deliver_direct(Shard &shard, SlotHandle target, const Relay &relay) {
+    Client **client = shard.clients.get(target);
+    if (!client || (*client)->closing) return;
+    Relay variants = relay;
+    deliver_to_client(shard, *client, variants);
+}
+
+// interrupt the wait for I/O of shard through its inbox eventfd
+void wake_shard(Shard &shard) {
+    uint64_t one = 1;
+    if (write(shard.inbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("error: failed to wake shard: %s\n", strerror(errno));
+    }
+}
+
+// push item onto the inbox of shard; only the push that finds it empty wakes the shard
+void push_inbox(Shard &shard, InboxMessage *item) {
+    InboxMessage *head = shard.inbox.load(memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!shard.inbox.compare_exchange_weak(head, item, memory_order_release, memory_order_relaxed));
+
+    if (!head) wake_shard(shard);
+}
+
+// hand a broadcast to another shard; it holds a reference to room until delivered
+void post_to_shard(Shard &shard, Room *room, const Relay &relay, int sender_uid) {
+    retain_room(room);
+    push_inbox(shard, new InboxMessage{nullptr, relay, room, sender_uid, SlotHandle()});
+}
+
+// hand a direct message to the shard of its recipient
+void post_direct(Shard &shard, SlotHandle target, const Relay &relay, int sender_uid) {
+    push_inbox(shard, new InboxMessage{nullptr, relay, nullptr, sender_uid, target});
+}
+
+// deliver every broadcast and direct message other shards posted since the last
+// wakeup, in posting order
+void drain_inbox(Shard &shard) {
+    uint64_t counter;
+    while (read(shard.inbox_fd, &counter, sizeof(counter)) > 0) {}
+
+    InboxMessage *item = shard.inbox.exchange(nullptr, memory_order_acquire);
+    InboxMessage *ordered = nullptr;
+    while (item) {
+        InboxMessage *next = item->next;
+        item->next = ordered;
+        ordered = item;
+        item = next;
+    }
+    while (ordered) {
+        InboxMessage *next = ordered->next;
+        if (ordered->room) {
+            deliver_to_shard(shard, ordered->room, ordered->relay, ordered->sender_uid);
+            release_room(ordered->room);
+        } else {
+            deliver_direct(shard, ordered->target, ordered->relay);
+        }
+        delete ordered;
+        ordered = next;
+        flush_if_overdue(shard);
+    }
+}
+
+// send message to every member of room except the sender; only shards that
+// currently have members in the room are woken
+void send_message_to_room(Shard &shard, Room *room, const Relay &relay, int sender_uid) {
+    deliver_to_shard(shard, room, relay, sender_uid);
+    uint64_t mask = room->shard_mask.load(memory_order_acquire) & ~(1ull << shard.index);
+    while (mask) {
+        int index = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        post_to_shard(*shards[index], room, relay, sender_uid);
+    }
+}
 
+// user ids are unique in a federation, they carry the node id in their high bits. The
+// counter below wraps after 4M joins, and then skips the ids of the users still
+// connected; user_directory.lock held
+int next_uid() {
+    const unsigned mask = (1u << UID_NODE_SHIFT) - 1;
     while (true) {
-        if (leave_flag) break;
-
-        int receive = recv(client->sockfd, buffer, MAX_BUFFER_SIZE, 0);
-        if (receive > 0) {
-            if (strlen(buffer) > 0) {
-                // validate and parse the incoming message
-                string buffer_str(buffer);
-                if (buffer_str.rfind("MSG ", 0) == 0) { // ensure the message starts with "MSG "
-                    string message = buffer_str.substr(4);  // extract message after "MSG "
-                    message.erase(message.find_last_not_of(" \n\r\t") + 1);  // remove trailing newline character
-
-                    if (message.length() <= 255) {
-                        string formatted_message = "MSG " + client->name + " " + message + "\n";
-                        cout << client->name << ": " << message << endl;
-                        fflush(stdout);  // flush stdout to ensure it is shown immediately
-                        send_message_to_all(formatted_message, client->uid);
-                    } else {
-                        string error_message = "ERROR " + client->name + ": message too long\n";
-                        send_message_to_all(error_message, client->uid);
-                    }
-                } else {
-                    // invalid message format
-                    string error_message = "ERROR invalid message format\n";
-                    send(client->sockfd, error_message.c_str(), error_message.length(), 0);
-                }
+        unsigned low = static_cast<unsigned>(uid++) & mask;
+        int candidate = static_cast<int>(config.federation.node_id << UID_NODE_SHIFT | low);
+        if (low >= FIRST_UID && user_directory.users.count(candidate) == 0) return candidate;
+    }
+}
+
+// handle the nickname a greeted client sent with NICK, or in a FRAME_NICK
+void handle_nick(Client *client, string_view nick) {
+    if (!valid_nickname(nick)) {
+        client->shard->metrics.handshakes_failed.add();
+        // invalid nickname
+        reply(client, ERROR_MESSAGE);
+        close_client(client);
+        return;
+    }
+
+    {
+        // claim the nickname and register the client in one step, a NICK racing on
+        // another shard for the same name finds it taken
+        lock_guard<mutex> guard(user_directory.lock);
+        auto claimed = user_directory.uids.emplace(string(nick), 0);
+        if (!claimed.second) {
+            // the client stays in the handshake and may try another nickname
+            reply(client, "ERROR nickname in use\n");
+            return;
+        }
+        client->shard->handshakes.erase(client->handle);
+        client->uid = next_uid();
+        client->name = string(nick);
+        client->state = ClientState::Joined;
+        add_client_to_queue(client);
+        claimed.first->second = client->uid;
+        user_directory.users[client->uid] = UserEntry{client->name, client->shard->index, client->handle};
+    }
+    if (!reply(client, OK_MESSAGE)) LOG_ERROR("error: sending OK message failed\n");
+    arm_timer(client);  // replaces the handshake deadline
+    federation_publish_presence(client->uid, client->name, true);
+
+    LOG_INFO("%s joined the chat\n", client->name.c_str());
+    join_room(client, lobby);
+}
+
+// a client's timer went off at now: a greeted client ran out of time for its
+// handshake; a joined one is evicted if its output stalled, disconnected if it did
+// not answer its PING in time, and sent one once it was silent for the idle timeout.
+// Input of any kind counts as the answer, and the timer is then set again
+void expire_client(Client *client, uint64_t now) {
+    if (client->closing) return;
+    ShardMetrics &metrics = client->shard->metrics;
+    if (client->state != ClientState::Joined) {
+        LOG_ERROR("error: handshake timed out (fd=%d)\n", client->sockfd);
+        metrics.handshakes_failed.add();
+        reply(client, ERROR_MESSAGE);
+        close_client(client);
+        return;
+    }
+    if (config.stall_timeout_ms > 0 && !client->outqueue.empty() &&
+        now - client->output_ns >= ms_ns(config.stall_timeout_ms)) {
+        LOG_ERROR("error: evicting stalled client (uid=%d, queued=%zu bytes)\n", client->uid, client->outqueue_bytes);
+        metrics.stall_evictions.add();
+        close_client(client);
+        return;
+    }
+    if (client->ping_ns && client->input_ns >= client->ping_ns) client->ping_ns = 0;
+    if (client->ping_ns && now - client->ping_ns >= ms_ns(config.ping_timeout_ms)) {
+        LOG_ERROR("error: client (uid=%d) did not answer PING, disconnecting\n", client->uid);
+        metrics.ping_timeouts.add();
+        close_client(client);
+        return;
+    }
+    if (!client->ping_ns && config.idle_timeout_ms > 0 && now - client->input_ns >= ms_ns(config.idle_timeout_ms)) {
+        client->ping_ns = now;
+        metrics.pings_sent.add();
+        reply(client, PING_MESSAGE);
+        if (client->closing) return;
+    }
+    arm_timer(client);
+}
+
+// fire the client timers that are due; returns the poll timeout until the timing
+// wheel has work again, -1 if no timer is set
+int expire_timers(Shard &shard) {
+    uint64_t now = now_ns();
+    shard.timers.advance(now, [now](WheelTimer &timer) { expire_client(static_cast<Client*>(&timer), now); });
+    int64_t wait = shard.timers.next_timeout(now);
+    return wait < 0 ? -1 : static_cast<int>((wait + 999999) / 1000000);
+}
+
+// messages from client to room in both wire formats, formatted once for every
+// recipient on every shard to share
+Relay make_relay(uint32_t sender, string_view nick, Room *room, const string_view *messages, size_t count) {
+    Relay relay;
+    string_view room_name = room == lobby ? string_view() : string_view(room->name);
+    relay.text = BufferRef(format_msgs(nick, room_name, messages, count));
+    if (binary_clients.load(memory_order_relaxed) > 0) {
+        relay.frame = BufferRef(format_frame_msg(&sender, room_name, messages, count));
+    }
+    return relay;
+}
+
+// relay chat messages from client to room: history, journal, log, fan-out and the
+// other nodes of a federation
+void relay_messages(Client *client, Room *room, const string_view *messages, size_t count) {
+    Relay relay = make_relay(client->uid, client->name, room, messages, count);
+    uint64_t stamp = now_ns();
+    relay.text->stamp = stamp;
+    if (relay.frame) relay.frame->stamp = stamp;
+    client->shard->metrics.messages_in.add(count);
+
+    client->shard->archive.push_back(Archived{room, wall_ns(), relay.text});
+    for (size_t i = 0; i < count && log_content_enabled(); i++) {
+        string_view message = messages[i];
+        if (room == lobby) {
+            LOG_INFO("%s: %.*s\n", client->name.c_str(), (int)message.length(), message.data());
+        } else {
+            LOG_INFO("%s %s: %.*s\n", room->name.c_str(), client->name.c_str(), (int)message.length(), message.data());
+        }
+    }
+    send_message_to_room(*client->shard, room, relay, client->uid);
+    federation_publish_message(client->uid, client->name, room->name, messages, count);
+}
+
+// what is wrong with text that arrived whole in a frame, as the error reply: a '\n'
+// in it would end the line early for text clients and let the rest pass for a line
+// of its own; nullptr if it is fine
+const char *text_error(string_view text) {
+    LineScan scan;
+    if (scan_line(text.data(), text.size(), scan)) return "ERROR line break in message\n";
+    if (!scan.valid || scan.scanned != text.size()) return "ERROR invalid UTF-8\n";
+    return nullptr;
+}
+
+// whether a message of another node passes the checks local input does
+bool valid_remote_text(string_view text) {
+    return text.size() <= MAX_MESSAGE_LENGTH && !text_error(text);
+}
+
+// chat messages of a user on another node, archived and delivered like a local user's
+// by every shard with members in the room; a room nobody here is in does not exist
+// here, and other nodes do not create one. Dropped during a hot upgrade, whose
+// handoff relies on no shard getting new broadcasts once all of them are quiet. Other
+// nodes are trusted no more than clients: messages that would be refused from a
+// local user are dropped
+void deliver_remote(uint32_t sender, string_view nick, string_view room_name, const string_view *messages,
+                    size_t count) {
+    if (upgrade.phase.load(memory_order_acquire) != UpgradePhase::Idle || !valid_room_name(room_name) ||
+        !valid_nickname(nick)) {
+        return;
+    }
+    thread_local vector<string_view> accepted;
+    accepted.clear();
+    for (size_t i = 0; i < count; i++) {
+        if (valid_remote_text(messages[i])) accepted.push_back(messages[i]);
+    }
+    if (accepted.empty()) return;
+    Room *room = acquire_room(room_name, false);
+    if (!room) return;
+    Relay relay = make_relay(sender, nick, room, accepted.data(), accepted.size());
+    uint64_t stamp = now_ns();
+    relay.text->stamp = stamp;
+    if (relay.frame) relay.frame->stamp = stamp;
+    Archived archived{room, wall_ns(), relay.text};
+    archive_lines(&archived, 1);
+
+    uint64_t mask = room->shard_mask.load(memory_order_acquire);
+    while (mask) {
+        int index = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        post_to_shard(*shards[index], room, relay, static_cast<int>(sender));
+    }
+    release_room(room);
+}
+
+// a user of another node joined or left. Two nodes can accept the same nickname
+// before they hear of each other; it then stays with whoever had it here first. A
+// nickname no local client could have is ignored
+void remote_presence(uint32_t uid, string_view nick, bool online) {
+    if (online && !valid_nickname(nick)) return;
+    LOG_DEBUG("%.*s %s on another node\n", (int)nick.size(), nick.data(), online ? "joined" : "left");
+    int user = static_cast<int>(uid);
+    if (!online) {
+        forget_user(user);
+        return;
+    }
+    lock_guard<mutex> guard(user_directory.lock);
+    auto claimed = user_directory.uids.emplace(string(nick), user);
+    if (!claimed.second && claimed.first->second != user) {
+        LOG_ERROR("warning: nickname %.*s is taken on two nodes\n", (int)nick.size(), nick.data());
+    }
+    user_directory.users[user] = UserEntry{string(nick), -1, SlotHandle()};
+}
+
+// the user behind nick, false if there is none
+bool find_user(string_view nick, int &uid, UserEntry &entry) {
+    lock_guard<mutex> guard(user_directory.lock);
+    auto it = user_directory.uids.find(string(nick));
+    if (it == user_directory.uids.end()) return false;
+    uid = it->second;
+    entry = user_directory.users[uid];
+    return true;
+}
+
+// a direct message of a user of another node; only one connected here is delivered to
+void deliver_remote_direct(uint32_t sender, string_view nick, uint32_t recipient, string_view text) {
+    if (upgrade.phase.load(memory_order_acquire) != UpgradePhase::Idle || !valid_nickname(nick) ||
+        !valid_remote_text(text)) {
+        return;
+    }
+    UserEntry entry;
+    {
+        lock_guard<mutex> guard(user_directory.lock);
+        auto it = user_directory.users.find(static_cast<int>(recipient));
+        if (it == user_directory.users.end() || it->second.shard < 0) return;
+        entry = it->second;
+    }
+    Relay relay;
+    relay.text = BufferRef(format_privmsg(nick, text));
+    relay.text->stamp = now_ns();
+    post_direct(*shards[entry.shard], entry.handle, relay, static_cast<int>(sender));
+}
+
+const FederationHandler federation_handler{deliver_remote, remote_presence, deliver_remote_direct};
+
+// relay a MSG to the lobby, or to a room the client is in when the text starts with
+// "#room"; clients that never sent JOIN keep the plain lobby semantics for such text
+void handle_chat(Client *client, string_view message) {
+    Room *room = lobby;
+    if (client->room_aware) {
+        string_view room_name = LOBBY_ROOM_NAME, text;
+        if (split_room_message(message, room_name, text)) message = text;
+        Membership *membership = find_membership(client, room_name);
+        if (!membership) {
+            reply(client, "ERROR not in room " + string(room_name) + "\n");
+            return;
+        }
+        room = membership->room;
+    }
+
+    if (message.length() > MAX_MESSAGE_LENGTH) {
+        Relay error_message{BufferRef(SharedBuffer::concat({"ERROR ", client->name, ": message too long\n"})), {}};
+        send_message_to_room(*client->shard, room, error_message, client->uid);
+        return;
+    }
+    relay_messages(client, room, &message, 1);
+}
+
+// FRAME_MSG: any number of messages to one room, relayed together as one frame to
+// binary members and one block of lines to the others
+void handle_frame_msg(Client *client, string_view body) {
+    string_view room_name, encoded, text;
+    if (!parse_frame_msg(body, room_name, encoded)) {
+        reply(client, "ERROR invalid frame\n");
+        return;
+    }
+    if (room_name.empty()) room_name = LOBBY_ROOM_NAME;
+    Membership *membership = find_membership(client, room_name);
+    if (!membership) {
+        reply(client, "ERROR not in room " + string(room_name) + "\n");
+        return;
+    }
+
+    string_view messages[MAX_FRAME_MESSAGES];
+    size_t count = 0;
+    while (next_frame_message(encoded, text)) {
+        if (text.size() > MAX_MESSAGE_LENGTH) {
+            reply(client, "ERROR message too long\n");
+            continue;
+        }
+        if (const char *error = text_error(text)) {
+            reply(client, error);
+            continue;
+        }
+        messages[count++] = text;
+        if (count == MAX_FRAME_MESSAGES) {
+            relay_messages(client, membership->room, messages, count);
+            count = 0;
+        }
+    }
+    if (count > 0) relay_messages(client, membership->room, messages, count);
+    if (!encoded.empty()) reply(client, "ERROR invalid frame\n");
+}
+
+// FRAME_WHO: the nickname behind a sender id
+void handle_who(Client *client, string_view body) {
+    if (body.size() != 4) {
+        reply(client, "ERROR invalid frame\n");
+        return;
+    }
+    string name;
+    {
+        lock_guard<mutex> guard(user_directory.lock);
+        auto it = user_directory.users.find(static_cast<int>(load_u32(body.data())));
+        if (it != user_directory.users.end()) name = it->second.name;
+    }
+    send_output(client, BufferRef(format_frame(FRAME_USER, {body, name})));
+}
+
+// PRIVMSG <nick> <text>: a message for one user only, delivered as PRIVMSG <sender>
+// <text> in place, through the inbox of the shard serving it, or to its node
+void handle_privmsg(Client *client, string_view nick, string_view text) {
+    if (text.length() > MAX_MESSAGE_LENGTH) {
+        reply(client, "ERROR message too long\n");
+        return;
+    }
+    int recipient_uid;
+    UserEntry recipient;
+    if (!find_user(nick, recipient_uid, recipient)) {
+        reply(client, "ERROR no such nickname " + string(nick) + "\n");
+        return;
+    }
+    if (recipient.shard < 0) {
+        federation_publish_direct(client->uid, client->name, recipient_uid, text);
+        return;
+    }
+    Relay relay;
+    relay.text = BufferRef(format_privmsg(client->name, text));
+    relay.text->stamp = now_ns();
+    if (recipient.shard == client->shard->index) {
+        deliver_direct(*client->shard, recipient.handle, relay);
+    } else {
+        post_direct(*shards[recipient.shard], recipient.handle, relay, client->uid);
+    }
+}
+
+// JOIN #room: subscribe to a room's messages
+void handle_join(Client *client, string_view name) {
+    client->room_aware = true;
+    if (!valid_room_name(name)) {
+        reply(client, "ERROR invalid room name\n");
+        return;
+    }
+    if (!find_membership(client, name)) {
+        Room *room = client->rooms.size() < MAX_ROOMS_PER_CLIENT ? acquire_room(name, true) : nullptr;
+        if (!room) {
+            reply(client, "ERROR too many rooms\n");
+            return;
+        }
+        join_room(client, room);
+        release_room(room);
+    }
+    reply(client, "OK JOIN " + string(name) + "\n");
+}
+
+// PART #room: stop receiving a room's messages
+void handle_part(Client *client, string_view name) {
+    Membership *membership = find_membership(client, name);
+    if (!membership) {
+        reply(client, "ERROR not in room " + string(name) + "\n");
+        return;
+    }
+    part_room(client, membership->room);
+    reply(client, "OK PART " + string(name) + "\n");
+}
+
+// HISTORY [#room] <count>|<seconds>s: replay recent lines of a room the client is in,
+// followed by OK HISTORY <lines>. They come from the room's history ring, or from the
+// journal when the ring has dropped lines the request reaches back to; a replay from
+// there is cut to what half the outbound queue limit holds, and one that is cut, or
+// could not reach back far enough without a journal, ends in OK HISTORY <lines> truncated
+void handle_history(Client *client, string_view room_name, unsigned amount, bool seconds) {
+    Membership *membership = find_membership(client, room_name);
+    if (!membership) {
+        reply(client, "ERROR not in room " + string(room_name) + "\n");
+        return;
+    }
+
+    Room *room = membership->room;
+    archive_staged(*client->shard);
+    size_t count = seconds ? SIZE_MAX : amount;
+    uint64_t since_ns = 0;
+    if (seconds) {
+        uint64_t now = wall_ns(), span = amount * 1000000000ull;
+        since_ns = now > span ? now - span : 0;
+    }
+
+    size_t lines = 0, stored = 0;
+    BufferRef replay;
+    {
+        lock_guard<mutex> guard(room->history_lock);
+        if (room->history) {
+            replay = BufferRef(room->history->collect(count, since_ns, lines));
+            stored = room->history->stored();
+        }
+    }
+    // the ring answered in full if it had count lines, or if it has older ones than asked for
+    bool complete = lines == count || lines < stored;
+    bool truncated = false;
+    if (complete || config.history == 0) {
+        // nothing more to find, or HISTORY is off
+    } else if (config.journal.directory.empty()) {
+        truncated = stored == config.history;
+    } else {
+        string text;
+        bool cut;
+        size_t found = journal_recent(room->name, count, since_ns, config.queue_bytes / 2, text, cut);
+        if (found > lines) {
+            lines = found;
+            replay = BufferRef(SharedBuffer::concat({string_view(text)}));
+            truncated = cut;
+        }
+    }
+    if (lines > 0) reply(client, replay);
+    reply(client, "OK HISTORY " + to_string(lines) + (truncated ? " truncated\n" : "\n"));
+}
+
+// handle one command line (without its '\n') from a joined client
+void handle_message(Client *client, string_view line) {
+    // validate and parse the incoming message
+    string_view message, nick;
+    string_view room = LOBBY_ROOM_NAME;
+    unsigned amount;
+    bool seconds;
+    if (parse_msg_command(line, message)) {
+        handle_chat(client, message);
+    } else if (parse_privmsg_command(line, nick, message)) {
+        handle_privmsg(client, nick, message);
+    } else if (!(message = parse_room_command(line, "JOIN")).empty()) {
+        handle_join(client, message);
+    } else if (!(message = parse_room_command(line, "PART")).empty()) {
+        handle_part(client, message);
+    } else if (parse_history_command(line, room, amount, seconds)) {
+        handle_history(client, room, amount, seconds);
+    } else if (is_pong_command(line)) {
+        // nothing to do, the input itself answered the PING
+    } else {
+        // invalid message format
+        string error_message = "ERROR invalid message format\n";
+        reply(client, error_message);
+    }
+}
+
+// handle one frame from a binary client that joined
+void handle_frame(Client *client, string_view frame) {
+    string_view body = frame.substr(1);
+    switch (frame.empty() ? 0 : frame[0]) {
+    case FRAME_MSG:
+        handle_frame_msg(client, body);
+        break;
+    case FRAME_TEXT:
+        if (const char *error = text_error(body)) {
+            reply(client, error);
+        } else {
+            handle_message(client, body);
+        }
+        break;
+    case FRAME_WHO:
+        handle_who(client, body);
+        break;
+    default:
+        reply(client, "ERROR invalid frame\n");
+    }
+}
+
+// the greeting was answered with HELLO 2: confirm, everything after it is frames
+void switch_to_binary(Client *client) {
+    send_output(client, HELLO_BINARY "\n");
+    client->binary = true;
+    binary_clients++;
+}
+
+// COMPRESS <method> before NICK: confirmed uncompressed, everything after that reply is
+// compressed. It is the last step of the handshake, HELLO 2 has to come first
+void handle_compress(Client *client, string_view method) {
+    Compression compression = method == COMPRESSION_DEFLATE          ? Compression::Deflate
+                              : method == COMPRESSION_DEFLATE_SHARED ? Compression::DeflateShared
+                                                                     : Compression::None;
+    if (client->compression != Compression::None || compression == Compression::None || config.compress_level == 0) {
+        reply(client, "ERROR unsupported compression\n");
+        return;
+    }
+    reply(client, "OK COMPRESS " + string(method) + "\n");
+    start_compression(client, compression);
+}
+
+// a command of the handshake other than NICK: HELLO 2 or COMPRESS; false if it is none
+bool handle_handshake_command(Client *client, string_view line) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line == HELLO_BINARY && !client->binary && client->compression == Compression::None) {
+        switch_to_binary(client);
+        return true;
+    }
+    if (line.compare(0, 9, "COMPRESS ") != 0) return false;
+    handle_compress(client, line.substr(9));
+    return true;
+}
+
+// charge a command of length bytes to the client's rate limits; false if it goes over
+// them, then the command is dropped and the client told once, or disconnected
+bool admit_input(Client *client, size_t length, uint64_t now) {
+    if (client->message_tokens.take(config.rate_msgs, 1, now) &&
+        client->byte_tokens.take(config.rate_bytes, static_cast<double>(length), now)) {
+        client->rate_limited = false;
+        return true;
+    }
+    client->shard->metrics.rate_limited.add();
+    if (config.rate_policy == RatePolicy::Disconnect) {
+        LOG_ERROR("error: client (uid=%d) over its rate limit, disconnecting\n", client->uid);
+        client->shard->metrics.rate_evictions.add();
+        reply(client, "ERROR rate limit exceeded\n");
+        close_client(client);
+    } else if (!client->rate_limited) {
+        reply(client, "ERROR rate limit exceeded\n");
+    }
+    client->rate_limited = true;
+    return false;
+}
+
+// the client used up its input budget of this tick with input left; the rest waits
+// for the next tick, and reading stops while that is a lot
+void defer_input(Client *client) {
+    Shard &shard = *client->shard;
+    if (!client->backlogged) {
+        client->backlogged = true;
+        shard.backlogged.push_back(client);
+    }
+    if (!client->paused && client->framer.pending() >= MAX_INPUT_BACKLOG) shard.io->pause(client);
+}
+
+// hand every complete line, or frame once the client switched to HELLO 2, in the
+// client's input buffer to the protocol handlers, up to the client's budget per tick
+void process_lines(Client *client) {
+    Shard &shard = *client->shard;
+    if (client->input_tick != shard.ticks) {
+        client->input_tick = shard.ticks;
+        client->input_used = 0;
+    }
+    uint64_t now = now_ns();
+    client->input_ns = now;  // any input, a partial line too, shows the client is there
+    string_view input;
+    LineScan scan;
+    while (!client->closing) {
+        if (config.input_budget > 0 && client->input_used >= config.input_budget) {
+            defer_input(client);
+            break;
+        }
+        bool joined = client->state == ClientState::Joined;
+        bool binary = client->binary;
+        // relayed with the 4 byte sender id in front, a frame still fits the limit
+        if (binary ? !client->framer.next_frame(input, MAX_FRAME_LENGTH - 4) : !client->framer.next_line(input, scan)) break;
+        client->input_used++;
+        if (!admit_input(client, input.size() + (binary ? 4 : 1), now)) continue;
+        if (binary) {
+            if (joined) {
+                handle_frame(client, input);
+            } else if (input.empty() || input[0] != FRAME_TEXT || !handle_handshake_command(client, input.substr(1))) {
+                handle_nick(client, !input.empty() && input[0] == FRAME_NICK ? input.substr(1) : string_view());
             }
-        } else if (receive == 0) {
-            cout << client->name << " left the chat\n";
-            fflush(stdout);  // flush stdout
-            string leave_message = "MSG " + client->name + " has left the chat\n";
-            send_message_to_all(leave_message, client->uid);
-            leave_flag = true;
         } else {
-            cout << "error: client (uid=" << client->uid << ") communication error\n";
-            fflush(stdout);  // flush stdout
-            leave_flag = true;
+            // the scan that found the line already trimmed and checked it
+            input = input.substr(0, scan.content);
+            if (joined && !scan.valid) {
+                reply(client, "ERROR invalid UTF-8\n");
+            } else if (joined) {
+                handle_message(client, input);
+            } else if (!handle_handshake_command(client, input)) {
+                handle_nick(client, parse_nick_command(input));
+            }
         }
-        memset(buffer, 0, MAX_BUFFER_SIZE); // clear buffer
     }
+    if (!client->closing && client->framer.overflowed()) {
+        reply(client, "ERROR message too long\n");
+        // a frame cannot be skipped without trusting its length
+        if (client->binary) close_client(client);
+    }
+}
 
-    close(client->sockfd);
-    remove_client_from_queue(client->uid);
-    delete client;
-    client_count--;
+// the peer closed its end: say goodbye in every room the client was in
+void client_left(Client *client) {
+    if (client->state == ClientState::Joined) {
+        LOG_INFO("%s left the chat\n", client->name.c_str());
+        string_view goodbye = "has left the chat";
+        for (Membership &membership : client->rooms) {
+            Relay leave_message = make_relay(client->uid, client->name, membership.room, &goodbye, 1);
+            send_message_to_room(*client->shard, membership.room, leave_message, client->uid);
+            federation_publish_message(client->uid, client->name, membership.room->name, &goodbye, 1);
+        }
+    }
+    close_client(client);
+}
+
+// admit a connection the engine accepted and greet it; the NICK reply is handled by the event loop
+void Shard::on_accept(int fd, const struct sockaddr_in &address) {
+    if (handed_over) {
+        // a late accept of a listener removed for an upgrade; the client retries
+        close(fd);
+        return;
+    }
+
+    // reserve the slot up front so concurrent shards cannot overshoot the limit
+    if (client_count.fetch_add(1) >= config.max_clients) {
+        client_count--;
+        LOG_ERROR("error: maximum clients reached. rejected: :%d\n", ntohs(address.sin_port));
+        metrics.connections_rejected.add();
+        close(fd);
+        return;
+    }
+
+    metrics.connections_accepted.add();
+    auto *client = new Client;
+    client->address = address;
+    client->sockfd = fd;
+    client->uid = 0;
+    client->shard = this;
+    client->handle = handshakes.insert(client);
+    client->input_ns = now_ns();
+    timers.schedule(*client, client->input_ns + ms_ns(config.handshake_timeout_ms));
+
+    if (!io->add_connection(client)) {
+        LOG_ERROR("error: failed to watch client socket: %s\n", strerror(errno));
+        close(fd);
+        handshakes.erase(client->handle);
+        timers.cancel(*client);
+        delete client;
+        client_count--;
+        return;
+    }
+
+    // send protocol version message
+    if (!send_output(client, PROTOCOL_MESSAGE, strlen(PROTOCOL_MESSAGE))) {
+        LOG_ERROR("error: failed to send protocol message\n");
+    }
+    flush_if_overdue(*this);
+}
+
+void Shard::on_wakeup() {
+    drain_inbox(*this);
+}
+
+// received bytes go straight into the client's line framer
+char *Shard::read_buffer(IoConnection *conn, size_t &length) {
+    Client *client = static_cast<Client*>(conn);
+    if (client->closing) return nullptr;
+    if (!client->framer.holds_buffer()) reading.push_back(client);
+    char *space = client->framer.write_ptr();  // may grow the buffer, so ask before write_space()
+    length = client->framer.write_space();
+    return space;
+}
+
+void Shard::on_read(IoConnection *conn, size_t length) {
+    Client *client = static_cast<Client*>(conn);
+    if (length == 0) {
+        // while upgrading the successor sees the end of the stream again and says goodbye
+        if (!quiesced) client_left(client);
+        return;
+    }
+    client->framer.commit(length);
+    metrics.bytes_in.add(length);
+    if (quiesced) return;  // handed over with the client, processed by the successor
+    process_lines(client);
+    flush_if_overdue(*this);
+}
+
+void Shard::on_writable(IoConnection *conn, size_t sent) {
+    Client *client = static_cast<Client*>(conn);
+    client->write_blocked = false;
+    if (client->pinned > 0) {
+        // an asynchronous send finished, its buffers are free to go; a short send
+        // means the socket buffer is full, the next send waits in the kernel
+        client->write_blocked = sent < client->pinned_bytes;
+        client->pinned = 0;
+        consume_sent(client, sent);
+    }
+    if (!client->closing && !flush_client(client)) close_client(client);
+    flush_if_overdue(*this);
+}
+
+void Shard::on_error(IoConnection *conn, int error) {
+    Client *client = static_cast<Client*>(conn);
+    client->pinned = 0;
+    if (client->closing) return;
+    LOG_ERROR("error: client (uid=%d) communication error: %s\n", client->uid, strerror(error));
+    close_client(client);
+}
+
+// the engine finished the operations it still had running when the client was reaped,
+// or released for an upgrade
+void Shard::on_released(IoConnection *conn) {
+    Client *client = static_cast<Client*>(conn);
+    if (client->closing) {
+        delete client;
+    } else {
+        releasing--;
+    }
 }
 
 // initialize server socket with retries for socket creation, setting options, and binding
@@ -147,25 +1722,24 @@ int initialize_server_socket(const char *host, const char *port) {
     int retry_count = 5;
     while (retry_count--) {
         if (getaddrinfo(host, port, &hints, &res) != 0) {
-            cerr << "error: failed to resolve socket address. retrying...\n";
-            fflush(stderr);  // flush stderr
+            LOG_ERROR("error: failed to resolve socket address. retrying...\n");
             sleep(1);
             continue;
         }
 
         sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
         if (sockfd < 0) {
-            cerr << "error: server socket creation failed. retrying...\n";
-            fflush(stderr);  // flush stderr
+            LOG_ERROR("error: server socket creation failed. retrying...\n");
             freeaddrinfo(res);
             sleep(1);
             continue;
         }
 
+        // each option needs its own call, every shard binds its own listener to the same port
         int option = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, (SO_REUSEPORT | SO_REUSEADDR), reinterpret_cast<char*>(&option), sizeof(option)) < 0) {
-            cerr << "error: setsockopt failed. retrying...\n";
-            fflush(stderr);  // flush stderr
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) < 0 ||
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) < 0) {
+            LOG_ERROR("error: setsockopt failed. retrying...\n");
             close(sockfd);
             freeaddrinfo(res);
             sleep(1);
@@ -173,8 +1747,7 @@ int initialize_server_socket(const char *host, const char *port) {
         }
 
         if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-            cerr << "error: server socket bind failed. retrying...\n";
-            fflush(stderr);  // flush stderr
+            LOG_ERROR("error: server socket bind failed. retrying...\n");
             close(sockfd);
             freeaddrinfo(res);
             sleep(1);
@@ -189,113 +1762,799 @@ int initialize_server_socket(const char *host, const char *port) {
     return -1; // should never reach here due to exit in handle_error
 }
 
-// signal handler for graceful server shutdown
+// signal handler for graceful server shutdown; the main event loop notices the flag and returns
 void signal_handler(int sig) {
-    cout << "\nshutting down server gracefully...\n";
-    fflush(stdout);  // flush stdout
-    exit(EXIT_SUCCESS);
+    if (sig == SIGUSR1) {
+        dump_requested = 1;
+    } else {
+        shutdown_requested = true;
+    }
 }
 
-// main server function
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        cerr << "error: usage: " << argv[0] << " <host:port>\n";
-        fflush(stderr);  // flush stderr
-        return EXIT_FAILURE;
+// resident set size of the process in bytes, 0 if unknown
+uint64_t resident_bytes() {
+    ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0;
+    if (!(statm >> size >> resident)) return 0;
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+// all metrics in Prometheus text format, summed over the shards
+string render_metrics() {
+    uint64_t accepted = 0, rejected = 0, handshakes_failed = 0, messages_in = 0, messages_out = 0;
+    uint64_t bytes_in = 0, bytes_out = 0, send_failures = 0, send_calls = 0, evictions = 0, drops = 0;
+    uint64_t deflate_in = 0, deflate_out = 0, rate_limited = 0, rate_evictions = 0;
+    uint64_t pings_sent = 0, ping_timeouts = 0, stall_evictions = 0;
+    HistogramSnapshot fanout_latency, queue_depth;
+    for (Shard *shard : shards) {
+        ShardMetrics &m = shard->metrics;
+        accepted += m.connections_accepted.get();
+        rejected += m.connections_rejected.get();
+        handshakes_failed += m.handshakes_failed.get();
+        messages_in += m.messages_in.get();
+        messages_out += m.messages_out.get();
+        bytes_in += m.bytes_in.get();
+        bytes_out += m.bytes_out.get();
+        send_failures += m.send_failures.get();
+        send_calls += m.send_calls.get();
+        evictions += m.slow_evictions.get();
+        drops += m.slow_drops.get();
+        deflate_in += m.deflate_in.get();
+        deflate_out += m.deflate_out.get();
+        rate_limited += m.rate_limited.get();
+        rate_evictions += m.rate_evictions.get();
+        pings_sent += m.pings_sent.get();
+        ping_timeouts += m.ping_timeouts.get();
+        stall_evictions += m.stall_evictions.get();
+        m.fanout_latency_ns.add_to(fanout_latency);
+        m.queue_depth.add_to(queue_depth);
     }
 
-    // parse host and port from command line argument
-    char *host = strtok(argv[1], ":");
-    char *port = strtok(nullptr, ":");
-    if (!host || !port) {
-        cerr << "error: invalid host or port format. use <host:port>\n";
-        fflush(stderr);  // flush stderr
-        return EXIT_FAILURE;
+    string out;
+    write_metric(out, "cserverd_connections_accepted_total", "counter", "Connections admitted.", accepted);
+    write_metric(out, "cserverd_connections_rejected_total", "counter", "Connections refused at the admission limit.", rejected);
+    write_metric(out, "cserverd_handshakes_failed_total", "counter", "Connections that sent a bad NICK or none in time.", handshakes_failed);
+    write_metric(out, "cserverd_messages_in_total", "counter", "Chat messages received for relay.", messages_in);
+    write_metric(out, "cserverd_messages_out_total", "counter", "Chat messages handed to recipients.", messages_out);
+    write_metric(out, "cserverd_bytes_in_total", "counter", "Bytes received from clients.", bytes_in);
+    write_metric(out, "cserverd_bytes_out_total", "counter", "Bytes sent to clients.", bytes_out);
+    write_metric(out, "cserverd_send_calls_total", "counter", "send and sendmsg calls made to clients.", send_calls);
+    write_metric(out, "cserverd_send_failures_total", "counter", "Sends that failed and closed the client.", send_failures);
+    write_metric(out, "cserverd_slow_consumer_evictions_total", "counter", "Clients disconnected by the slow-consumer policy.", evictions);
+    write_metric(out, "cserverd_slow_consumer_drops_total", "counter", "Messages dropped by the slow-consumer policy.", drops);
+    write_metric(out, "cserverd_deflate_in_bytes_total", "counter", "Bytes compressed for COMPRESS deflate clients.", deflate_in);
+    write_metric(out, "cserverd_deflate_out_bytes_total", "counter", "Compressed bytes those became.", deflate_out);
+    write_metric(out, "cserverd_rate_limited_total", "counter", "Commands refused by the per-client rate limits.", rate_limited);
+    write_metric(out, "cserverd_rate_limit_evictions_total", "counter", "Clients disconnected for going over the rate limits.", rate_evictions);
+    write_metric(out, "cserverd_pings_sent_total", "counter", "Keepalive PINGs sent to idle clients.", pings_sent);
+    write_metric(out, "cserverd_ping_timeouts_total", "counter", "Clients disconnected for not answering a PING.", ping_timeouts);
+    write_metric(out, "cserverd_stall_evictions_total", "counter", "Clients disconnected for output that stopped going out.", stall_evictions);
+    FederationStats federation = federation_stats();
+    write_metric(out, "cserverd_federation_links", "gauge", "Links to other nodes that are up.", federation.links);
+    write_metric(out, "cserverd_federation_received_total", "counter", "Broadcasts of other nodes received.", federation.received);
+    write_metric(out, "cserverd_federation_duplicates_total", "counter", "Copies of broadcasts dropped as already seen.", federation.duplicates);
+    write_metric(out, "cserverd_federation_forwarded_total", "counter", "Broadcasts passed on to other links.", federation.forwarded);
+    unsigned clients = client_count.load();
+    uint64_t resident = resident_bytes();
+    uint64_t per_client = clients > 0 && resident > startup_resident ? (resident - startup_resident) / clients : 0;
+    BufferPoolStats buffers = buffer_pool_stats();
+    ObjectPoolStats objects = object_pool_stats();
+    write_metric(out, "cserverd_clients", "gauge", "Open client connections.", clients);
+    write_metric(out, "cserverd_resident_bytes", "gauge", "Resident memory of the process.", resident);
+    write_metric(out, "cserverd_resident_bytes_per_client", "gauge", "Resident memory grown since startup, per open connection.", per_client);
+    write_metric(out, "cserverd_buffer_pool_borrowed_bytes", "gauge", "I/O buffers held by connections with data pending.", buffers.borrowed);
+    write_metric(out, "cserverd_buffer_pool_cached_bytes", "gauge", "Free I/O buffers kept for reuse.", buffers.cached);
+    write_metric(out, "cserverd_object_pool_bytes", "gauge", "Slabs of the connection object pool.", objects.slabs);
+    write_metric(out, "cserverd_object_pool_used_bytes", "gauge", "Pool slots held by connection objects.", objects.used);
+    write_metric(out, "cserverd_log_records_dropped_total", "counter", "Log records lost to a full log ring.", log_dropped());
+    write_metric(out, "cserverd_journal_bytes_total", "counter", "Bytes appended to the message journal.", journal_bytes());
+    write_metric(out, "cserverd_journal_syncs_total", "counter", "Group commits of the message journal.", journal_syncs());
+    write_summary(out, "cserverd_fanout_latency_seconds", "Time from receiving a message until its last recipient got it.",
+                  fanout_latency, 1e-9);
+    write_summary(out, "cserverd_client_queue_depth", "Outbound queue length in messages when a message is queued.",
+                  queue_depth, 1.0);
+    return out;
+}
+
+// write the metrics to the log, one record per line
+void dump_metrics() {
+    string text = render_metrics();
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        log_message(LogLevel::Info, "%.*s\n", (int)(end - start), text.data() + start);
+        start = end + 1;
     }
-    cout << "host: " << host << ", port: " << port << endl;
-    fflush(stdout);  // flush stdout
+}
 
-    // register signal handler for graceful shutdown
-    signal(SIGINT, signal_handler);
+// answer every connection on the admin socket with the current metrics; a request
+// starting with "GET " gets an HTTP response so a scraper can read it directly
+void run_admin(int admin_fd) {
+    while (true) {
+        int fd = accept4(admin_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_ERROR("error: admin accept failed: %s\n", strerror(errno));
+            return;
+        }
 
-    int server_sockfd = initialize_server_socket(host, port);
+        char request[512];
+        ssize_t length = 0;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, ADMIN_READ_TIMEOUT_MS) > 0) {
+            length = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+        }
+
+        string body = render_metrics();
+        string response;
+        if (length >= 4 && memcmp(request, "GET ", 4) == 0) {
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                       to_string(body.size()) + "\r\n\r\n";
+        }
+        response += body;
 
-    // set the server socket to non-blocking mode
-    fcntl(server_sockfd, F_SETFL, O_NONBLOCK);
+        size_t written = 0;
+        while (written < response.size()) {
+            ssize_t n = send(fd, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            written += n;
+        }
+        close(fd);
+    }
+}
 
-    // listen for incoming connections
-    if (listen(server_sockfd, MAX_CLIENTS) < 0) {
-        handle_error("error: server listen failed");
+// bind the admin Unix socket, replacing a stale socket file
+int open_admin_socket(const string &path) {
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR("error: admin socket path too long\n");
+        return -1;
     }
-    cout << "server listening on " << host << ":" << port << "...\n";
-    fflush(stdout);  // flush stdout
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
 
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_sockfd = accept(server_sockfd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sockfd < 0) {
-            // if no client is ready, continue looping (non-blocking mode)
-            continue;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        LOG_ERROR("error: admin socket %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// create the listener and inbox of a shard; a listener handed over by a predecessor
+// is taken as it is
+void setup_shard(Shard &shard, const char *host, const char *port, int inherited_fd) {
+    if (inherited_fd >= 0) {
+        shard.listen_fd = inherited_fd;
+    } else {
+        shard.listen_fd = initialize_server_socket(host, port);
+
+        // the listener and every client socket are non-blocking and owned by the event loop
+        if (set_nonblocking(shard.listen_fd) < 0) {
+            handle_error("error: failed to set server socket non-blocking");
         }
 
-        if ((client_count + 1) == MAX_CLIENTS) {
-            cerr << "error: maximum clients reached. rejected: ";
-            cerr << ":" << client_addr.sin_port << endl;
-            fflush(stderr);  // flush stderr
-            close(client_sockfd);
-            continue;
+        // listen for incoming connections
+        if (listen(shard.listen_fd, SOMAXCONN) < 0) {
+            handle_error("error: server listen failed");
         }
+    }
 
-        // send protocol version message
-        if (send(client_sockfd, PROTOCOL_MESSAGE, strlen(PROTOCOL_MESSAGE), 0) <= 0) {
-            cerr << "error: failed to send protocol message\n";
-            fflush(stderr);  // flush stderr
-            close(client_sockfd);
-            continue;
+    shard.inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard.inbox_fd < 0) {
+        handle_error("error: eventfd failed");
+    }
+}
+
+// create the I/O engine of a shard; this runs on the shard's own thread because an
+// io_uring ring only takes submissions from the thread that set it up
+void start_io(Shard &shard) {
+    if (config.io_uring) {
+        shard.io = create_uring_engine(shard);
+        if (!shard.io && shard.index == 0) {
+            LOG_ERROR("warning: io_uring is not available, falling back to epoll\n");
         }
+    }
+    if (!shard.io) shard.io = create_epoll_engine(shard);
+    if (!shard.io) {
+        handle_error("error: failed to create the I/O engine");
+    }
+    if (!shard.io->add_listener(shard.listen_fd) || !shard.io->add_wakeup(shard.inbox_fd)) {
+        handle_error("error: failed to watch the server socket");
+    }
+    LOG_DEBUG("shard %d uses %s\n", shard.index, shard.io->name());
+}
 
-        // handle NICK message
-        char nick_buffer[MAX_BUFFER_SIZE] = {0};
-        if (recv(client_sockfd, nick_buffer, sizeof(nick_buffer), 0) <= 0) {
-            cerr << "error: receiving NICK message failed\n";
-            fflush(stderr);  // flush stderr
-            close(client_sockfd);
-            continue;
+// give every client with input left over its budget of this tick, in the order their
+// budgets ran out; reading resumes once little is left. True if some still have more
+bool process_backlog(Shard &shard) {
+    if (shard.quiesced) return false;  // upgrading: the input travels with the client
+    size_t count = shard.backlogged.size();
+    for (size_t i = 0; i < count; i++) {
+        Client *client = shard.backlogged[i];
+        client->backlogged = false;
+        if (client->closing) continue;
+        process_lines(client);  // may list the client again, behind the others
+        if (client->paused && client->framer.pending() < MAX_INPUT_BACKLOG) shard.io->resume(client);
+        client->framer.release();
+    }
+    shard.backlogged.erase(shard.backlogged.begin(), shard.backlogged.begin() + count);
+    return !shard.backlogged.empty();
+}
+
+// give back the input buffers of the clients that read during this tick and have no
+// partial command left; the others keep theirs until it is complete
+void release_input_buffers(Shard &shard) {
+    for (Client *client : shard.reading) client->framer.release();
+    shard.reading.clear();
+}
+
+// one event loop iteration: work off the input backlog, flush and reap what the previous
+// one left behind, wait up to timeout ms for I/O (not at all while a backlog remains),
+// then flush and reap what that produced
+void run_tick(Shard &shard, int timeout) {
+    shard.ticks++;
+    release_input_buffers(shard);
+    if (process_backlog(shard)) timeout = 0;
+    flush_dirty_clients(shard);
+    reap_closing_clients(shard);
+
+    if (shard.io->poll(timeout) < 0) {
+        if (errno != EINTR) handle_error("error: waiting for I/O failed");
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_metrics();
         }
+        return;
+    }
 
-        char client_name[MAX_NAME_LENGTH + 1];  // ensure space for null terminator
-        sscanf(nick_buffer, "NICK %s", client_name);
-        client_name[strcspn(client_name, "\n")] = '\0';
+    release_input_buffers(shard);
+    flush_dirty_clients(shard);
+    reap_closing_clients(shard);
+}
 
-        regex nickname_regex("^[A-Za-z0-9_]+$");
-        if (regex_match(client_name, nickname_regex) && strlen(client_name) <= MAX_NAME_LENGTH) {
-            if (send(client_sockfd, OK_MESSAGE, strlen(OK_MESSAGE), 0) <= 0) {
-                cerr << "error: sending OK message failed\n";
-                fflush(stderr);  // flush stderr
-                close(client_sockfd);
-                continue;
+// register the clients a predecessor handed over with their shards and rooms before
+// any shard runs, so no input they carry is processed while a member is missing
+void adopt_clients(vector<HandoffClient> &handed) {
+    for (HandoffClient &session : handed) {
+        Shard &shard = *shards[session.shard % shards.size()];
+        auto *client = new Client;
+        client->sockfd = session.fd;
+        client->address = session.address;
+        client->uid = session.uid;
+        client->shard = &shard;
+        client->room_aware = session.room_aware;
+        client->binary = session.binary;
+        if (client->binary) binary_clients++;
+        client->input_ns = client->output_ns = now_ns();
+        if (session.joined) {
+            client->name = move(session.name);
+            client->state = ClientState::Joined;
+            add_client_to_queue(client);
+            user_directory.uids[client->name] = client->uid;
+            user_directory.users[client->uid] = UserEntry{client->name, shard.index, client->handle};
+            for (const string &name : session.rooms) {
+                Room *room = acquire_room(name, true);
+                if (!room) continue;
+                join_room(client, room);
+                release_room(room);
             }
+            arm_timer(client);
+        } else {
+            client->handle = shard.handshakes.insert(client);
+            shard.timers.schedule(*client, client->input_ns + ms_ns(config.handshake_timeout_ms));
+        }
+        Compression compression = static_cast<Compression>(session.compression);
+        if (compression > Compression::DeflateShared) compression = Compression::None;
+        shard.adopted.push_back(AdoptedClient{client, move(session.input), move(session.output), compression});
+        client_count++;
+    }
+}
 
-            // add client to queue
-            auto *client = new Client;
-            client->address = client_addr;
-            client->sockfd = client_sockfd;
-            client->uid = uid++;
-            client->name = client_name;
+// start I/O on the adopted clients of shard: first the output the predecessor could
+// not send, then the input it did not process, which may already relay new lines
+void start_adopted(Shard &shard) {
+    for (AdoptedClient &adopted : shard.adopted) {
+        Client *client = adopted.client;
+        if (!shard.io->add_connection(client)) {
+            LOG_ERROR("error: failed to watch client socket: %s\n", strerror(errno));
+            close_client(client);
+            continue;
+        }
+        // already in the client's wire format, compressed or not
+        if (!adopted.output.empty()) send_output(client, adopted.output.data(), adopted.output.size());
+        start_compression(client, adopted.compression);
+        client->framer.append(adopted.input.data(), adopted.input.size());
+    }
+    for (AdoptedClient &adopted : shard.adopted) {
+        process_lines(adopted.client);
+        adopted.client->framer.release();
+    }
+    shard.adopted = vector<AdoptedClient>();
+}
 
-            cout << client->name << " joined the chat\n";
-            fflush(stdout);  // flush stdout
-            add_client_to_queue(client);
-            thread(handle_client, client).detach();
+// move the hot upgrade to phase and wake every shard to notice
+void set_upgrade_phase(UpgradePhase phase) {
+    {
+        lock_guard<mutex> guard(upgrade.lock);
+        upgrade.phase.store(phase, memory_order_release);
+    }
+    upgrade.changed.notify_all();
+    uint64_t one = 1;
+    for (Shard *shard : shards) {
+        if (write(shard->inbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_ERROR("error: failed to wake shard: %s\n", strerror(errno));
+        }
+    }
+}
+
+// count the calling shard in or out of an upgrade step
+void count_upgrade_step(int &counter, int delta) {
+    {
+        lock_guard<mutex> guard(upgrade.lock);
+        counter += delta;
+    }
+    upgrade.changed.notify_all();
+}
+
+// block until counter, one of the upgrade step counts, reaches count
+void wait_for_upgrade_step(const int &counter, int count) {
+    unique_lock<mutex> lock(upgrade.lock);
+    upgrade.changed.wait(lock, [&] { return counter == count; });
+}
+
+// every client of shard that is not being closed, joined or still in the handshake
+vector<Client*> live_clients(Shard &shard) {
+    vector<Client*> live;
+    for (Client *client : shard.clients) {
+        if (!client->closing) live.push_back(client);
+    }
+    for (Client *client : shard.handshakes) {
+        if (!client->closing) live.push_back(client);
+    }
+    return live;
+}
+
+bool has_output(Shard &shard) {
+    for (Client *client : live_clients(shard)) {
+        if (!client->outqueue.empty()) return true;
+    }
+    return false;
+}
+
+// the session of a released client as the successor needs it
+HandoffClient describe_client(Client *client) {
+    HandoffClient session;
+    session.fd = client->sockfd;
+    session.shard = client->shard->index;
+    session.address = client->address;
+    session.uid = client->uid;
+    session.joined = client->state == ClientState::Joined;
+    session.room_aware = client->room_aware;
+    session.binary = client->binary;
+    // what the predecessor did not compress yet goes over as it will reach the client
+    if (client->compression != Compression::None) deflate_queued(client);
+    session.compression = static_cast<uint8_t>(client->compression);
+    session.name = client->name;
+    for (Membership &membership : client->rooms) session.rooms.push_back(membership.room->name);
+    string_view input = client->framer.buffered();
+    session.input.assign(input.data(), input.size());
+    size_t offset = client->out_offset;
+    for (const BufferRef &message : client->outqueue) {
+        session.output.append(message->data() + offset, message->size() - offset);
+        offset = 0;
+    }
+    return session;
+}
+
+// the upgrade failed: take the listener and the clients back and process the input
+// that was held back meanwhile
+void resume_shard(Shard &shard) {
+    shard.handoff.clear();
+    shard.handed_over = false;
+    shard.quiesced = false;
+    if (!shard.io->add_listener(shard.listen_fd)) {
+        handle_error("error: failed to watch the server socket");
+    }
+    vector<Client*> clients = live_clients(shard);
+    for (Client *client : clients) {
+        if (!shard.io->add_connection(client)) close_client(client);
+    }
+    for (Client *client : clients) process_lines(client);
+    count_upgrade_step(upgrade.shards_quiesced, -1);
+}
+
+// a successor is taking over: stop accepting and processing input, drain the outbound
+// queues, then release the listener and the clients for run_upgrade() to send.
+// Returns true once the successor has them, false if the upgrade failed and the
+// shard carries on where it stopped
+bool hand_over_shard(Shard &shard) {
+    shard.io->remove_listener();
+    shard.quiesced = true;
+    count_upgrade_step(upgrade.shards_quiesced, 1);
+
+    // the other shards may still relay into this one until they are quiet as well
+    while (upgrade.phase.load(memory_order_acquire) == UpgradePhase::Quiesce) {
+        run_tick(shard, UPGRADE_POLL_MS);
+    }
+
+    // no inbox gets anything new now; what the queues still hold at the deadline
+    // travels with the client
+    drain_inbox(shard);
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(config.upgrade_drain_ms);
+    while (has_output(shard) && chrono::steady_clock::now() < deadline) {
+        run_tick(shard, UPGRADE_POLL_MS);
+    }
+
+    // a send still in flight has put an unknown part of the queue on the wire, so
+    // that client cannot be handed over consistently; its peer did not read during
+    // the whole drain, the slow-consumer policy would have caught up with it anyway
+    for (Client *client : live_clients(shard)) {
+        if (client->pinned > 0) {
+            LOG_ERROR("error: evicting slow client (uid=%d) for the upgrade\n", client->uid);
+            shard.metrics.slow_evictions.add();
+            close_client(client);
+        }
+    }
+    for (Client *client : shard.dirty_clients) client->dirty = false;
+    shard.dirty_clients.clear();
+    reap_closing_clients(shard);
+
+    shard.handed_over = true;
+    for (Client *client : live_clients(shard)) {
+        if (!shard.io->release(client)) shard.releasing++;
+    }
+    // operations still finishing may deliver input, which moves along as well
+    while (shard.releasing > 0) {
+        if (shard.io->poll(UPGRADE_POLL_MS) < 0 && errno != EINTR) {
+            handle_error("error: waiting for I/O failed");
+        }
+    }
+    for (Client *client : live_clients(shard)) shard.handoff.push_back(describe_client(client));
+    count_upgrade_step(upgrade.shards_handed, 1);
 
+    unique_lock<mutex> lock(upgrade.lock);
+    upgrade.changed.wait(lock, [] {
+        UpgradePhase phase = upgrade.phase.load(memory_order_acquire);
+        return phase == UpgradePhase::Commit || phase == UpgradePhase::Abort;
+    });
+    if (upgrade.phase.load(memory_order_acquire) == UpgradePhase::Commit) return true;
+    lock.unlock();
+    resume_shard(shard);
+    return false;
+}
+
+// run one hot upgrade towards the successor connected on fd; true once it took over
+bool hand_over(int fd) {
+    LOG_INFO("successor connected, handing over...\n");
+    int workers = static_cast<int>(shards.size());
+    // the successor links up as the same node, and nothing may come in from the
+    // other nodes while the shards drain
+    bool federated = config.federation.node_id != 0;
+    if (federated) federation_stop();
+    set_upgrade_phase(UpgradePhase::Quiesce);
+    wait_for_upgrade_step(upgrade.shards_quiesced, workers);
+    set_upgrade_phase(UpgradePhase::Drain);
+    wait_for_upgrade_step(upgrade.shards_handed, workers);
+
+    HandoffState state;
+    state.next_uid = uid.load();
+    for (Shard *shard : shards) {
+        state.listeners.push_back(shard->listen_fd);
+        for (HandoffClient &session : shard->handoff) state.clients.push_back(move(session));
+    }
+    bool taken = handoff_send(fd, state);
+    count_upgrade_step(upgrade.shards_handed, -workers);
+    if (taken) {
+        LOG_INFO("handed %zu client(s) over to the successor\n", state.clients.size());
+        set_upgrade_phase(UpgradePhase::Commit);
+        return true;
+    }
+
+    LOG_ERROR("error: handing over to the successor failed, resuming\n");
+    set_upgrade_phase(UpgradePhase::Abort);
+    wait_for_upgrade_step(upgrade.shards_quiesced, 0);
+    set_upgrade_phase(UpgradePhase::Idle);
+    if (federated && !federation_start(config.federation, federation_handler)) {
+        LOG_ERROR("error: failed to restart the federation, this node stays unlinked\n");
+    }
+    return false;
+}
+
+// serve the upgrade socket: the first successor that asks takes everything over
+void run_upgrade(int upgrade_fd) {
+    while (true) {
+        int fd = accept4(upgrade_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_ERROR("error: upgrade accept failed: %s\n", strerror(errno));
+            return;
+        }
+        bool taken = handoff_await_request(fd) && hand_over(fd);
+        close(fd);
+        if (taken) return;
+    }
+}
+
+// event loop of one shard; returns at shutdown or once a successor took the shard over
+void run_shard(Shard *shard) {
+    current_shard = shard;
+    start_io(*shard);
+    start_adopted(*shard);
+    while (!shutdown_requested) {
+        if (upgrade.phase.load(memory_order_acquire) == UpgradePhase::Quiesce && hand_over_shard(*shard)) {
+            return;
+        }
+        run_tick(*shard, expire_timers(*shard));
+    }
+    archive_staged(*shard);
+}
+
+// raise the descriptor limit towards the admission limit; every client holds one socket
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return;
+    rlim_t wanted = config.max_clients + 64;  // listeners, engine and eventfd descriptors
+    if (limit.rlim_cur >= wanted) return;
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? wanted : min(wanted, limit.rlim_max);
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < wanted) {
+        LOG_ERROR("warning: descriptor limit %llu is below --max-clients %u\n",
+                  (unsigned long long)limit.rlim_cur, config.max_clients);
+    }
+}
+
+// parse the command line into config; returns the <host:port> argument or nullptr on error
+char *parse_options(int argc, char **argv) {
+    char *address = nullptr;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (option == "--workers" && has_value) {
+            config.workers = atoi(argv[++i]);
+            if (config.workers < 1 || config.workers > MAX_WORKERS) return nullptr;
+        } else if (option == "--max-clients" && has_value) {
+            config.max_clients = strtoul(argv[++i], nullptr, 10);
+            if (config.max_clients < 1) return nullptr;
+        } else if (option == "--handshake-timeout" && has_value) {
+            config.handshake_timeout_ms = atoi(argv[++i]);
+            if (config.handshake_timeout_ms < 1) return nullptr;
+        } else if (option == "--idle-timeout" && has_value) {
+            config.idle_timeout_ms = atoi(argv[++i]);
+            if (config.idle_timeout_ms < 0) return nullptr;
+        } else if (option == "--ping-timeout" && has_value) {
+            config.ping_timeout_ms = atoi(argv[++i]);
+            if (config.ping_timeout_ms < 1) return nullptr;
+        } else if (option == "--stall-timeout" && has_value) {
+            config.stall_timeout_ms = atoi(argv[++i]);
+            if (config.stall_timeout_ms < 0) return nullptr;
+        } else if (option == "--log-level" && has_value) {
+            string level = argv[++i];
+            if (level == "error") config.log_level = LogLevel::Error;
+            else if (level == "info") config.log_level = LogLevel::Info;
+            else if (level == "debug") config.log_level = LogLevel::Debug;
+            else return nullptr;
+        } else if (option == "--admin" && has_value) {
+            config.admin_path = argv[++i];
+        } else if (option == "--no-content-log") {
+            config.log_content = false;
+        } else if (option == "--queue-bytes" && has_value) {
+            config.queue_bytes = strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--queue-msgs" && has_value) {
+            config.queue_msgs = strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--slow-policy" && has_value) {
+            string policy = argv[++i];
+            if (policy == "drop-oldest") config.slow_policy = SlowPolicy::DropOldest;
+            else if (policy == "drop-newest") config.slow_policy = SlowPolicy::DropNewest;
+            else if (policy == "disconnect") config.slow_policy = SlowPolicy::Disconnect;
+            else return nullptr;
+        } else if (option == "--io-engine" && has_value) {
+            string engine = argv[++i];
+            if (engine == "epoll") config.io_uring = false;
+            else if (engine == "io_uring") config.io_uring = true;
+            else return nullptr;
+        } else if (option == "--coalesce-us" && has_value) {
+            config.coalesce_us = atoi(argv[++i]);
+            if (config.coalesce_us < 0) return nullptr;
+        } else if (option == "--history" && has_value) {
+            config.history = strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--journal" && has_value) {
+            config.journal.directory = argv[++i];
+        } else if (option == "--journal-segment-bytes" && has_value) {
+            config.journal.segment_bytes = strtoull(argv[++i], nullptr, 10);
+            if (config.journal.segment_bytes < 4096 || config.journal.segment_bytes > UINT32_MAX) return nullptr;
+        } else if (option == "--journal-segments" && has_value) {
+            config.journal.keep_segments = strtoul(argv[++i], nullptr, 10);
+            if (config.journal.keep_segments < 1) return nullptr;
+        } else if (option == "--upgrade-socket" && has_value) {
+            config.upgrade_path = argv[++i];
+        } else if (option == "--upgrade-drain-ms" && has_value) {
+            config.upgrade_drain_ms = atoi(argv[++i]);
+            if (config.upgrade_drain_ms < 0) return nullptr;
+        } else if (option == "--compress-level" && has_value) {
+            config.compress_level = atoi(argv[++i]);
+            if (config.compress_level < 0 || config.compress_level > 9) return nullptr;
+        } else if ((option == "--rate-msgs" || option == "--rate-bytes") && has_value) {
+            // the burst is one second's worth
+            RateLimit &limit = option == "--rate-msgs" ? config.rate_msgs : config.rate_bytes;
+            limit.rate = limit.burst = strtod(argv[++i], nullptr);
+            if (limit.rate < 0) return nullptr;
+        } else if (option == "--rate-policy" && has_value) {
+            string policy = argv[++i];
+            if (policy == "error") config.rate_policy = RatePolicy::Error;
+            else if (policy == "disconnect") config.rate_policy = RatePolicy::Disconnect;
+            else return nullptr;
+        } else if (option == "--input-budget" && has_value) {
+            config.input_budget = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--node-id" && has_value) {
+            config.federation.node_id = strtoul(argv[++i], nullptr, 10);
+            if (config.federation.node_id < 1 || config.federation.node_id > MAX_NODE_ID) return nullptr;
+        } else if (option == "--peer-listen" && has_value) {
+            config.federation.listen = argv[++i];
+        } else if (option == "--peer" && has_value) {
+            config.federation.peers.push_back(argv[++i]);
+        } else if (option == "--peer-secret-file" && has_value) {
+            config.peer_secret_path = argv[++i];
+        } else if (option == "--peer-timeout" && has_value) {
+            config.federation.timeout_ms = atoi(argv[++i]);
+            if (config.federation.timeout_ms < 100) return nullptr;
+        } else if (option == "--journal-sync-ms" && has_value) {
+            config.journal.sync_ms = atoi(argv[++i]);
+            if (config.journal.sync_ms < 1) return nullptr;
+        } else if (!address && option[0] != '-') {
+            address = argv[i];
         } else {
-            // invalid nickname
-            send(client_sockfd, ERROR_MESSAGE, strlen(ERROR_MESSAGE), 0);
-            close(client_sockfd);
+            return nullptr;
+        }
+    }
+    // links need a node id to tell the nodes apart, and the secret to be let in
+    bool linked = !config.federation.listen.empty() || !config.federation.peers.empty();
+    if (linked && (config.federation.node_id == 0 || config.peer_secret_path.empty())) return nullptr;
+    return address;
+}
+
+// the federation's shared secret: the first line of the file at path, without
+// trailing whitespace; exits if there is none
+string read_secret(const string &path) {
+    ifstream file(path);
+    string secret;
+    if (!file || !getline(file, secret)) handle_error("error: cannot read peer secret file " + path);
+    while (!secret.empty() && isspace(static_cast<unsigned char>(secret.back()))) secret.pop_back();
+    if (secret.empty()) {
+        errno = EINVAL;
+        handle_error("error: empty peer secret in " + path);
+    }
+    return secret;
+}
+
+// main server function
+int main(int argc, char **argv) {
+    char *address = parse_options(argc, argv);
+    if (!address) {
+        cerr << "error: usage: " << argv[0] << " <host:port> [--workers N] [--max-clients N] [--handshake-timeout MS]"
+             << " [--idle-timeout MS] [--ping-timeout MS] [--stall-timeout MS] [--io-engine epoll|io_uring]"
+             << " [--queue-bytes N] [--queue-msgs N] [--coalesce-us US]"
+             << " [--slow-policy drop-oldest|drop-newest|disconnect]"
+             << " [--log-level error|info|debug] [--no-content-log] [--admin PATH]"
+             << " [--history N] [--journal DIR] [--journal-segment-bytes N] [--journal-segments N]"
+             << " [--journal-sync-ms MS] [--upgrade-socket PATH] [--upgrade-drain-ms MS]"
+             << " [--compress-level 0-9] [--rate-msgs N] [--rate-bytes N] [--rate-policy error|disconnect]"
+             << " [--input-budget N] [--node-id N] [--peer-listen HOST:PORT] [--peer HOST:PORT]..."
+             << " [--peer-secret-file PATH] [--peer-timeout MS]\n";
+        fflush(stderr);  // flush stderr
+        return EXIT_FAILURE;
+    }
+
+    // parse host and port from command line argument
+    char *host = strtok(address, ":");
+    char *port = strtok(nullptr, ":");
+    if (!host || !port) {
+        cerr << "error: invalid host or port format. use <host:port>\n";
+        fflush(stderr);  // flush stderr
+        return EXIT_FAILURE;
+    }
+    logger_start(config.log_level, config.log_content);
+    LOG_INFO("host: %s, port: %s\n", host, port);
+
+    // register signal handler for graceful shutdown
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, signal_handler);  // dump metrics
+    SharedBuffer::release_hook = record_fanout_latency;
+
+    // a server already running on the upgrade socket hands over its listeners and
+    // clients; the journal is opened afterwards so it holds everything that server relayed
+    HandoffState handed;
+    if (!config.upgrade_path.empty()) {
+        int fd = handoff_connect(config.upgrade_path);
+        if (fd >= 0) {
+            LOG_INFO("taking over from the running server...\n");
+            bool taken = handoff_request(fd, handed);
+            close(fd);
+            if (!taken) handle_error("error: taking over from the running server failed");
         }
     }
 
-    close(server_sockfd);
-    return 0;
-}
\ No newline at end of file
+    raise_fd_limit();
+
+    // every shard gets its own SO_REUSEPORT listener, the kernel spreads connections over them
+    for (int i = 0; i < config.workers; i++) {
+        auto *shard = new Shard;
+        shard->index = i;
+        setup_shard(*shard, host, port, i < (int)handed.listeners.size() ? handed.listeners[i] : -1);
+        shards.push_back(shard);
+    }
+    if (handed.listeners.size() > shards.size()) {
+        // connections still waiting in the backlog of these listeners are reset
+        LOG_ERROR("warning: the previous server ran more workers, closing %zu listener(s)\n",
+                  handed.listeners.size() - shards.size());
+        for (size_t i = shards.size(); i < handed.listeners.size(); i++) close(handed.listeners[i]);
+    }
+    lobby = acquire_room(LOBBY_ROOM_NAME, true);   // held for good, the lobby always exists
+    if (!handed.clients.empty()) {
+        uid = max(uid.load(), handed.next_uid);
+        adopt_clients(handed.clients);
+        LOG_INFO("took over %zu client(s)\n", handed.clients.size());
+    }
+    if (!config.journal.directory.empty() && !journal_open(config.journal, replay_journal)) {
+        handle_error("error: failed to open the message journal");
+    }
+    if (config.federation.node_id != 0) {
+        if (!config.peer_secret_path.empty()) config.federation.secret = read_secret(config.peer_secret_path);
+        if (!federation_start(config.federation, federation_handler)) {
+            handle_error("error: failed to start the federation");
+        }
+        // clients taken over are announced like new ones, nothing new for the other nodes
+        lock_guard<mutex> guard(user_directory.lock);
+        for (auto &user : user_directory.users) federation_publish_presence(user.first, user.second.name, true);
+        LOG_INFO("node %u of a federation\n", config.federation.node_id);
+    }
+    startup_resident = resident_bytes();
+    LOG_INFO("server listening on %s:%s with %d worker(s)...\n", host, port, config.workers);
+
+    // shard 0 runs on the main thread; the workers block the shutdown signals so
+    // they are always delivered to it
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    for (int i = 1; i < config.workers; i++) {
+        shards[i]->worker = thread(run_shard, shards[i]);
+    }
+    if (!config.admin_path.empty()) {
+        int admin_fd = open_admin_socket(config.admin_path);
+        if (admin_fd >= 0) thread(run_admin, admin_fd).detach();
+    }
+    if (!config.upgrade_path.empty()) {
+        int upgrade_fd = handoff_listen(config.upgrade_path);
+        if (upgrade_fd >= 0) thread(run_upgrade, upgrade_fd).detach();
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    run_shard(shards[0]);
+
+    // no more traffic from the other nodes into the shards, the journal or the log
+    federation_stop();
+    // the workers block the signals and only see the flag once woken; they archive
+    // their last lines and stop using the journal, logger and directories before
+    // those go. After an upgrade they have returned already, or are about to
+    for (size_t i = 1; i < shards.size(); i++) {
+        wake_shard(*shards[i]);
+        shards[i]->worker.join();
+    }
+
+    // after an upgrade the socket files belong to the successor
+    if (upgrade.phase.load() == UpgradePhase::Commit) {
+        LOG_INFO("\nhanded over to the new server, exiting...\n");
+    } else {
+        LOG_INFO("\nshutting down server gracefully...\n");
+        if (!config.admin_path.empty()) unlink(config.admin_path.c_str());
+        if (!config.upgrade_path.empty()) unlink(config.upgrade_path.c_str());
+    }
+    journal_close();
+    logger_stop();
+    exit(EXIT_SUCCESS);
+}
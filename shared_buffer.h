@@ -0,0 +1,98 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <atomic>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <string_view>
+#include <utility>
+
+// Immutable, reference-counted byte buffer for broadcasts.
+//
+// The header and the bytes live in one allocation. A message is formatted once by
+// its sender and every recipient's outbound queue holds a reference to the same
+// bytes, on any shard; the last release frees it.
+class SharedBuffer {
+public:
+    // allocate room for capacity bytes with a reference count of one
+    static SharedBuffer *create(size_t capacity) {
+        void *memory = ::operator new(sizeof(SharedBuffer) + capacity);
+        return new (memory) SharedBuffer();
+    }
+
+    // allocate a buffer holding the concatenation of parts
+    static SharedBuffer *concat(std::initializer_list<std::string_view> parts) {
+        size_t total = 0;
+        for (std::string_view part : parts) total += part.size();
+        SharedBuffer *buffer = create(total);
+        for (std::string_view part : parts) buffer->append(part);
+        return buffer;
+    }
+
+    // append while the buffer is still private to its creator, within the capacity it was created with
+    void append(std::string_view part) {
+        memcpy(bytes() + size_, part.data(), part.size());
+        size_ += part.size();
+    }
+
+    const char *data() const { return bytes(); }
+    size_t size() const { return size_; }
+    std::string_view view() const { return std::string_view(bytes(), size_); }
+
+    // caller-defined timestamp, e.g. when the message was received; 0 means unset
+    uint64_t stamp = 0;
+
+    // called on the thread that drops the last reference of a stamped buffer
+    static inline void (*release_hook)(const SharedBuffer &buffer) = nullptr;
+
+    void retain() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (stamp && release_hook) release_hook(*this);
+            this->~SharedBuffer();
+            ::operator delete(this);
+        }
+    }
+
+private:
+    SharedBuffer() = default;
+
+    char *bytes() { return reinterpret_cast<char*>(this + 1); }
+    const char *bytes() const { return reinterpret_cast<const char*>(this + 1); }
+
+    std::atomic<unsigned> refs_{1};
+    size_t size_ = 0;
+};
+
+// owning handle to a SharedBuffer; copies share the bytes
+class BufferRef {
+public:
+    BufferRef() = default;
+    explicit BufferRef(SharedBuffer *adopt) : buffer_(adopt) {}
+    BufferRef(const BufferRef &other) : buffer_(other.buffer_) {
+        if (buffer_) buffer_->retain();
+    }
+    BufferRef(BufferRef &&other) noexcept : buffer_(other.buffer_) {
+        other.buffer_ = nullptr;
+    }
+    BufferRef &operator=(BufferRef other) noexcept {
+        std::swap(buffer_, other.buffer_);
+        return *this;
+    }
+    ~BufferRef() {
+        if (buffer_) buffer_->release();
+    }
+
+    SharedBuffer *get() const { return buffer_; }
+    SharedBuffer *operator->() const { return buffer_; }
+    explicit operator bool() const { return buffer_ != nullptr; }
+
+private:
+    SharedBuffer *buffer_ = nullptr;
+};
+
+#endif
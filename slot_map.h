@@ -0,0 +1,103 @@
+#ifndef SLOT_MAP_H
+#define SLOT_MAP_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Stable reference to an entry of a SlotMap. The generation makes a handle to a
+// removed entry fail to resolve even after its slot has been reused.
+struct SlotHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+    bool operator==(const SlotHandle &other) const {
+        return index == other.index && generation == other.generation;
+    }
+    bool operator!=(const SlotHandle &other) const { return !(*this == other); }
+};
+
+// Growable container with O(1) insert, remove and lookup through generational
+// handles, and values kept densely packed so iterating them is a linear walk.
+//
+// Removing swaps the last value into the hole, so removal during iteration is
+// not allowed; callers defer it until the walk is done.
+template <typename T>
+class SlotMap {
+public:
+    using iterator = typename std::vector<T>::iterator;
+    using const_iterator = typename std::vector<T>::const_iterator;
+
+    void reserve(size_t capacity) {
+        values_.reserve(capacity);
+        owners_.reserve(capacity);
+        slots_.reserve(capacity);
+    }
+
+    SlotHandle insert(T value) {
+        uint32_t index;
+        if (free_head_ != UINT32_MAX) {
+            index = free_head_;
+            free_head_ = slots_[index].dense;
+        } else {
+            index = static_cast<uint32_t>(slots_.size());
+            slots_.push_back(Slot{0, 0});
+        }
+        Slot &slot = slots_[index];
+        slot.dense = static_cast<uint32_t>(values_.size());
+        values_.push_back(std::move(value));
+        owners_.push_back(index);
+        return SlotHandle{index, slot.generation};
+    }
+
+    bool erase(SlotHandle handle) {
+        if (!contains(handle)) return false;
+        Slot &slot = slots_[handle.index];
+        uint32_t dense = slot.dense;
+        uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+        if (dense != last) {
+            values_[dense] = std::move(values_[last]);
+            owners_[dense] = owners_[last];
+            slots_[owners_[dense]].dense = dense;
+        }
+        values_.pop_back();
+        owners_.pop_back();
+
+        // bump the generation so stale handles miss, then put the slot on the free list
+        slot.generation++;
+        slot.dense = free_head_;
+        free_head_ = handle.index;
+        return true;
+    }
+
+    bool contains(SlotHandle handle) const {
+        // a free slot's generation is always ahead of every handle ever given out for it
+        return handle.index < slots_.size() && slots_[handle.index].generation == handle.generation;
+    }
+
+    T *get(SlotHandle handle) {
+        return contains(handle) ? &values_[slots_[handle.index].dense] : nullptr;
+    }
+
+    size_t size() const { return values_.size(); }
+    bool empty() const { return values_.empty(); }
+
+    iterator begin() { return values_.begin(); }
+    iterator end() { return values_.end(); }
+    const_iterator begin() const { return values_.begin(); }
+    const_iterator end() const { return values_.end(); }
+
+private:
+    struct Slot {
+        uint32_t dense;        // position in values_ while live, next free slot while free
+        uint32_t generation;
+    };
+
+    std::vector<T> values_;          // live values, densely packed
+    std::vector<uint32_t> owners_;   // slot index of each dense value
+    std::vector<Slot> slots_;
+    uint32_t free_head_ = UINT32_MAX;
+};
+
+#endif
@@ -0,0 +1,530 @@
+#include "text_scan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_SCAN_X86 1
+#endif
+
+using namespace std;
+
+namespace {
+
+enum class Step { Found, Stopped, CutOff };
+
+// length of the sequence the lead byte at p starts, n bytes available: 0 if it is
+// malformed, more than n if it is cut off with what arrived well-formed so far
+size_t sequence_length(const unsigned char *p, size_t n) {
+    unsigned char lead = p[0];
+    unsigned char low = 0x80, high = 0xBF;   // range of the second byte
+    size_t size;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        size = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        size = 3;
+        if (lead == 0xE0) low = 0xA0;        // overlong
+        if (lead == 0xED) high = 0x9F;       // surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        size = 4;
+        if (lead == 0xF0) low = 0x90;        // overlong
+        if (lead == 0xF4) high = 0x8F;       // above U+10FFFF
+    } else {
+        return 0;
+    }
+    for (size_t k = 1; k < size; k++) {
+        if (k == n) return size;
+        if (p[k] < low || p[k] > high) return 0;
+        low = 0x80;
+        high = 0xBF;
+    }
+    return size;
+}
+
+// the '\n' ending line is at end: the line is found, trailing whitespace is trimmed
+// looking back from there, as it is only ever a few bytes
+void found_at(const unsigned char *line, size_t end, LineScan &scan) {
+    size_t content = end;
+    while (content > 0 && (line[content - 1] == ' ' || line[content - 1] == '\t' || line[content - 1] == '\r')) content--;
+    scan.scanned = end;
+    scan.content = content;
+}
+
+// scan byte by byte from scan.scanned until the '\n', or until a sequence boundary
+// at or past stop
+Step scan_bytes(const unsigned char *line, size_t length, size_t stop, LineScan &scan) {
+    size_t i = scan.scanned;
+    while (i < stop) {
+        if (stop - i >= 8) {
+            // eight bytes at a time over ASCII without a '\n': a byte of newlines is
+            // zero where word has a '\n', and subtracting one from each byte sets the
+            // high bit of the first zero byte, and of no byte before it
+            uint64_t word, newlines;
+            memcpy(&word, line + i, 8);
+            newlines = word ^ 0x0A0A0A0A0A0A0A0Aull;
+            uint64_t marks = (word | ((newlines - 0x0101010101010101ull) & ~newlines)) & 0x8080808080808080ull;
+            if (marks == 0) {
+                i += 8;
+                continue;
+            }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            i += __builtin_ctzll(marks) / 8;
+#else
+            i += __builtin_clzll(marks) / 8;
+#endif
+        }
+        unsigned char c = line[i];
+        if (c < 0x80) {
+            if (c == '\n') {
+                found_at(line, i, scan);
+                return Step::Found;
+            }
+            i++;
+            continue;
+        }
+        size_t size = sequence_length(line + i, length - i);
+        if (size > length - i) {
+            scan.scanned = i;
+            return Step::CutOff;
+        }
+        if (size == 0) {
+            scan.valid = false;
+            size = 1;
+        }
+        i += size;
+    }
+    scan.scanned = i;
+    return Step::Stopped;
+}
+
+bool scan_line_scalar(const char *line, size_t length, LineScan &scan) {
+    return scan_bytes(reinterpret_cast<const unsigned char*>(line), length, length, scan) == Step::Found;
+}
+
+#ifdef TEXT_SCAN_X86
+
+// The vector kernels start where all sequences before are complete, as if preceded
+// by ASCII, which is where a scan that stops leaves scan.scanned. They move on a
+// whole block at a time: each block is checked together with the last three bytes
+// of the one before, and errors are only gathered in a register, so no block waits
+// for the outcome of the last one. A run of ASCII without a '\n' is skipped four
+// blocks to a test. The last block is loaded so that it ends with the data,
+// overlapping bytes already scanned, which are masked out; a line shorter than a
+// block, or a rest a little longer than one once a kernel stepped back to a sequence
+// its last block cut off, goes to the next kernel down.
+
+// 32 zero bytes and 32 0xFF bytes: a load at 32 - n has n leading zeros
+alignas(64) const unsigned char zeros_then_ones[64] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+// UTF-8 validation after Keiser and Lemire, "Validating UTF-8 in less than one
+// instruction per byte": every error shows in the high nibble of a byte and the two
+// nibbles of the byte before it, looked up in three tables whose entries are bit
+// sets of the errors each nibble allows; an error is a bit set in all three. The
+// one pair this cannot judge, a continuation after a continuation, is right exactly
+// where the byte two or three back is a lead of a sequence that long.
+#define TOO_SHORT (1 << 0)        // a lead or ASCII where a continuation belongs
+#define TOO_LONG (1 << 1)         // a continuation after ASCII
+#define OVERLONG_3 (1 << 2)       // E0 80..9F
+#define TOO_LARGE (1 << 3)        // F4 90..BF, F5..FF
+#define SURROGATE (1 << 4)        // ED A0..BF
+#define OVERLONG_2 (1 << 5)       // C0, C1
+#define TOO_LARGE_1000 (1 << 6)   // F5..FF 80..8F
+#define OVERLONG_4 (1 << 6)       // F0 80..8F
+#define TWO_CONTS (1 << 7)        // a continuation after a continuation
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+alignas(16) const unsigned char byte_1_high_table[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+alignas(16) const unsigned char byte_1_low_table[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+alignas(16) const unsigned char byte_2_high_table[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// a lead in the last three bytes of a block whose sequence goes on past it is above
+// these; 0xFF elsewhere. 16-byte blocks use the second half
+alignas(32) const unsigned char incomplete_above[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+
+__attribute__((target("ssse3"), always_inline))
+inline __m128i lookup(const unsigned char *table, __m128i nibbles) {
+    return _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table)), nibbles);
+}
+
+// nonzero where block, following previous, is not well-formed UTF-8; a sequence cut
+// off by the end of block is not an error yet, the next block or incomplete() tells
+__attribute__((target("ssse3"), always_inline))
+inline __m128i utf8_errors(__m128i block, __m128i previous) {
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    // the bytes one, two and three back, into previous
+    __m128i prev1 = _mm_alignr_epi8(block, previous, 15);
+    __m128i prev2 = _mm_alignr_epi8(block, previous, 14);
+    __m128i prev3 = _mm_alignr_epi8(block, previous, 13);
+
+    __m128i byte_1_high = lookup(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    __m128i byte_1_low = lookup(byte_1_low_table, _mm_and_si128(prev1, low_nibble));
+    __m128i byte_2_high = lookup(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(block, 4), low_nibble));
+    __m128i errors = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+    return _mm_xor_si128(errors, must_continue);
+}
+
+// nonzero where a lead byte at the end of block starts a sequence the block cuts off
+__attribute__((target("ssse3"), always_inline))
+inline __m128i incomplete(__m128i block) {
+    return _mm_subs_epu8(block, _mm_load_si128(reinterpret_cast<const __m128i*>(incomplete_above + 16)));
+}
+
+// a bit per byte of v that is not zero; SSSE3 has no test instruction
+__attribute__((target("ssse3"), always_inline))
+inline unsigned nonzero_bytes(__m128i v) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) ^ 0xFFFF;
+}
+
+// the errors of a line whose '\n' is at end of block: only the bytes before it
+// belong to the line, the rest turn to zeros; cut_off is incomplete(previous)
+__attribute__((target("ssse3"), always_inline))
+inline __m128i line_errors(__m128i block, __m128i previous, __m128i cut_off, unsigned end) {
+    if (!(_mm_movemask_epi8(block) & ((1u << end) - 1))) return cut_off;
+    __m128i after = _mm_loadu_si128(reinterpret_cast<const __m128i*>(zeros_then_ones + 32 - end));
+    return utf8_errors(_mm_andnot_si128(after, block), previous);
+}
+
+__attribute__((target("ssse3")))
+bool scan_line_ssse3(const char *line, size_t length, LineScan &scan) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(line);
+    if (length < 16) return scan_bytes(bytes, length, length, scan) == Step::Found;
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    size_t scanned = scan.scanned;
+    __m128i errors = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();   // ASCII before the first block
+    __m128i cut_off = _mm_setzero_si128();    // incomplete(previous)
+    while (length - scanned >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + scanned));
+        __m128i newline_bytes = _mm_cmpeq_epi8(block, newline);
+        if (!_mm_movemask_epi8(_mm_or_si128(newline_bytes, block))) {
+            // the common blocks: ASCII without a '\n', where nothing may be cut off
+            errors = _mm_or_si128(errors, cut_off);
+            cut_off = _mm_setzero_si128();
+            previous = _mm_setzero_si128();
+            // on from the next 16-byte boundary, so that no load splits a cache line
+            scanned += 16 - reinterpret_cast<uintptr_t>(bytes + scanned) % 16;
+            // a second such block makes a long run likely, the rest of it goes four
+            // blocks to a test. A byte xor '\n', less one with signed saturation, is
+            // negative just where it is not ASCII or is the '\n'
+            const __m128i one = _mm_set1_epi8(1);
+            if (length - scanned < 64) continue;
+            __m128i next = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + scanned)), newline);
+            if (_mm_movemask_epi8(_mm_subs_epi8(next, one))) continue;
+            scanned += 16;
+            while (length - scanned >= 64) {
+                const __m128i *blocks = reinterpret_cast<const __m128i*>(bytes + scanned);
+                __m128i marks = _mm_or_si128(
+                    _mm_or_si128(_mm_subs_epi8(_mm_xor_si128(_mm_loadu_si128(blocks), newline), one),
+                                 _mm_subs_epi8(_mm_xor_si128(_mm_loadu_si128(blocks + 1), newline), one)),
+                    _mm_or_si128(_mm_subs_epi8(_mm_xor_si128(_mm_loadu_si128(blocks + 2), newline), one),
+                                 _mm_subs_epi8(_mm_xor_si128(_mm_loadu_si128(blocks + 3), newline), one)));
+                if (_mm_movemask_epi8(marks)) {
+                    // on to the block that ends the run, which the loop above takes
+                    while (!_mm_movemask_epi8(_mm_subs_epi8(
+                        _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + scanned)), newline), one)))
+                        scanned += 16;
+                    break;
+                }
+                scanned += 64;
+            }
+            continue;
+        }
+        unsigned newlines = _mm_movemask_epi8(newline_bytes);
+        if (newlines) {
+            unsigned end = __builtin_ctz(newlines);
+            errors = _mm_or_si128(errors, line_errors(block, previous, cut_off, end));
+            scan.valid = scan.valid && !nonzero_bytes(errors);
+            found_at(bytes, scanned + end, scan);
+            return true;
+        }
+        errors = _mm_or_si128(errors, utf8_errors(block, previous));
+        cut_off = incomplete(block);
+        previous = block;
+        scanned += 16;
+    }
+    // a sequence the last block cut off is scanned again with the rest
+    if (unsigned cut = nonzero_bytes(cut_off)) scanned -= 16 - __builtin_ctz(cut);
+    scan.valid = scan.valid && !nonzero_bytes(errors);
+    scan.scanned = scanned;
+    if (scanned == length) return false;
+    // after stepping back the rest may be a little longer than a block
+    if (length - scanned > 16) return scan_bytes(bytes, length, length, scan) == Step::Found;
+
+    // the rest as a last block ending with the data, the bytes before it turned to
+    // zeros, which passes for ASCII before the first sequence
+    size_t base = length - 16;
+    __m128i before = _mm_loadu_si128(reinterpret_cast<const __m128i*>(zeros_then_ones + 32 - (scanned - base)));
+    __m128i block = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + base)), before);
+    unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    if (newlines) {
+        unsigned end = __builtin_ctz(newlines);
+        errors = line_errors(block, _mm_setzero_si128(), _mm_setzero_si128(), end);
+        scan.valid = scan.valid && !nonzero_bytes(errors);
+        found_at(bytes, base + end, scan);
+        return true;
+    }
+    scan.valid = scan.valid && !nonzero_bytes(utf8_errors(block, _mm_setzero_si128()));
+    // the table takes any byte from 0xC0 up for a lead, only a sequence that is cut
+    // off for real stops the scan
+    unsigned cut = nonzero_bytes(incomplete(block));
+    size_t lead = cut ? base + __builtin_ctz(cut) : length;
+    if (lead < length && sequence_length(bytes + lead, length - lead) == 0) {
+        scan.valid = false;
+        lead = length;
+    }
+    scan.scanned = lead;
+    return false;
+}
+
+// the same for 32-byte blocks; each lane looks up in its own copy of the table
+__attribute__((target("avx2"), always_inline))
+inline __m256i lookup(const unsigned char *table, __m256i nibbles) {
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table))),
+                               nibbles);
+}
+
+__attribute__((target("avx2"), always_inline))
+inline __m256i utf8_errors(__m256i block, __m256i previous) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    // the bytes one, two and three back, across the lane boundary and into previous
+    __m256i shifted = _mm256_permute2x128_si256(previous, block, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(block, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(block, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(block, shifted, 13);
+
+    __m256i byte_1_high = lookup(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = lookup(byte_1_low_table, _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = lookup(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(block, 4), low_nibble));
+    __m256i errors = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+    return _mm256_xor_si256(errors, must_continue);
+}
+
+__attribute__((target("avx2"), always_inline))
+inline __m256i incomplete(__m256i block) {
+    return _mm256_subs_epu8(block, _mm256_load_si256(reinterpret_cast<const __m256i*>(incomplete_above)));
+}
+
+__attribute__((target("avx2"), always_inline))
+inline __m256i line_errors(__m256i block, __m256i previous, __m256i cut_off, unsigned end) {
+    if (!(static_cast<uint32_t>(_mm256_movemask_epi8(block)) & ((uint32_t(1) << end) - 1))) return cut_off;
+    __m256i after = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(zeros_then_ones + 32 - end));
+    return utf8_errors(_mm256_andnot_si256(after, block), previous);
+}
+
+__attribute__((target("avx2")))
+bool scan_line_avx2(const char *line, size_t length, LineScan &scan) {
+    if (length < 32) return scan_line_ssse3(line, length, scan);
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(line);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i high_bit = _mm256_set1_epi8(static_cast<char>(0x80));
+
+    size_t scanned = scan.scanned;
+    __m256i errors = _mm256_setzero_si256();
+    __m256i previous = _mm256_setzero_si256();   // ASCII before the first block
+    __m256i cut_off = _mm256_setzero_si256();    // incomplete(previous)
+    while (length - scanned >= 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + scanned));
+        __m256i newline_bytes = _mm256_cmpeq_epi8(block, newline);
+        if (_mm256_testz_si256(_mm256_or_si256(newline_bytes, block), high_bit)) {
+            // the common blocks: ASCII without a '\n', where nothing may be cut off
+            errors = _mm256_or_si256(errors, cut_off);
+            cut_off = _mm256_setzero_si256();
+            previous = _mm256_setzero_si256();
+            // on from the next 32-byte boundary, so that no load splits a cache line
+            scanned += 32 - reinterpret_cast<uintptr_t>(bytes + scanned) % 32;
+            // a second such block makes a long run likely, the rest of it goes four
+            // blocks to a test. A byte xor '\n' is above zero as a signed byte just
+            // where it is ASCII but not the '\n', so one minimum tells for four blocks
+            const __m256i one = _mm256_set1_epi8(1);
+            if (length - scanned < 128) continue;
+            __m256i next = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + scanned)), newline);
+            if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(one, next))) continue;
+            scanned += 32;
+            while (length - scanned >= 128) {
+                const __m256i *blocks = reinterpret_cast<const __m256i*>(bytes + scanned);
+                __m256i lowest = _mm256_min_epi8(
+                    _mm256_min_epi8(_mm256_xor_si256(_mm256_loadu_si256(blocks), newline),
+                                    _mm256_xor_si256(_mm256_loadu_si256(blocks + 1), newline)),
+                    _mm256_min_epi8(_mm256_xor_si256(_mm256_loadu_si256(blocks + 2), newline),
+                                    _mm256_xor_si256(_mm256_loadu_si256(blocks + 3), newline)));
+                if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(one, lowest))) {
+                    // on to the block that ends the run, which the loop above takes
+                    while (!_mm256_movemask_epi8(_mm256_cmpgt_epi8(
+                        one, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + scanned)), newline))))
+                        scanned += 32;
+                    break;
+                }
+                scanned += 128;
+            }
+            continue;
+        }
+        uint32_t newlines = static_cast<uint32_t>(_mm256_movemask_epi8(newline_bytes));
+        if (newlines) {
+            unsigned end = __builtin_ctz(newlines);
+            errors = _mm256_or_si256(errors, line_errors(block, previous, cut_off, end));
+            scan.valid = scan.valid && _mm256_testz_si256(errors, errors);
+            found_at(bytes, scanned + end, scan);
+            _mm256_zeroupper();
+            return true;
+        }
+        errors = _mm256_or_si256(errors, utf8_errors(block, previous));
+        cut_off = incomplete(block);
+        previous = block;
+        scanned += 32;
+    }
+    // a sequence the last block cut off is scanned again with the rest
+    uint32_t cut = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(cut_off, _mm256_setzero_si256())));
+    if (cut) scanned -= 32 - __builtin_ctz(cut);
+    scan.valid = scan.valid && _mm256_testz_si256(errors, errors);
+    scan.scanned = scanned;
+    if (scanned == length) {
+        _mm256_zeroupper();
+        return false;
+    }
+    if (length - scanned > 32) {
+        // the SSSE3 kernel is not VEX-encoded, it runs at full speed only with the
+        // upper halves of the registers cleared
+        _mm256_zeroupper();
+        return scan_line_ssse3(line, length, scan);
+    }
+
+    // the rest as a last block ending with the data, as in the SSSE3 kernel
+    size_t base = length - 32;
+    __m256i before = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(zeros_then_ones + 32 - (scanned - base)));
+    __m256i block = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + base)), before);
+    uint32_t newlines = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+    if (newlines) {
+        unsigned end = __builtin_ctz(newlines);
+        errors = line_errors(block, _mm256_setzero_si256(), _mm256_setzero_si256(), end);
+        scan.valid = scan.valid && _mm256_testz_si256(errors, errors);
+        found_at(bytes, base + end, scan);
+        _mm256_zeroupper();
+        return true;
+    }
+    errors = utf8_errors(block, _mm256_setzero_si256());
+    scan.valid = scan.valid && _mm256_testz_si256(errors, errors);
+    cut = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(incomplete(block), _mm256_setzero_si256())));
+    _mm256_zeroupper();
+    size_t lead = cut ? base + __builtin_ctz(cut) : length;
+    if (lead < length && sequence_length(bytes + lead, length - lead) == 0) {
+        scan.valid = false;
+        lead = length;
+    }
+    scan.scanned = lead;
+    return false;
+}
+
+#endif
+
+struct Kernel {
+    const char *name;
+    bool (*scan)(const char*, size_t, LineScan&);
+};
+
+const Kernel kernels[] = {
+#ifdef TEXT_SCAN_X86
+    {"avx2", scan_line_avx2},
+    {"ssse3", scan_line_ssse3},
+#endif
+    {"scalar", scan_line_scalar},
+};
+
+bool supported(const Kernel &kernel) {
+#ifdef TEXT_SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(kernel.name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(kernel.name, "ssse3") == 0) return __builtin_cpu_supports("ssse3");
+#endif
+    return true;
+}
+
+// the first kernel of the list the CPU runs, the scalar one always does
+const Kernel *best_kernel() {
+    for (const Kernel &kernel : kernels) {
+        if (supported(kernel)) return &kernel;
+    }
+    return nullptr;
+}
+
+const Kernel *kernel = best_kernel();
+
+}  // namespace
+
+bool scan_line(const char *line, size_t length, LineScan &scan) {
+    return kernel->scan(line, length, scan);
+}
+
+bool valid_utf8(const char *data, size_t length) {
+    LineScan scan;
+    while (scan_line(data, length, scan)) {
+        if (!scan.valid) return false;
+        data += scan.scanned + 1;
+        length -= scan.scanned + 1;
+        scan = LineScan();
+    }
+    return scan.valid && scan.scanned == length;
+}
+
+const char *text_scan_kernel() {
+    return kernel->name;
+}
+
+bool use_text_scan_kernel(const char *name) {
+    for (const Kernel &candidate : kernels) {
+        if (strcmp(candidate.name, name) == 0 && supported(candidate)) {
+            kernel = &candidate;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,37 @@
+#ifndef TEXT_SCAN_H
+#define TEXT_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Scanning of received text: one pass over a line finds the '\n' that ends it, the
+// trailing whitespace to trim and whether it is well-formed UTF-8, so a line is read
+// once instead of once per question. The AVX2 kernel checks 32 bytes at a time and
+// the SSSE3 kernel 16, ASCII and UTF-8 alike; the scalar fallback skips ASCII 8 bytes
+// at a time and checks anything else byte by byte. The best kernel the CPU has is
+// picked at startup.
+
+// how far a line has been scanned, carried over while the rest of it arrives; every
+// connection holds one, so offsets are 32 bits and a line is below 4 GiB
+struct LineScan {
+    uint32_t scanned = 0;   // bytes looked at, always whole UTF-8 sequences
+    uint32_t content = 0;   // once found, the length without trailing ' ', '\t' and '\r'
+    bool valid = true;      // false once a byte is not part of well-formed UTF-8
+};
+
+// scan line, of which length bytes have arrived, from scan.scanned on for its '\n'.
+// True once found, scan.scanned is then the length of the line without it; otherwise
+// scanned stops at length, or at the start of a UTF-8 sequence length cut off
+bool scan_line(const char *line, size_t length, LineScan &scan);
+
+// whether data is well-formed UTF-8: no overlong forms, surrogates, code points
+// above U+10FFFF or sequences cut off at the end
+bool valid_utf8(const char *data, size_t length);
+
+// name of the kernel in use: "avx2", "ssse3" or "scalar"
+const char *text_scan_kernel();
+
+// use the kernel called name from now on, for benchmarks; false if the CPU lacks it
+bool use_text_scan_kernel(const char *name);
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define TIMING_WHEEL_BITS 6                             // slots per level: 64
+#define TIMING_WHEEL_SLOTS (1u << TIMING_WHEEL_BITS)
+#define TIMING_WHEEL_LEVELS 4                           // 2^24 ticks ahead before a timer is parked
+
+// A timer of a TimingWheel. Meant as a base of the object it times, so that the
+// expiry callback can cast back to it; linked into one slot while scheduled.
+struct WheelTimer {
+    WheelTimer *next = nullptr;
+    WheelTimer **link = nullptr;   // the pointer to this timer in its slot, nullptr unless scheduled
+    uint64_t due = 0;              // tick it expires in
+
+    bool scheduled() const { return link != nullptr; }
+};
+
+// Hashed hierarchical timing wheel: scheduling, rescheduling and cancelling a timer
+// are O(1), and turning the wheel only touches the slots that hold timers.
+//
+// Level 0 has a slot for each of the next 64 ticks, every level above a slot for
+// each 64 slots of the level below. A timer goes into the lowest level whose span
+// covers its delay, and moves down when the wheel reaches its slot, so it is
+// relinked at most once per level before it expires; one further out than the top
+// level reaches is parked in its last slot and placed again from there. Deadlines
+// are rounded up to whole ticks: a timer never expires early, and at most a tick
+// late. Occupancy bitmaps per level find the next slot with work without a scan.
+class TimingWheel {
+public:
+    TimingWheel(uint64_t tick_ns, uint64_t now_ns) : tick_ns_(tick_ns), now_(now_ns / tick_ns) {}
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel &operator=(const TimingWheel&) = delete;
+
+    size_t size() const { return size_; }
+
+    // expire timer at deadline_ns, replacing the deadline it had; one already
+    // passed expires the next time the wheel turns
+    void schedule(WheelTimer &timer, uint64_t deadline_ns) {
+        cancel(timer);
+        uint64_t due = (deadline_ns + tick_ns_ - 1) / tick_ns_;
+        timer.due = due > now_ ? due : now_ + 1;
+        place(timer);
+        size_++;
+    }
+
+    void cancel(WheelTimer &timer) {
+        if (!timer.link) return;
+        *timer.link = timer.next;
+        if (timer.next) timer.next->link = timer.link;
+        timer.next = nullptr;
+        timer.link = nullptr;
+        size_--;
+    }
+
+    // when a scheduled timer expires, its deadline rounded up to the tick
+    uint64_t deadline(const WheelTimer &timer) const { return timer.due * tick_ns_; }
+
+    // turn the wheel to now_ns and call expired(timer) for every timer due by then,
+    // tick by tick; each is unscheduled first, so the callback may schedule it again
+    // or cancel any other timer
+    template <typename F>
+    void advance(uint64_t now_ns, F &&expired) {
+        uint64_t target = now_ns / tick_ns_;
+        while (now_ < target) {
+            uint64_t next = next_tick();
+            if (next > target) {
+                now_ = target;
+                break;
+            }
+            now_ = next;
+            // slots of the upper levels reached in this tick move down first, some
+            // of their timers may be due right now
+            int top = 0;
+            while (top + 1 < TIMING_WHEEL_LEVELS && (now_ & span(top + 1)) == 0) top++;
+            for (int level = top; level > 0; level--) cascade(level);
+
+            size_t slot = now_ & (TIMING_WHEEL_SLOTS - 1);
+            while (WheelTimer *timer = slots_[0][slot]) {
+                cancel(*timer);
+                expired(*timer);
+            }
+            occupied_[0] &= ~(uint64_t(1) << slot);
+        }
+    }
+
+    // ns from now_ns until the wheel has work, a timer to expire or move down; -1
+    // while no timer is scheduled
+    int64_t next_timeout(uint64_t now_ns) {
+        if (size_ == 0) return -1;
+        uint64_t deadline = next_tick() * tick_ns_;
+        return deadline > now_ns ? static_cast<int64_t>(deadline - now_ns) : 0;
+    }
+
+private:
+    // the bits of a tick below the slot index of level
+    static uint64_t span(int level) { return (uint64_t(1) << (TIMING_WHEEL_BITS * level)) - 1; }
+
+    void place(WheelTimer &timer) {
+        uint64_t delta = timer.due - now_;
+        uint64_t tick = timer.due;
+        int level = 0;
+        while (level + 1 < TIMING_WHEEL_LEVELS && delta > span(level + 1)) level++;
+        if (delta > span(TIMING_WHEEL_LEVELS)) tick = now_ + span(TIMING_WHEEL_LEVELS);  // parked
+        size_t slot = (tick >> (TIMING_WHEEL_BITS * level)) & (TIMING_WHEEL_SLOTS - 1);
+        WheelTimer *&head = slots_[level][slot];
+        timer.next = head;
+        if (head) head->link = &timer.next;
+        head = &timer;
+        timer.link = &head;
+        occupied_[level] |= uint64_t(1) << slot;
+    }
+
+    // relink the timers of the level's slot the wheel just reached into the levels below
+    void cascade(int level) {
+        size_t slot = (now_ >> (TIMING_WHEEL_BITS * level)) & (TIMING_WHEEL_SLOTS - 1);
+        WheelTimer *timer = slots_[level][slot];
+        slots_[level][slot] = nullptr;
+        occupied_[level] &= ~(uint64_t(1) << slot);
+        while (timer) {
+            WheelTimer *next = timer->next;
+            place(*timer);
+            timer = next;
+        }
+    }
+
+    // the first tick after now_ in which a slot holding timers is reached, UINT64_MAX if
+    // none; a slot emptied by cancel() keeps its bit until it is found empty here
+    uint64_t next_tick() {
+        uint64_t next = UINT64_MAX;
+        for (int level = 0; level < TIMING_WHEEL_LEVELS; level++) {
+            unsigned shift = TIMING_WHEEL_BITS * level;
+            uint64_t position = now_ >> shift;
+            while (occupied_[level]) {
+                // slot (position + k) % 64 is reached in tick (position + k) << shift, k in 1..64
+                unsigned start = (position + 1) & (TIMING_WHEEL_SLOTS - 1);
+                uint64_t bits = occupied_[level];
+                uint64_t rotated = start ? (bits >> start) | (bits << (TIMING_WHEEL_SLOTS - start)) : bits;
+                unsigned k = __builtin_ctzll(rotated) + 1;
+                size_t slot = (position + k) & (TIMING_WHEEL_SLOTS - 1);
+                if (!slots_[level][slot]) {
+                    occupied_[level] &= ~(uint64_t(1) << slot);
+                    continue;
+                }
+                uint64_t tick = (position + k) << shift;
+                if (tick < next) next = tick;
+                break;
+            }
+        }
+        return next;
+    }
+
+    uint64_t tick_ns_;
+    uint64_t now_;            // the last tick the wheel was turned to
+    size_t size_ = 0;         // timers scheduled
+    WheelTimer *slots_[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS] = {};
+    uint64_t occupied_[TIMING_WHEEL_LEVELS] = {};
+};
+
+#endif
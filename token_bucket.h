@@ -0,0 +1,40 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <cstdint>
+
+// rate of a token bucket: tokens added per second, and the most it holds; a rate
+// of 0 means unlimited
+struct RateLimit {
+    double rate = 0;
+    double burst = 0;
+};
+
+// Token bucket of one client. It starts full, refills continuously at the limit's
+// rate up to its burst, and an operation costing more than what is left is refused
+// without spending anything; one costing more than the whole burst needs a full
+// bucket and empties it. The limit is passed in so every client shares one.
+class TokenBucket {
+public:
+    // spend cost tokens at now_ns, or refuse; the first call fills the bucket
+    bool take(const RateLimit &limit, double cost, uint64_t now_ns) {
+        if (limit.rate <= 0) return true;
+        if (refilled_ns_ == 0) {
+            tokens_ = limit.burst;
+        } else if (now_ns > refilled_ns_) {
+            tokens_ += (now_ns - refilled_ns_) * 1e-9 * limit.rate;
+            if (tokens_ > limit.burst) tokens_ = limit.burst;
+        }
+        refilled_ns_ = now_ns;
+        if (cost > limit.burst) cost = limit.burst;
+        if (tokens_ < cost) return false;
+        tokens_ -= cost;
+        return true;
+    }
+
+private:
+    double tokens_ = 0;
+    uint64_t refilled_ns_ = 0;
+};
+
+#endif
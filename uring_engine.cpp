@@ -0,0 +1,457 @@
+#include "io_engine.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "logger.h"
+
+#define URING_ENTRIES 1024          // submission queue entries, the completion queue gets 4x
+#define URING_BUFFERS 512           // provided receive buffers, power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_TAG_ACCEPT 1          // user_data of the listener's multishot accept
+#define URING_TAG_WAKEUP 2          // user_data of the wakeup fd's multishot poll
+#define URING_OP_RECV 1             // low bits of a connection's user_data
+#define URING_OP_SEND 2
+#define URING_OP_MASK 7
+
+using namespace std;
+
+namespace {
+
+// per-connection bookkeeping, hung off IoConnection::io_state
+struct UringConnection {
+    int pending = 0;            // operations whose last completion has not arrived
+    bool receiving = false;     // a multishot recv is armed
+    bool sending = false;
+    bool released = false;
+    char *send_state = nullptr; // msghdr and iovec array of the send in flight, from the object pool
+    size_t send_size = 0;
+
+    static void *operator new(size_t size) { return object_pool_allocate(size); }
+    static void operator delete(void *object, size_t size) { object_pool_deallocate(object, size); }
+};
+
+int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size));
+}
+
+int uring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// multishot recv, the newest feature used, arrived in Linux 6.0
+bool kernel_supported() {
+    struct utsname name;
+    int major = 0;
+    if (uname(&name) < 0 || sscanf(name.release, "%d.", &major) != 1) return false;
+    return major >= 6;
+}
+
+class UringEngine : public IoEngine {
+public:
+    explicit UringEngine(IoHandler &handler) : handler_(handler) {}
+
+    ~UringEngine() override {
+        if (buffers_) munmap(buffers_, URING_BUFFERS * URING_BUFFER_SIZE);
+        if (buffer_ring_) munmap(buffer_ring_, URING_BUFFERS * sizeof(struct io_uring_buf));
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (ring_) munmap(ring_, ring_size_);
+        if (ring_fd_ >= 0) close(ring_fd_);
+    }
+
+    // map the rings and register the receive buffers; false if anything is missing
+    bool init() {
+        struct io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring_fd_ = uring_setup(URING_ENTRIES, &params);
+        if (ring_fd_ < 0 && errno == EINVAL) {
+            // the task-run flags are newer than the rest, they are only an optimization
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = URING_ENTRIES * 4;
+            ring_fd_ = uring_setup(URING_ENTRIES, &params);
+        }
+        if (ring_fd_ < 0) return false;
+        unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) return false;
+
+        // the submission and completion rings share one mapping
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        ring_size_ = sq_size > cq_size ? sq_size : cq_size;
+        void *ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) return false;
+        ring_ = static_cast<char*>(ring);
+
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+        sq_head_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(ring_ + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        unsigned *sq_array = reinterpret_cast<unsigned*>(ring_ + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; i++) sq_array[i] = i;  // entry i always lives in slot i
+        sqe_tail_ = *sq_tail_;
+
+        cq_head_ = reinterpret_cast<unsigned*>(ring_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(ring_ + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(ring_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe*>(ring_ + params.cq_off.cqes);
+
+        // received data lands in these buffers, each handed back right after it is copied out
+        void *buffer_ring = mmap(nullptr, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *buffers = mmap(nullptr, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer_ring == MAP_FAILED || buffers == MAP_FAILED) return false;
+        buffer_ring_ = static_cast<struct io_uring_buf_ring*>(buffer_ring);
+        buffers_ = static_cast<char*>(buffers);
+
+        struct io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = URING_BUFFER_GROUP;
+        if (uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+        for (unsigned i = 0; i < URING_BUFFERS; i++) recycle_buffer(i);
+        return true;
+    }
+
+    const char *name() const override { return "io_uring"; }
+
+    bool asynchronous() const override { return true; }
+
+    bool add_listener(int fd) override {
+        listen_fd_ = fd;
+        arm_accept();
+        return true;
+    }
+
+    void remove_listener() override {
+        listen_fd_ = -1;
+        cancel(URING_TAG_ACCEPT);
+        submit();
+    }
+
+    bool add_wakeup(int fd) override {
+        wakeup_fd_ = fd;
+        arm_wakeup();
+        return true;
+    }
+
+    bool add_connection(IoConnection *conn) override {
+        conn->io_state = new UringConnection;
+        conn->paused = false;
+        arm_recv(conn);
+        return true;
+    }
+
+    // the recv is cancelled; what it already received completes before the cancellation
+    void pause(IoConnection *conn) override {
+        auto *state = static_cast<UringConnection*>(conn->io_state);
+        conn->paused = true;
+        if (state->receiving) cancel(reinterpret_cast<uint64_t>(conn) | URING_OP_RECV);
+    }
+
+    // a recv still waiting for its cancellation is simply re-armed once that arrives
+    void resume(IoConnection *conn) override {
+        auto *state = static_cast<UringConnection*>(conn->io_state);
+        conn->paused = false;
+        if (!state->receiving && !state->released) arm_recv(conn);
+    }
+
+    bool release(IoConnection *conn) override {
+        auto *state = static_cast<UringConnection*>(conn->io_state);
+        state->released = true;
+        if (state->pending == 0) {
+            delete state;
+            conn->io_state = nullptr;
+            return true;
+        }
+
+        // cancel by user_data, which stays unique while the fd number may be reused
+        cancel(reinterpret_cast<uint64_t>(conn) | URING_OP_RECV);
+        if (state->sending) cancel(reinterpret_cast<uint64_t>(conn) | URING_OP_SEND);
+        // submit now: operations still queued for this socket must reach the kernel
+        // before the caller closes the fd and the number is handed out again
+        submit();
+        return false;
+    }
+
+    ssize_t send(IoConnection *conn, const struct iovec *iov, int count, int flags) override {
+        auto *state = static_cast<UringConnection*>(conn->io_state);
+        if (state->sending) {
+            errno = EBUSY;
+            return -1;
+        }
+        // the kernel reads both until the send completes, only then they go back to the pool
+        state->send_size = sizeof(struct msghdr) + count * sizeof(struct iovec);
+        state->send_state = static_cast<char*>(object_pool_allocate(state->send_size));
+        auto *msg = new (state->send_state) msghdr{};
+        auto *iovecs = reinterpret_cast<struct iovec*>(state->send_state + sizeof(struct msghdr));
+        memcpy(iovecs, iov, count * sizeof(struct iovec));
+        msg->msg_iov = iovecs;
+        msg->msg_iovlen = count;
+        state->sending = true;
+        state->pending++;
+
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->sockfd;
+        sqe->addr = reinterpret_cast<uint64_t>(msg);
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = reinterpret_cast<uint64_t>(conn) | URING_OP_SEND;
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    void submit() override {
+        unsigned count;
+        while ((count = publish()) > 0) {
+            if (uring_enter(ring_fd_, count, 0, 0, nullptr, 0) < 0 && errno != EINTR) {
+                LOG_ERROR("error: io_uring submit failed: %s\n", strerror(errno));
+                return;
+            }
+        }
+    }
+
+    int poll(int timeout_ms) override {
+        unsigned count = publish();
+        bool ready = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) != *cq_head_;
+
+        // one syscall submits the whole tick's operations and waits for completions
+        struct __kernel_timespec ts{};
+        struct io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout_ms >= 0 || ready) {
+            int wait = ready ? 0 : timeout_ms;
+            ts.tv_sec = wait / 1000;
+            ts.tv_nsec = (wait % 1000) * 1000000ll;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+        int result = uring_enter(ring_fd_, count, ready ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                 &arg, sizeof(arg));
+        if (result < 0 && errno != ETIME && errno != EBUSY) {
+            if (errno == EINTR) return -1;
+            LOG_ERROR("error: io_uring_enter failed: %s\n", strerror(errno));
+            return -1;
+        }
+        return reap_completions();
+    }
+
+private:
+    // publish the prepared entries; returns how many the kernel has not consumed yet
+    unsigned publish() {
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        return sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+    // a cleared submission entry, submitting what is queued when the ring is full
+    struct io_uring_sqe *next_sqe() {
+        while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            submit();
+        }
+        struct io_uring_sqe *sqe = &sqes_[sqe_tail_ & sq_mask_];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe_tail_++;
+        return sqe;
+    }
+
+    void arm_accept() {
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd_;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = URING_TAG_ACCEPT;
+    }
+
+    void arm_wakeup() {
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wakeup_fd_;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = URING_TAG_WAKEUP;
+    }
+
+    void arm_recv(IoConnection *conn) {
+        auto *state = static_cast<UringConnection*>(conn->io_state);
+        state->pending++;
+        state->receiving = true;
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->sockfd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = reinterpret_cast<uint64_t>(conn) | URING_OP_RECV;
+    }
+
+    void cancel(uint64_t user_data) {
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = 0;
+    }
+
+    void recycle_buffer(unsigned id) {
+        // indexed by hand: in C++ the header's flexible array member does not start at offset 0
+        struct io_uring_buf &buffer = reinterpret_cast<struct io_uring_buf*>(buffer_ring_)[buffer_tail_ & (URING_BUFFERS - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(buffers_ + static_cast<size_t>(id) * URING_BUFFER_SIZE);
+        buffer.len = URING_BUFFER_SIZE;
+        buffer.bid = static_cast<uint16_t>(id);
+        buffer_tail_++;
+        __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+    // copy a received chunk into the connection's own buffer
+    void deliver(IoConnection *conn, const char *data, size_t length) {
+        while (length > 0) {
+            size_t space;
+            char *buffer = handler_.read_buffer(conn, space);
+            if (!buffer) return;
+            size_t chunk = length < space ? length : space;
+            memcpy(buffer, data, chunk);
+            handler_.on_read(conn, chunk);
+            data += chunk;
+            length -= chunk;
+        }
+    }
+
+    int reap_completions() {
+        int handled = 0;
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = cqes_[head & cq_mask_];
+            head++;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            handled++;
+            dispatch(cqe);
+        }
+        return handled;
+    }
+
+    void dispatch(const struct io_uring_cqe &cqe) {
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (cqe.user_data == 0) return;  // cancel requests
+        if (cqe.user_data == URING_TAG_ACCEPT) {
+            if (cqe.res >= 0) {
+                struct sockaddr_in address{};
+                socklen_t length = sizeof(address);
+                getpeername(cqe.res, (struct sockaddr*)&address, &length);
+                handler_.on_accept(cqe.res, address);
+            } else if (cqe.res != -ECANCELED) {
+                LOG_ERROR("error: accept failed: %s\n", strerror(-cqe.res));
+            }
+            if (!more && listen_fd_ >= 0) arm_accept();
+            return;
+        }
+        if (cqe.user_data == URING_TAG_WAKEUP) {
+            handler_.on_wakeup();
+            if (!more) arm_wakeup();
+            return;
+        }
+
+        auto *conn = reinterpret_cast<IoConnection*>(cqe.user_data & ~static_cast<uint64_t>(URING_OP_MASK));
+        auto *state = static_cast<UringConnection*>(conn->io_state);
+        if (!more) state->pending--;
+
+        if ((cqe.user_data & URING_OP_MASK) == URING_OP_RECV) {
+            if (!more) state->receiving = false;
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                // taken off the socket already, so it goes to the handler even after release()
+                if (cqe.res > 0) deliver(conn, buffers_ + static_cast<size_t>(id) * URING_BUFFER_SIZE, cqe.res);
+                recycle_buffer(id);
+            }
+            if (!state->released) {
+                if (cqe.res == 0) {
+                    handler_.on_read(conn, 0);
+                } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+                    handler_.on_error(conn, -cqe.res);
+                } else if (!more && !conn->paused) {
+                    arm_recv(conn);  // the multishot recv ran out of buffers, stopped or was paused
+                }
+            }
+        } else {
+            state->sending = false;
+            object_pool_deallocate(state->send_state, state->send_size);
+            state->send_state = nullptr;
+            if (!state->released) {
+                if (cqe.res >= 0) {
+                    handler_.on_writable(conn, cqe.res);
+                } else {
+                    handler_.on_error(conn, -cqe.res);
+                }
+            }
+        }
+
+        if (state->released && state->pending == 0) {
+            delete state;
+            conn->io_state = nullptr;
+            handler_.on_released(conn);
+        }
+    }
+
+    IoHandler &handler_;
+    int ring_fd_ = -1;
+    int listen_fd_ = -1;
+    int wakeup_fd_ = -1;
+
+    char *ring_ = nullptr;
+    size_t ring_size_ = 0;
+    struct io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sqe_tail_ = 0;          // entries prepared, published with the next submit
+
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    struct io_uring_cqe *cqes_ = nullptr;
+
+    struct io_uring_buf_ring *buffer_ring_ = nullptr;
+    char *buffers_ = nullptr;
+    uint16_t buffer_tail_ = 0;
+};
+
+}  // namespace
+
+IoEngine *create_uring_engine(IoHandler &handler) {
+    if (!kernel_supported()) return nullptr;
+    auto *engine = new UringEngine(handler);
+    if (!engine->init()) {
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}